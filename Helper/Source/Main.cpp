@@ -0,0 +1,155 @@
+/*
+  ==============================================================================
+
+    Main.cpp
+    RiffusionHelper: runs Riffusion requests on behalf of the plugin, out of the
+    DAW's process. Launched and owned by HelperProcessConnection.
+
+  ==============================================================================
+*/
+
+#include <JuceHeader.h>
+#include "../../Source/CancellationToken.h"
+#include "../../Source/HelperProtocol.h"
+#include "../../Source/PerformanceTracer.h"
+#include "../../Source/RiffusionClient.h"
+#include "../../Source/SharedAudioRing.h"
+
+namespace {
+    // Matches GenerationService::kMaxConcurrentRequests, the most the plugin ever has in flight.
+    constexpr int kMaxConcurrentJobs = 2;
+    constexpr int kShutdownTimeoutMs = 5000;
+}  // namespace
+
+//==============================================================================
+class HelperWorker : public juce::ChildProcessWorker
+{
+public:
+    HelperWorker() : pool(kMaxConcurrentJobs)
+    {
+    }
+
+    ~HelperWorker() override
+    {
+        pool.removeAllJobs(true, kShutdownTimeoutMs);
+    }
+
+    void handleMessageFromCoordinator(const juce::MemoryBlock& data) override
+    {
+        juce::var message = juce::JSON::parse(data.toString());
+        juce::String type = message["type"].toString();
+        if (type == "init") {
+            ring = std::make_unique<SharedAudioRing>(juce::File(message["ring"].toString()),
+                static_cast<int>(message["capacity"]), false);
+        }
+        else if (type == "generate") {
+            auto token = std::make_shared<CancellationToken>();
+            {
+                const juce::ScopedLock scopedLock(lock);
+                tokens[static_cast<int>(message["job"])] = token;
+            }
+            // Don't block the connection thread, pings have to keep flowing.
+            pool.addJob([this, message, token]() { runJob(message, *token); });
+        }
+        else if (type == "cancel") {
+            const juce::ScopedLock scopedLock(lock);
+            auto it = tokens.find(static_cast<int>(message["job"]));
+            if (it != tokens.end()) {
+                it->second->cancel();
+            }
+        }
+    }
+
+    void handleConnectionLost() override
+    {
+        {
+            // Nobody is waiting for the results any more.
+            const juce::ScopedLock scopedLock(lock);
+            for (auto& [jobId, token] : tokens) {
+                token->cancel();
+            }
+        }
+        disconnected.signal();
+    }
+
+    void waitUntilDisconnected()
+    {
+        disconnected.wait(-1);
+    }
+
+private:
+    void runJob(const juce::var& request, CancellationToken& token)
+    {
+        PerformanceTracer tracer;
+        juce::DynamicObject::Ptr reply = new juce::DynamicObject();
+        reply->setProperty("type", "result");
+        reply->setProperty("job", request["job"]);
+
+        juce::String message;
+        bool success = false;
+        const int offset = request["offset"];
+        const int numSamples = request["numSamples"];
+        if (ring == nullptr || !ring->isValid()) {
+            message = "Helper has no shared memory.";
+        }
+        else if (offset < 0 || numSamples <= 0 || offset + numSamples > ring->getCapacity()) {
+            message = "Helper got a bad recording.";
+        }
+        else {
+            juce::AudioBuffer<float> audio(1, numSamples);
+            audio.copyFrom(0, 0, ring->getSamples(SharedAudioRing::Direction::ToHelper, offset), numSamples);
+            std::shared_ptr<juce::AudioBuffer<float>> result;
+            success = client.generate(request["server"].toString(), request["params"], audio,
+                static_cast<double>(request["sampleRate"]), &result, &message, tracer, nullptr, {}, &token);
+            if (success) {
+                const int resultOffset = ring->allocate(SharedAudioRing::Direction::FromHelper, result->getNumSamples());
+                if (resultOffset < 0) {
+                    success = false;
+                    message = "Generated audio is too long for the shared memory.";
+                }
+                else {
+                    juce::FloatVectorOperations::copy(ring->getSamples(SharedAudioRing::Direction::FromHelper, resultOffset),
+                        result->getReadPointer(0), result->getNumSamples());
+                    reply->setProperty("offset", resultOffset);
+                    reply->setProperty("numSamples", result->getNumSamples());
+                }
+            }
+        }
+        reply->setProperty("success", success);
+        reply->setProperty("message", message);
+        reply->setProperty("trace", juce::JSON::parse(tracer.toChromeTraceJson()));
+        {
+            const juce::ScopedLock scopedLock(lock);
+            tokens.erase(static_cast<int>(request["job"]));
+        }
+        if (token.isCancelled()) {
+            return;
+        }
+        juce::String text = juce::JSON::toString(juce::var(reply.get()), true);
+        sendMessageToCoordinator(juce::MemoryBlock(text.toRawUTF8(), text.getNumBytesAsUTF8()));
+    }
+
+    RiffusionClient client;
+    juce::ThreadPool pool;
+    juce::CriticalSection lock;
+    // Tokens of the jobs in the pool, by job id, so the plugin can cancel them.
+    std::map<int, std::shared_ptr<CancellationToken>> tokens;
+    std::unique_ptr<SharedAudioRing> ring;
+    juce::WaitableEvent disconnected;
+};
+
+//==============================================================================
+int main (int argc, char* argv[])
+{
+    juce::StringArray arguments;
+    for (int i = 1; i < argc; ++i) {
+        arguments.add(argv[i]);
+    }
+    HelperWorker worker;
+    if (!worker.initialiseFromCommandLine(arguments.joinIntoString(" "), HelperProtocol::kCommandLineUid)) {
+        // Not launched by the plugin.
+        return 1;
+    }
+    worker.waitUntilDisconnected();
+    return 0;
+}
@@ -0,0 +1,730 @@
+/*
+  ==============================================================================
+
+    Main.cpp
+    RiffusionMockServer: a stand-in for the Riffusion server that speaks the same
+    /run_vst/ and /jobs/ JSON, with synthetic audio and injectable faults.
+
+  ==============================================================================
+*/
+
+#include <JuceHeader.h>
+
+#include <atomic>
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+    constexpr int kDefaultPort = 3000;
+    constexpr int kDefaultThreads = 16;
+    // What the server does when a request doesn't say.
+    constexpr int kDefaultSteps = 50;
+    constexpr int kDefaultStepMs = 20;
+    // Anything bigger is refused, so a broken client can't eat the machine.
+    constexpr size_t kMaxHeaderBytes = 1 << 16;
+    constexpr juce::int64 kMaxBodyBytes = 64 << 20;
+    // A client that goes quiet for this long mid-request is dropped.
+    constexpr int kReadTimeoutMs = 30000;
+    // Jobs kept for polling and /result, oldest dropped first.
+    constexpr size_t kMaxJobs = 256;
+    // Bandwidth caps are applied in slices this long.
+    constexpr int kThrottleSliceMs = 20;
+    constexpr int kUnthrottledChunkBytes = 1 << 16;
+    constexpr int kShutdownTimeoutMs = 5000;
+
+    const char* const kUsage =
+        "Usage: RiffusionMockServer [options]\n"
+        "\n"
+        "  --port=<n>                 Port to listen on (default 3000).\n"
+        "  --host=<address>           Address to listen on (default 127.0.0.1, 0.0.0.0 for all).\n"
+        "  --threads=<n>              Connections handled at once (default 16).\n"
+        "  --step-ms=<ms>             Time per inference step (default 20). Generations run one\n"
+        "                             at a time, like on a single GPU.\n"
+        "  --no-jobs                  Answer /jobs/ with 404, like a server with only /run_vst/.\n"
+        "  --seed=<n>                 Seed for the fault draws (default 1).\n"
+        "  --quiet                    Don't log every request.\n"
+        "\n"
+        "Network:\n"
+        "  --latency-ms=<ms>          Added before every response.\n"
+        "  --jitter-ms=<ms>           Up to this much more, uniformly.\n"
+        "  --tail-ms=<ms>             This much more again, on --tail-rate of the responses.\n"
+        "  --tail-rate=<0..1>\n"
+        "  --bandwidth=<bytes/s>      Cap on what's sent back. Takes a k or m suffix.\n"
+        "  --upload-bandwidth=<bytes/s>  Cap on what's read from the client.\n"
+        "\n"
+        "Faults, each on the given fraction of requests:\n"
+        "  --error-rate=<0..1>        Answer with --error-status (default 500).\n"
+        "  --error-status=<code>\n"
+        "  --hang-rate=<0..1>         Read the request and never answer.\n"
+        "  --truncate-rate=<0..1>     Cut responses with audio off halfway.\n"
+        "  --bad-base64-rate=<0..1>   Corrupt the base64 of responses with audio.\n"
+        "  --fail-rate=<0..1>         Fail the generation (job status \"failed\", or a 500).\n";
+
+    struct Options
+    {
+        int port = kDefaultPort;
+        juce::String host = "127.0.0.1";
+        int numThreads = kDefaultThreads;
+        int stepMs = kDefaultStepMs;
+        bool noJobs = false;
+        juce::int64 seed = 1;
+        bool quiet = false;
+        int latencyMs = 0;
+        int jitterMs = 0;
+        int tailMs = 0;
+        double tailRate = 0.0;
+        // Bytes per second, 0 for no cap.
+        double bandwidth = 0.0;
+        double uploadBandwidth = 0.0;
+        double errorRate = 0.0;
+        int errorStatus = 500;
+        double hangRate = 0.0;
+        double truncateRate = 0.0;
+        double badBase64Rate = 0.0;
+        double failRate = 0.0;
+    };
+
+    // What happens to one request, drawn when it arrives.
+    struct Faults
+    {
+        int delayMs = 0;
+        bool error = false;
+        bool hang = false;
+        bool truncate = false;
+        bool badBase64 = false;
+        bool fail = false;
+
+        juce::String toString() const {
+            juce::StringArray names;
+            if (error) names.add("error");
+            if (hang) names.add("hang");
+            if (truncate) names.add("truncate");
+            if (badBase64) names.add("bad base64");
+            if (fail) names.add("fail");
+            return names.joinIntoString(", ");
+        }
+    };
+
+    // Takes plain bytes, or a k or m suffix.
+    double parseBytesPerSecond(const juce::String& text) {
+        const juce::String value = text.trim().toLowerCase();
+        double multiplier = 1.0;
+        if (value.endsWithChar('k')) {
+            multiplier = 1024.0;
+        }
+        else if (value.endsWithChar('m')) {
+            multiplier = 1024.0 * 1024.0;
+        }
+        return juce::jmax(0.0, value.getDoubleValue() * multiplier);
+    }
+
+    Options parseOptions(const juce::ArgumentList& args) {
+        Options options;
+        auto readOption = [&args](const char* name, auto apply) {
+            const juce::String value = args.getValueForOption(name);
+            if (value.isNotEmpty()) {
+                apply(value);
+            }
+        };
+        auto rate = [](const juce::String& value) { return juce::jlimit(0.0, 1.0, value.getDoubleValue()); };
+        readOption("--port", [&](const juce::String& v) { options.port = v.getIntValue(); });
+        readOption("--host", [&](const juce::String& v) { options.host = v; });
+        readOption("--threads", [&](const juce::String& v) { options.numThreads = juce::jmax(1, v.getIntValue()); });
+        readOption("--step-ms", [&](const juce::String& v) { options.stepMs = juce::jmax(0, v.getIntValue()); });
+        readOption("--seed", [&](const juce::String& v) { options.seed = v.getLargeIntValue(); });
+        readOption("--latency-ms", [&](const juce::String& v) { options.latencyMs = juce::jmax(0, v.getIntValue()); });
+        readOption("--jitter-ms", [&](const juce::String& v) { options.jitterMs = juce::jmax(0, v.getIntValue()); });
+        readOption("--tail-ms", [&](const juce::String& v) { options.tailMs = juce::jmax(0, v.getIntValue()); });
+        readOption("--tail-rate", [&](const juce::String& v) { options.tailRate = rate(v); });
+        readOption("--bandwidth", [&](const juce::String& v) { options.bandwidth = parseBytesPerSecond(v); });
+        readOption("--upload-bandwidth", [&](const juce::String& v) { options.uploadBandwidth = parseBytesPerSecond(v); });
+        readOption("--error-rate", [&](const juce::String& v) { options.errorRate = rate(v); });
+        readOption("--error-status", [&](const juce::String& v) { options.errorStatus = v.getIntValue(); });
+        readOption("--hang-rate", [&](const juce::String& v) { options.hangRate = rate(v); });
+        readOption("--truncate-rate", [&](const juce::String& v) { options.truncateRate = rate(v); });
+        readOption("--bad-base64-rate", [&](const juce::String& v) { options.badBase64Rate = rate(v); });
+        readOption("--fail-rate", [&](const juce::String& v) { options.failRate = rate(v); });
+        options.noJobs = args.containsOption("--no-jobs");
+        options.quiet = args.containsOption("--quiet");
+        return options;
+    }
+
+    juce::String getStatusText(int status) {
+        switch (status) {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 409: return "Conflict";
+        case 500: return "Internal Server Error";
+        case 502: return "Bad Gateway";
+        case 503: return "Service Unavailable";
+        case 504: return "Gateway Timeout";
+        default: return "Error";
+        }
+    }
+
+    juce::String makeJson(std::initializer_list<std::pair<const char*, juce::var>> properties) {
+        juce::DynamicObject::Ptr object = new juce::DynamicObject();
+        for (const auto& property : properties) {
+            object->setProperty(property.first, property.second);
+        }
+        return juce::JSON::toString(juce::var(object.get()), true);
+    }
+
+    juce::String makeError(const juce::String& message) {
+        return makeJson({ { "error", juce::var(message) } });
+    }
+
+    //==========================================================================
+    // Keeps a transfer under a byte rate by sleeping after each chunk until the
+    // bytes so far are due.
+    class Throttle
+    {
+    public:
+        explicit Throttle(double bytesPerSecondToUse)
+            : bytesPerSecond(bytesPerSecondToUse), startMs(juce::Time::getMillisecondCounterHiRes())
+        {
+        }
+
+        int getChunkSize() const
+        {
+            if (bytesPerSecond <= 0.0) {
+                return kUnthrottledChunkBytes;
+            }
+            return juce::jlimit(1, kUnthrottledChunkBytes, static_cast<int>(bytesPerSecond * kThrottleSliceMs / 1000.0));
+        }
+
+        void add(int numBytes)
+        {
+            total += numBytes;
+            if (bytesPerSecond <= 0.0) {
+                return;
+            }
+            const double dueMs = startMs + static_cast<double>(total) * 1000.0 / bytesPerSecond;
+            const double waitMs = dueMs - juce::Time::getMillisecondCounterHiRes();
+            if (waitMs > 0.0) {
+                juce::Thread::sleep(static_cast<int>(std::ceil(waitMs)));
+            }
+        }
+
+    private:
+        const double bytesPerSecond;
+        const double startMs;
+        juce::int64 total = 0;
+    };
+
+    bool sendAll(juce::StreamingSocket& socket, const char* data, size_t size, Throttle& throttle) {
+        size_t sent = 0;
+        while (sent < size) {
+            const int chunk = static_cast<int>(juce::jmin(static_cast<size_t>(throttle.getChunkSize()), size - sent));
+            const int written = socket.write(data + sent, chunk);
+            if (written <= 0) {
+                return false;
+            }
+            sent += static_cast<size_t>(written);
+            throttle.add(written);
+        }
+        return true;
+    }
+
+    //==========================================================================
+    // A few harmonics of a note picked from a prompt and seed, pulsing at a rate
+    // picked the same way, so different settings sound different.
+    struct Tone
+    {
+        explicit Tone(const juce::var& prompt)
+        {
+            const auto hash = static_cast<juce::uint64>(
+                (prompt["prompt"].toString() + "|" + prompt["seed"].toString()).hashCode64());
+            frequency = 110.0 * std::pow(2.0, static_cast<double>(hash % 24) / 12.0);
+            pulsesPerSecond = 1.0 + static_cast<double>((hash >> 8) % 4);
+        }
+
+        float getSample(int sample, double sampleRate) const
+        {
+            const double time = sample / sampleRate;
+            const double envelope = 1.0 - std::fmod(time * pulsesPerSecond, 1.0);
+            double value = 0.0;
+            for (int harmonic = 1; harmonic <= 3; ++harmonic) {
+                value += std::sin(juce::MathConstants<double>::twoPi * frequency * harmonic * time) / harmonic;
+            }
+            return static_cast<float>(0.3 * envelope * value);
+        }
+
+        double frequency = 0.0;
+        double pulsesPerSecond = 0.0;
+    };
+
+    // Decodes the request's recording and answers with the same length of audio:
+    // the recording blended towards tones picked from the two prompts, the way the
+    // real server blends with alpha and denoising. The same request always gets the
+    // same answer.
+    bool synthesise(const juce::var& request, juce::String* base64Wav, juce::String* error) {
+        if (!request["audio"].isString()) {
+            *error = "Request had no audio.";
+            return false;
+        }
+        juce::MemoryOutputStream wavBytes;
+        if (!juce::Base64::convertFromBase64(wavBytes, request["audio"].toString())) {
+            *error = "Couldn't decode the request's base64.";
+            return false;
+        }
+        juce::WavAudioFormat wavFormat;
+        std::unique_ptr<juce::AudioFormatReader> reader(wavFormat.createReaderFor(
+            new juce::MemoryInputStream(wavBytes.getData(), wavBytes.getDataSize(), false), true));
+        if (!reader || reader->numChannels == 0 || reader->sampleRate <= 0.0) {
+            *error = "Couldn't read the request's WAV.";
+            return false;
+        }
+        const int numSamples = static_cast<int>(reader->lengthInSamples);
+        const double sampleRate = reader->sampleRate;
+        juce::AudioBuffer<float> audio(static_cast<int>(reader->numChannels), numSamples);
+        reader->read(&audio, 0, numSamples, 0, true, true);
+
+        const juce::var start = request["start"];
+        const juce::var end = request["end"];
+        const double alpha = juce::jlimit(0.0, 1.0, static_cast<double>(request["alpha"]));
+        const double denoising = juce::jlimit(0.0, 1.0, static_cast<double>(start["denoising"]) * (1.0 - alpha)
+            + static_cast<double>(end["denoising"]) * alpha);
+        const Tone startTone(start);
+        const Tone endTone(end);
+        juce::AudioBuffer<float> result(1, numSamples);
+        const float* in = audio.getReadPointer(0);
+        float* out = result.getWritePointer(0);
+        for (int i = 0; i < numSamples; ++i) {
+            const double tone = startTone.getSample(i, sampleRate) * (1.0 - alpha) + endTone.getSample(i, sampleRate) * alpha;
+            out[i] = static_cast<float>(in[i] * (1.0 - denoising) + tone * denoising);
+        }
+
+        juce::MemoryOutputStream* memStream = new juce::MemoryOutputStream(static_cast<size_t>(numSamples) * sizeof(juce::int16));
+        std::unique_ptr<juce::AudioFormatWriter> writer(wavFormat.createWriterFor(memStream, sampleRate, 1, 16, juce::StringPairArray(), 0));
+        if (!writer) {
+            delete memStream;
+            *error = "Couldn't write the result.";
+            return false;
+        }
+        writer->writeFromAudioSampleBuffer(result, 0, numSamples);
+        writer->flush();
+        *base64Wav = juce::Base64::toBase64(memStream->getData(), memStream->getDataSize());
+        return true;
+    }
+
+    // Swaps a stretch in the middle for characters base64 doesn't have.
+    juce::String corruptBase64(const juce::String& base64) {
+        const int middle = base64.length() / 2;
+        return base64.replaceSection(middle, juce::jmin(16, base64.length() - middle), "*!*!*!*!*!*!*!*!");
+    }
+}  // namespace
+
+//==============================================================================
+/**
+    Accepts connections on one thread and serves each from a pool. Every request
+    draws its latency and faults from one seeded Random, in the order requests
+    arrive, so a single client sees the same faults on every run.
+
+    Generations take num_inference_steps times --step-ms and run one after
+    another, so concurrent requests queue the way they would on one GPU. Job
+    progress is worked out from the clock, so nothing runs between polls.
+*/
+class MockServer
+{
+public:
+    explicit MockServer(const Options& optionsToUse)
+        : options(optionsToUse), random(optionsToUse.seed), pool(optionsToUse.numThreads)
+    {
+    }
+
+    ~MockServer()
+    {
+        stopping = true;
+        listener.close();
+        pool.removeAllJobs(true, kShutdownTimeoutMs);
+    }
+
+    bool start()
+    {
+        return listener.createListener(options.port, options.host);
+    }
+
+    void run()
+    {
+        while (!stopping) {
+            std::shared_ptr<juce::StreamingSocket> connection(listener.waitForNextConnection());
+            if (connection == nullptr) {
+                break;
+            }
+            pool.addJob([this, connection]() { handleConnection(*connection); });
+        }
+    }
+
+private:
+    struct Request
+    {
+        juce::String method;
+        juce::StringArray path;
+        juce::String body;
+    };
+
+    struct Response
+    {
+        int status = 200;
+        juce::String body;
+        // Only responses with audio in them are truncated.
+        bool hasAudio = false;
+    };
+
+    struct Job
+    {
+        double startMs = 0.0;
+        double endMs = 0.0;
+        int numSteps = 0;
+        bool failed = false;
+        juce::String audio;
+    };
+
+    void handleConnection(juce::StreamingSocket& socket)
+    {
+        const double startMs = juce::Time::getMillisecondCounterHiRes();
+        Request request;
+        if (!readRequest(socket, &request)) {
+            return;
+        }
+        Faults faults = drawFaults();
+        const juce::String target = request.method + " /" + request.path.joinIntoString("/");
+        if (faults.hang) {
+            waitForClose(socket);
+            Faults hung;
+            hung.hang = true;
+            log(target, startMs, 0, 0, hung);
+            return;
+        }
+        sleepFor(faults.delayMs);
+        Response response;
+        if (faults.error) {
+            response.status = options.errorStatus;
+            response.body = makeError("Injected error.");
+        }
+        else {
+            response = route(request, faults);
+        }
+        // Only log the faults that applied to this request.
+        if (!response.hasAudio) {
+            faults.truncate = false;
+            faults.badBase64 = false;
+        }
+        if (faults.error || request.method != "POST") {
+            faults.fail = false;
+        }
+        const size_t bytesSent = sendResponse(socket, response, faults.truncate);
+        log(target, startMs, response.status, bytesSent, faults);
+    }
+
+    // Reads the request line, headers and body, at no more than the upload cap.
+    bool readRequest(juce::StreamingSocket& socket, Request* request)
+    {
+        Throttle throttle(options.uploadBandwidth);
+        std::vector<char> chunk(kUnthrottledChunkBytes);
+        std::string received;
+        auto receive = [&]() {
+            if (socket.waitUntilReady(true, kReadTimeoutMs) != 1) {
+                return false;
+            }
+            const int numRead = socket.read(chunk.data(), throttle.getChunkSize(), false);
+            if (numRead <= 0) {
+                return false;
+            }
+            received.append(chunk.data(), static_cast<size_t>(numRead));
+            throttle.add(numRead);
+            return true;
+        };
+        size_t headerEnd = std::string::npos;
+        while ((headerEnd = received.find("\r\n\r\n")) == std::string::npos) {
+            if (received.size() > kMaxHeaderBytes || !receive()) {
+                return false;
+            }
+        }
+        juce::StringArray lines = juce::StringArray::fromLines(juce::String::fromUTF8(received.data(), static_cast<int>(headerEnd)));
+        juce::StringArray requestLine = juce::StringArray::fromTokens(lines[0], " ", {});
+        if (requestLine.size() < 2) {
+            return false;
+        }
+        request->method = requestLine[0].toUpperCase();
+        juce::String target = requestLine[1].upToFirstOccurrenceOf("?", false, false);
+        // A proxy sends the whole URL.
+        if (target.startsWithIgnoreCase("http")) {
+            target = juce::URL(target).getSubPath();
+        }
+        // Empty parts are dropped, so a doubled or trailing slash doesn't matter.
+        request->path = juce::StringArray::fromTokens(target, "/", {});
+        request->path.removeEmptyStrings();
+
+        juce::int64 contentLength = 0;
+        for (int i = 1; i < lines.size(); ++i) {
+            if (lines[i].upToFirstOccurrenceOf(":", false, false).trim().equalsIgnoreCase("Content-Length")) {
+                contentLength = lines[i].fromFirstOccurrenceOf(":", false, false).trim().getLargeIntValue();
+            }
+        }
+        if (contentLength < 0 || contentLength > kMaxBodyBytes) {
+            return false;
+        }
+        received.erase(0, headerEnd + 4);
+        while (static_cast<juce::int64>(received.size()) < contentLength) {
+            if (!receive()) {
+                return false;
+            }
+        }
+        request->body = juce::String::fromUTF8(received.data(), static_cast<int>(contentLength));
+        return true;
+    }
+
+    Faults drawFaults()
+    {
+        const juce::ScopedLock scopedLock(randomLock);
+        Faults faults;
+        faults.delayMs = options.latencyMs + (options.jitterMs > 0 ? random.nextInt(options.jitterMs + 1) : 0);
+        if (random.nextDouble() < options.tailRate) {
+            faults.delayMs += options.tailMs;
+        }
+        faults.error = random.nextDouble() < options.errorRate;
+        faults.hang = random.nextDouble() < options.hangRate;
+        faults.truncate = random.nextDouble() < options.truncateRate;
+        faults.badBase64 = random.nextDouble() < options.badBase64Rate;
+        faults.fail = random.nextDouble() < options.failRate;
+        return faults;
+    }
+
+    Response route(const Request& request, const Faults& faults)
+    {
+        const juce::StringArray& path = request.path;
+        const bool isPost = request.method == "POST";
+        if (path.size() == 1 && path[0] == "run_vst") {
+            return isPost ? runBlocking(request, faults) : Response { 405, makeError("Use POST.") };
+        }
+        if (path.size() >= 1 && path[0] == "jobs") {
+            if (options.noJobs) {
+                return { 404, makeError("No such endpoint.") };
+            }
+            if (path.size() == 1) {
+                return isPost ? submitJob(request, faults) : Response { 405, makeError("Use POST.") };
+            }
+            if (path.size() == 2) {
+                return getJobStatus(path[1]);
+            }
+            if (path.size() == 3 && path[2] == "result") {
+                return getJobResult(path[1], faults);
+            }
+        }
+        return { 404, makeError("No such endpoint.") };
+    }
+
+    Response runBlocking(const Request& request, const Faults& faults)
+    {
+        const juce::var json = juce::JSON::parse(request.body);
+        juce::String audio;
+        juce::String error;
+        if (!synthesise(json, &audio, &error)) {
+            return { 400, makeError(error) };
+        }
+        const juce::Range<double> slot = reserveGpu(getNumSteps(json));
+        sleepFor(static_cast<int>(std::ceil(slot.getEnd() - juce::Time::getMillisecondCounterHiRes())));
+        if (faults.fail) {
+            return { 500, makeError("Injected generation failure.") };
+        }
+        return makeAudioResponse(audio, faults);
+    }
+
+    Response submitJob(const Request& request, const Faults& faults)
+    {
+        const juce::var json = juce::JSON::parse(request.body);
+        Job job;
+        juce::String error;
+        if (!synthesise(json, &job.audio, &error)) {
+            return { 400, makeError(error) };
+        }
+        job.numSteps = getNumSteps(json);
+        job.failed = faults.fail;
+        const juce::Range<double> slot = reserveGpu(job.numSteps);
+        job.startMs = slot.getStart();
+        job.endMs = slot.getEnd();
+        const juce::ScopedLock scopedLock(jobsLock);
+        const int id = nextJobId++;
+        jobs[id] = std::move(job);
+        while (jobs.size() > kMaxJobs) {
+            jobs.erase(jobs.begin());
+        }
+        return { 200, makeJson({ { "job_id", juce::var(juce::String(id)) } }) };
+    }
+
+    Response getJobStatus(const juce::String& id)
+    {
+        const juce::ScopedLock scopedLock(jobsLock);
+        const Job* job = findJob(id);
+        if (job == nullptr) {
+            return { 404, makeError("No such job.") };
+        }
+        const double now = juce::Time::getMillisecondCounterHiRes();
+        juce::String status = "queued";
+        int step = 0;
+        if (now >= job->endMs) {
+            status = job->failed ? "failed" : "done";
+            step = job->numSteps;
+        }
+        else if (now >= job->startMs) {
+            status = "running";
+            step = options.stepMs > 0 ? static_cast<int>((now - job->startMs) / options.stepMs) : job->numSteps;
+        }
+        return { 200, makeJson({ { "job_id", juce::var(id) },
+                                 { "status", juce::var(status) },
+                                 { "step", juce::var(step) },
+                                 { "num_steps", juce::var(job->numSteps) },
+                                 { "error", juce::var(status == "failed" ? "Injected generation failure." : "") } }) };
+    }
+
+    Response getJobResult(const juce::String& id, const Faults& faults)
+    {
+        const juce::ScopedLock scopedLock(jobsLock);
+        const Job* job = findJob(id);
+        if (job == nullptr) {
+            return { 404, makeError("No such job.") };
+        }
+        if (juce::Time::getMillisecondCounterHiRes() < job->endMs) {
+            return { 409, makeError("Job isn't done.") };
+        }
+        if (job->failed) {
+            return { 500, makeError("Injected generation failure.") };
+        }
+        return makeAudioResponse(job->audio, faults);
+    }
+
+    static Response makeAudioResponse(const juce::String& audio, const Faults& faults)
+    {
+        return { 200, makeJson({ { "audio", juce::var(faults.badBase64 ? corruptBase64(audio) : audio) } }), true };
+    }
+
+    // Called with jobsLock held.
+    const Job* findJob(const juce::String& id) const
+    {
+        const int number = id.getIntValue();
+        auto it = jobs.find(number);
+        return juce::String(number) == id && it != jobs.end() ? &it->second : nullptr;
+    }
+
+    int getNumSteps(const juce::var& json) const
+    {
+        const juce::var steps = json["num_inference_steps"];
+        return steps.isVoid() ? kDefaultSteps : juce::jmax(1, static_cast<int>(steps));
+    }
+
+    // Queues a generation behind the ones already running, and returns when it
+    // starts and ends.
+    juce::Range<double> reserveGpu(int numSteps)
+    {
+        const juce::ScopedLock scopedLock(jobsLock);
+        const double start = juce::jmax(juce::Time::getMillisecondCounterHiRes(), gpuFreeMs);
+        gpuFreeMs = start + static_cast<double>(numSteps) * options.stepMs;
+        return { start, gpuFreeMs };
+    }
+
+    // Writes the headers and body, at no more than the bandwidth cap. A truncated
+    // response promises the whole body, sends half of it and hangs up. Returns the
+    // bytes sent.
+    size_t sendResponse(juce::StreamingSocket& socket, const Response& response, bool truncate)
+    {
+        const std::string body = response.body.toStdString();
+        const std::string header = (juce::String("HTTP/1.1 ") + juce::String(response.status) + " "
+            + getStatusText(response.status) + "\r\n"
+            + "Content-Type: application/json\r\n"
+            + "Content-Length: " + juce::String(static_cast<juce::int64>(body.size())) + "\r\n"
+            + "Connection: close\r\n\r\n").toStdString();
+        const size_t bodyBytes = truncate ? body.size() / 2 : body.size();
+        Throttle throttle(options.bandwidth);
+        if (!sendAll(socket, header.data(), header.size(), throttle)) {
+            return 0;
+        }
+        if (!sendAll(socket, body.data(), bodyBytes, throttle)) {
+            return header.size();
+        }
+        return header.size() + bodyBytes;
+    }
+
+    // Holds the connection open without answering until the client gives up.
+    void waitForClose(juce::StreamingSocket& socket)
+    {
+        char byte = 0;
+        while (!stopping) {
+            const int ready = socket.waitUntilReady(true, 100);
+            if (ready < 0 || (ready > 0 && socket.read(&byte, 1, false) <= 0)) {
+                return;
+            }
+        }
+    }
+
+    void sleepFor(int ms)
+    {
+        const double endMs = juce::Time::getMillisecondCounterHiRes() + ms;
+        double remaining = ms;
+        while (remaining > 0.0 && !stopping) {
+            juce::Thread::sleep(juce::jmin(100, static_cast<int>(std::ceil(remaining))));
+            remaining = endMs - juce::Time::getMillisecondCounterHiRes();
+        }
+    }
+
+    void log(const juce::String& target, double startMs, int status, size_t bytesSent, const Faults& faults)
+    {
+        if (options.quiet) {
+            return;
+        }
+        juce::String line = target + " -> " + (status != 0 ? juce::String(status) : juce::String("no answer"))
+            + ", " + juce::String(static_cast<juce::int64>(bytesSent)) + " bytes, "
+            + juce::String(juce::Time::getMillisecondCounterHiRes() - startMs, 1) + " ms";
+        const juce::String injected = faults.toString();
+        if (injected.isNotEmpty()) {
+            line << " [" << injected << "]";
+        }
+        const juce::ScopedLock scopedLock(logLock);
+        std::cout << line << std::endl;
+    }
+
+    const Options options;
+    std::atomic<bool> stopping { false };
+    juce::StreamingSocket listener;
+
+    juce::CriticalSection randomLock;
+    juce::Random random;
+
+    juce::CriticalSection jobsLock;
+    std::map<int, Job> jobs;
+    int nextJobId = 1;
+    // When the last generation queued finishes.
+    double gpuFreeMs = 0.0;
+
+    juce::CriticalSection logLock;
+    juce::ThreadPool pool;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (MockServer)
+};
+
+//==============================================================================
+int main (int argc, char* argv[])
+{
+    const juce::ArgumentList args(argc, argv);
+    if (args.containsOption("--help|-h")) {
+        std::cout << kUsage;
+        return 0;
+    }
+    const Options options = parseOptions(args);
+    MockServer server(options);
+    if (!server.start()) {
+        std::cerr << "Couldn't listen on " << options.host << ":" << options.port << std::endl;
+        return 1;
+    }
+    std::cout << "Listening on http://" << options.host << ":" << options.port << std::endl;
+    server.run();
+    return 0;
+}
@@ -0,0 +1,68 @@
+/*
+  ==============================================================================
+
+    BackgroundWorker.cpp
+    One thread, shared by every instance, for work that's done a slice at a time.
+
+  ==============================================================================
+*/
+
+#include "BackgroundWorker.h"
+
+namespace {
+    // How long to sleep when nobody has any work. Clients that are asked for work from
+    // the audio thread, where waking the thread isn't allowed, are picked up this late.
+    constexpr int kIdleWaitMs = 20;
+    constexpr int kStopTimeoutMs = 2000;
+}  // namespace
+
+//==============================================================================
+BackgroundWorker::BackgroundWorker() : juce::Thread("Riffusion Background")
+{
+    startThread();
+}
+
+BackgroundWorker::~BackgroundWorker()
+{
+    stopThread(kStopTimeoutMs);
+}
+
+void BackgroundWorker::addClient(Client* client)
+{
+    {
+        const juce::ScopedLock scopedLock(lock);
+        clients.addIfNotAlreadyThere(client);
+    }
+    notify();
+}
+
+void BackgroundWorker::removeClient(Client* client)
+{
+    const juce::ScopedLock scopedLock(lock);
+    clients.removeFirstMatchingValue(client);
+}
+
+void BackgroundWorker::run()
+{
+    while (!threadShouldExit()) {
+        bool anyWork = false;
+        int numClients = 0;
+        {
+            const juce::ScopedLock scopedLock(lock);
+            numClients = clients.size();
+        }
+        // One slice per client per round. The lock is taken for each slice rather than
+        // the whole round, so removing a client only ever waits for one.
+        for (int i = 0; i < numClients && !threadShouldExit(); ++i) {
+            const juce::ScopedLock scopedLock(lock);
+            if (clients.isEmpty()) {
+                break;
+            }
+            lastClient = (lastClient + 1) % clients.size();
+            anyWork = clients[lastClient]->doWork() || anyWork;
+        }
+        if (!anyWork) {
+            wait(kIdleWaitMs);
+        }
+    }
+}
@@ -0,0 +1,57 @@
+/*
+  ==============================================================================
+
+    BackgroundWorker.h
+    One thread, shared by every instance, for work that's done a slice at a time.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+
+//==============================================================================
+/**
+    Runs the background DSP of every plugin instance (time stretching, morph
+    analysis) on a single thread, through juce::SharedResourcePointer, so loading
+    more instances doesn't add threads.
+
+    Clients do their work in short slices, and are given one slice each in turn, so
+    a long render on one track can't hold up another. When nobody has anything to
+    do, the thread sleeps until woken or until the next poll.
+*/
+class BackgroundWorker : private juce::Thread
+{
+public:
+    class Client
+    {
+    public:
+        virtual ~Client() = default;
+        // Background thread. Does a few milliseconds of work at most, and returns true
+        // if there's more to do straight away.
+        virtual bool doWork() = 0;
+    };
+
+    BackgroundWorker();
+    ~BackgroundWorker() override;
+
+    void addClient(Client* client);
+    // Waits for the client's slice to finish if it's in one, so after this returns
+    // the client is never called again.
+    void removeClient(Client* client);
+
+    // Any thread but the audio thread. Ends the sleep between polls, for when a client
+    // has just been given work.
+    void wake() { notify(); }
+
+private:
+    void run() override;
+
+    juce::CriticalSection lock;
+    juce::Array<Client*> clients;
+    // The client that was given the last slice.
+    int lastClient = 0;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (BackgroundWorker)
+};
@@ -0,0 +1,83 @@
+/*
+  ==============================================================================
+
+    CancellationToken.h
+    Lets one thread abort another thread's request, including blocking reads.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+
+#include <atomic>
+
+//==============================================================================
+/**
+    Shared between whoever runs a request and whoever may want to stop it. The
+    request checks isCancelled() between steps, sleeps with waitForCancel(), and
+    registers its open connection so cancel() can abort a connect or read that is
+    blocked inside the network stack.
+*/
+class CancellationToken
+{
+public:
+    CancellationToken() = default;
+
+    // Any thread. Doesn't wait for the request to notice.
+    void cancel()
+    {
+        cancelled = true;
+        cancelledEvent.signal();
+        const juce::ScopedLock scopedLock(lock);
+        if (stream != nullptr) {
+            stream->cancel();
+        }
+    }
+
+    bool isCancelled() const { return cancelled; }
+
+    // Sleeps for up to timeoutMs. Returns true straight away if cancelled.
+    bool waitForCancel(int timeoutMs)
+    {
+        return cancelledEvent.wait(timeoutMs) || cancelled;
+    }
+
+    // Makes cancel() abort the stream for as long as this exists. Does nothing if
+    // token is null, so requests that can't be cancelled don't need a token.
+    class ScopedStream
+    {
+    public:
+        ScopedStream(CancellationToken* t, juce::WebInputStream& stream) : token(t)
+        {
+            if (token != nullptr) {
+                const juce::ScopedLock scopedLock(token->lock);
+                token->stream = &stream;
+                if (token->cancelled) {
+                    stream.cancel();
+                }
+            }
+        }
+
+        ~ScopedStream()
+        {
+            if (token != nullptr) {
+                const juce::ScopedLock scopedLock(token->lock);
+                token->stream = nullptr;
+            }
+        }
+
+    private:
+        CancellationToken* token;
+    };
+
+private:
+    std::atomic<bool> cancelled { false };
+    // Manual reset, so every waiter wakes up and keeps waking up.
+    juce::WaitableEvent cancelledEvent { true };
+    juce::CriticalSection lock;
+    juce::WebInputStream* stream = nullptr;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (CancellationToken)
+};
@@ -0,0 +1,424 @@
+/*
+  ==============================================================================
+
+    GenerationService.cpp
+    Process-wide service that runs Riffusion requests for every plugin instance.
+
+  ==============================================================================
+*/
+
+#include "GenerationService.h"
+
+namespace {
+    // Each entry is a few seconds of mono audio, so this stays at a few megabytes.
+    constexpr size_t kMaxCacheEntries = 8;
+    constexpr int kIdleWaitMs = 100;
+    constexpr int kStopTimeoutMs = 2000;
+    // How often the workers are woken up again while waiting for them to exit.
+    constexpr int kStopPollMs = 10;
+
+    // FNV-1a, used to fold the request into a cache key.
+    juce::uint64 hashBytes(const void* data, size_t numBytes, juce::uint64 hash) {
+        const auto* bytes = static_cast<const juce::uint8*>(data);
+        for (size_t i = 0; i < numBytes; ++i) {
+            hash ^= bytes[i];
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+}  // namespace
+
+//==============================================================================
+GenerationService::GenerationService()
+{
+    for (int i = 0; i < kMaxConcurrentRequests; ++i) {
+        // Each worker deletes itself when it returns, so none is ever waited on forever.
+        ++shared->numWorkersRunning;
+        const bool launched = juce::Thread::launch([state = shared, i]
+        {
+            juce::Thread::setCurrentThreadName("Riffusion Generation " + juce::String(i));
+            state->runWorker();
+        });
+        if (!launched) {
+            --shared->numWorkersRunning;
+        }
+    }
+}
+
+GenerationService::~GenerationService()
+{
+    {
+        // Nobody is left to unwind for, so don't let a hung server hold up the exit.
+        const juce::ScopedLock scopedLock(shared->lock);
+        for (auto& [clientId, client] : shared->clients) {
+            if (client.runningToken) {
+                client.runningToken->cancel();
+            }
+            for (auto& token : client.speculativeTokens) {
+                token->cancel();
+            }
+        }
+    }
+    shared->shouldExit = true;
+    const juce::uint32 deadline = juce::Time::getMillisecondCounter() + kStopTimeoutMs;
+    while (shared->numWorkersRunning > 0 && juce::Time::getMillisecondCounter() < deadline) {
+        // The events are auto-reset and each wakes a single waiter, so keep at it
+        // until every idle worker has noticed.
+        shared->workAvailable.signal();
+        shared->jobFinished.signal();
+        juce::Thread::sleep(kStopPollMs);
+    }
+    // Anything still running now is stuck somewhere that can't be cancelled. It keeps
+    // the shared state alive, and frees it when it does get out.
+}
+
+int GenerationService::registerClient(std::shared_ptr<PerformanceTracer> tracer)
+{
+    const juce::ScopedLock scopedLock(shared->lock);
+    int clientId = shared->nextClientId++;
+    shared->clients[clientId].tracer = std::move(tracer);
+    return clientId;
+}
+
+void GenerationService::unregisterClient(int clientId)
+{
+    while (true) {
+        {
+            const juce::ScopedLock scopedLock(shared->lock);
+            auto it = shared->clients.find(clientId);
+            if (it == shared->clients.end()) {
+                return;
+            }
+            Client& client = it->second;
+            client.queue.clear();
+            client.speculativeQueue.clear();
+            if (client.runningToken) {
+                client.runningToken->cancel();
+            }
+            for (auto& token : client.speculativeTokens) {
+                token->cancel();
+            }
+            // Running jobs finish by themselves and find the client gone.
+            if (client.numCallbacksRunning == 0) {
+                shared->clients.erase(it);
+                return;
+            }
+        }
+        shared->jobFinished.wait(kIdleWaitMs);
+    }
+}
+
+void GenerationService::submit(int clientId, Request request, Callback onDone, ProgressCallback onProgress)
+{
+    Job job;
+    job.clientId = clientId;
+    job.cacheKey = computeCacheKey(request);
+    job.request = std::move(request);
+    job.onDone = std::move(onDone);
+    job.onProgress = std::move(onProgress);
+    {
+        const juce::ScopedLock scopedLock(shared->lock);
+        auto it = shared->clients.find(clientId);
+        if (it == shared->clients.end()) {
+            jassertfalse;
+            return;
+        }
+        // If this was asked for speculatively and hasn't started yet, it doesn't need to
+        // run twice, and certainly not at low priority.
+        auto& speculativeQueue = it->second.speculativeQueue;
+        for (auto queued = speculativeQueue.begin(); queued != speculativeQueue.end(); ++queued) {
+            if (queued->cacheKey == job.cacheKey) {
+                speculativeQueue.erase(queued);
+                it->second.speculation.promoted++;
+                break;
+            }
+        }
+        it->second.queue.push_back(std::move(job));
+    }
+    shared->workAvailable.signal();
+}
+
+void GenerationService::submitSpeculative(int clientId, Request request)
+{
+    Job job;
+    job.clientId = clientId;
+    job.cacheKey = computeCacheKey(request);
+    job.request = std::move(request);
+    job.isSpeculative = true;
+    {
+        const juce::ScopedLock scopedLock(shared->lock);
+        auto it = shared->clients.find(clientId);
+        if (it == shared->clients.end()) {
+            jassertfalse;
+            return;
+        }
+        it->second.speculativeQueue.push_back(std::move(job));
+        it->second.speculation.submitted++;
+    }
+    shared->workAvailable.signal();
+}
+
+void GenerationService::cancelSpeculative(int clientId)
+{
+    const juce::ScopedLock scopedLock(shared->lock);
+    auto it = shared->clients.find(clientId);
+    if (it != shared->clients.end()) {
+        it->second.speculation.cancelled += static_cast<int>(it->second.speculativeQueue.size()
+            + it->second.speculativeTokens.size());
+        it->second.speculativeQueue.clear();
+        for (auto& token : it->second.speculativeTokens) {
+            token->cancel();
+        }
+    }
+}
+
+GenerationService::SpeculationStats GenerationService::getSpeculationStats(int clientId) const
+{
+    const juce::ScopedLock scopedLock(shared->lock);
+    auto it = shared->clients.find(clientId);
+    return it != shared->clients.end() ? it->second.speculation : SpeculationStats();
+}
+
+void GenerationService::setUseHelperProcess(bool shouldUseHelper)
+{
+    shared->useHelperProcess = shouldUseHelper;
+    if (shouldUseHelper) {
+        // Start it now rather than on the first request.
+        shared->helperProcess.ensureRunning();
+    }
+}
+
+void GenerationService::cancel(int clientId)
+{
+    const juce::ScopedLock scopedLock(shared->lock);
+    auto it = shared->clients.find(clientId);
+    if (it != shared->clients.end()) {
+        it->second.queue.clear();
+        if (it->second.runningToken) {
+            it->second.runningToken->cancel();
+        }
+    }
+}
+
+void GenerationService::Shared::runWorker()
+{
+    while (!shouldExit) {
+        Job job;
+        std::shared_ptr<PerformanceTracer> tracer;
+        if (!popNextJob(job, tracer)) {
+            workAvailable.wait(kIdleWaitMs);
+            continue;
+        }
+        Result result;
+        {
+            PerformanceTracer::ScopedSpan span(*tracer, job.isSpeculative ? "speculate" : "generate");
+            result = runJob(job, *tracer);
+        }
+        if (job.onDone && beginCallback(job.clientId)) {
+            job.onDone(result);
+            endCallback(job.clientId);
+        }
+        finishJob(job);
+    }
+    --numWorkersRunning;
+}
+
+bool GenerationService::Shared::popNextJob(Job& job, std::shared_ptr<PerformanceTracer>& tracer)
+{
+    const juce::ScopedLock scopedLock(lock);
+    // Start with the first client after the one served last, wrapping around.
+    auto pick = [this](auto isReady) -> std::map<int, Client>::iterator
+    {
+        for (auto it = clients.upper_bound(lastServedClient); it != clients.end(); ++it) {
+            if (isReady(it->second)) {
+                return it;
+            }
+        }
+        for (auto it = clients.begin(); it != clients.end() && it->first <= lastServedClient; ++it) {
+            if (isReady(it->second)) {
+                return it;
+            }
+        }
+        return clients.end();
+    };
+    auto it = pick([](const Client& c) { return !c.isRunning && !c.queue.empty(); });
+    if (it != clients.end()) {
+        job = std::move(it->second.queue.front());
+        it->second.queue.pop_front();
+        it->second.isRunning = true;
+        it->second.runningToken = job.token;
+    }
+    else {
+        if (numSpeculativeRunning >= kMaxConcurrentSpeculativeRequests) {
+            return false;
+        }
+        it = pick([](const Client& c) { return !c.speculativeQueue.empty(); });
+        if (it == clients.end()) {
+            return false;
+        }
+        job = std::move(it->second.speculativeQueue.front());
+        it->second.speculativeQueue.pop_front();
+        it->second.numSpeculativeRunning++;
+        it->second.speculativeTokens.push_back(job.token);
+        numSpeculativeRunning++;
+        runningSpeculativeKeys.insert(job.cacheKey);
+    }
+    tracer = it->second.tracer;
+    lastServedClient = it->first;
+    return true;
+}
+
+void GenerationService::Shared::finishJob(const Job& job)
+{
+    {
+        const juce::ScopedLock scopedLock(lock);
+        auto it = clients.find(job.clientId);
+        if (job.isSpeculative) {
+            numSpeculativeRunning--;
+            runningSpeculativeKeys.erase(runningSpeculativeKeys.find(job.cacheKey));
+            if (it != clients.end()) {
+                auto& tokens = it->second.speculativeTokens;
+                tokens.erase(std::find(tokens.begin(), tokens.end(), job.token));
+                it->second.numSpeculativeRunning--;
+            }
+        }
+        else if (it != clients.end()) {
+            it->second.isRunning = false;
+            it->second.runningToken.reset();
+        }
+    }
+    jobFinished.signal();
+    // This client may have more work queued up behind the job that just finished.
+    workAvailable.signal();
+}
+
+GenerationService::Result GenerationService::Shared::runJob(const Job& job, PerformanceTracer& tracer)
+{
+    Result result;
+    if (!job.isSpeculative) {
+        waitForSpeculativeJob(job.cacheKey, *job.token);
+    }
+    if (auto cached = findInCache(job.cacheKey, !job.isSpeculative)) {
+        result.success = true;
+        result.message = "Done Generating (cached)";
+        result.audio = cached;
+        return result;
+    }
+
+    if (job.token->isCancelled()) {
+        result.message = "Cancelled.";
+        return result;
+    }
+    std::shared_ptr<juce::AudioBuffer<float>> audio;
+    juce::String message;
+    // Progress goes back into the plugin instance, so it's guarded like the final callback.
+    ProgressCallback onProgress;
+    if (job.onProgress) {
+        onProgress = [this, &job](const juce::String& jobId, const RiffusionClient::JobStatus& status)
+        {
+            if (beginCallback(job.clientId)) {
+                job.onProgress(jobId, status);
+                endCallback(job.clientId);
+            }
+        };
+    }
+    // The helper can't report job progress, so resuming a job always happens here.
+    bool success = (useHelperProcess && job.request.resumeJobId.isEmpty())
+        ? helperProcess.generate(job.request.serverAddress, job.request.params, job.request.audio,
+            job.request.sampleRate, helperTimeoutMs, &audio, &message, tracer, job.token.get())
+        : client.generate(job.request.serverAddress, job.request.params, job.request.audio,
+            job.request.sampleRate, &audio, &message, tracer, onProgress, job.request.resumeJobId, job.token.get());
+    if (!success) {
+        result.message = message;
+        return result;
+    }
+    result.audio = audio;
+    addToCache(job.cacheKey, result.audio, job.isSpeculative ? job.clientId : 0);
+    if (job.isSpeculative) {
+        const juce::ScopedLock scopedLock(lock);
+        auto it = clients.find(job.clientId);
+        if (it != clients.end()) {
+            it->second.speculation.completed++;
+        }
+    }
+    result.success = true;
+    result.message = "Done Generating";
+    return result;
+}
+
+bool GenerationService::Shared::beginCallback(int clientId)
+{
+    const juce::ScopedLock scopedLock(lock);
+    auto it = clients.find(clientId);
+    if (it == clients.end()) {
+        return false;
+    }
+    it->second.numCallbacksRunning++;
+    return true;
+}
+
+void GenerationService::Shared::endCallback(int clientId)
+{
+    {
+        const juce::ScopedLock scopedLock(lock);
+        auto it = clients.find(clientId);
+        if (it != clients.end()) {
+            it->second.numCallbacksRunning--;
+        }
+    }
+    jobFinished.signal();
+}
+
+void GenerationService::Shared::waitForSpeculativeJob(juce::int64 key, CancellationToken& token)
+{
+    while (!shouldExit && !token.isCancelled()) {
+        {
+            const juce::ScopedLock scopedLock(lock);
+            if (runningSpeculativeKeys.count(key) == 0) {
+                return;
+            }
+        }
+        jobFinished.wait(kIdleWaitMs);
+    }
+}
+
+std::shared_ptr<const juce::AudioBuffer<float>> GenerationService::Shared::findInCache(juce::int64 key, bool countAsHit)
+{
+    const juce::ScopedLock scopedLock(lock);
+    for (auto it = cache.begin(); it != cache.end(); ++it) {
+        if (it->key == key) {
+            if (countAsHit && it->speculativeClientId != 0) {
+                auto client = clients.find(it->speculativeClientId);
+                if (client != clients.end()) {
+                    client->second.speculation.hits++;
+                }
+                it->speculativeClientId = 0;
+            }
+            // Move to the front so it's the last to be evicted.
+            cache.splice(cache.begin(), cache, it);
+            return cache.front().audio;
+        }
+    }
+    return nullptr;
+}
+
+void GenerationService::Shared::addToCache(juce::int64 key, std::shared_ptr<const juce::AudioBuffer<float>> audio, int speculativeClientId)
+{
+    const juce::ScopedLock scopedLock(lock);
+    cache.push_front({ key, std::move(audio), speculativeClientId });
+    while (cache.size() > kMaxCacheEntries) {
+        cache.pop_back();
+    }
+}
+
+juce::int64 GenerationService::computeCacheKey(const Request& request)
+{
+    juce::uint64 hash = 14695981039346656037ull;
+    juce::String text = request.serverAddress + juce::JSON::toString(request.params, true) + request.resumeJobId;
+    hash = hashBytes(text.toRawUTF8(), text.getNumBytesAsUTF8(), hash);
+    hash = hashBytes(&request.sampleRate, sizeof(request.sampleRate), hash);
+    for (int channel = 0; channel < request.audio.getNumChannels(); ++channel) {
+        hash = hashBytes(request.audio.getReadPointer(channel), request.audio.getNumSamples() * sizeof(float), hash);
+    }
+    return static_cast<juce::int64>(hash);
+}
@@ -0,0 +1,206 @@
+/*
+  ==============================================================================
+
+    GenerationService.h
+    Process-wide service that runs Riffusion requests for every plugin instance.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "CancellationToken.h"
+#include "HelperProcessConnection.h"
+#include "PerformanceTracer.h"
+#include "RiffusionClient.h"
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
+
+//==============================================================================
+/**
+    One of these is shared by every plugin instance in the process (through
+    juce::SharedResourcePointer, so it goes away with the last instance). It owns a
+    fixed pool of worker threads, the protocol client and a small cache of results,
+    so thread count and memory stay flat no matter how many instances are open.
+    A worker stuck on a request that can't be cancelled is never killed: it carries
+    on after the service has gone, and exits once the request gives up.
+    Requests can optionally be run in a separate helper process instead.
+
+    Each instance registers as a client. Clients are served round-robin with at most
+    one request running per client, so one busy track can't starve the others, and
+    no more than kMaxConcurrentRequests requests hit the server at once.
+
+    Clients can also queue speculative requests, whose results only go into the
+    cache. They run at low priority: only when no regular request is waiting, and
+    never on every worker at once so a regular request can always start. A regular
+    request that matches a speculative one takes it over if it hasn't started yet,
+    or waits for it if it has.
+*/
+class GenerationService
+{
+public:
+    // Everything needed to run one request.
+    struct Request
+    {
+        juce::String serverAddress;
+        // The JSON payload, minus the audio which gets encoded on a worker thread.
+        juce::var params;
+        // Mono input audio.
+        juce::AudioBuffer<float> audio;
+        double sampleRate = 44100.0;
+        // If set, wait for this server job instead of starting a new one.
+        juce::String resumeJobId;
+    };
+
+    struct Result
+    {
+        bool success = false;
+        // Error (or status) message to show the user.
+        juce::String message;
+        // Generated audio, possibly shared with the cache.
+        std::shared_ptr<const juce::AudioBuffer<float>> audio;
+    };
+
+    // Called on a worker thread when a request finishes.
+    using Callback = std::function<void(const Result&)>;
+    // Called on a worker thread as a server job makes progress.
+    using ProgressCallback = RiffusionClient::ProgressCallback;
+
+    // How a client's speculative requests have fared. A speculative result that
+    // completed but was never asked for is waste.
+    struct SpeculationStats
+    {
+        int submitted = 0;
+        int completed = 0;
+        // Regular requests answered by a speculative result.
+        int hits = 0;
+        // Queued speculative requests taken over by a matching regular one.
+        int promoted = 0;
+        int cancelled = 0;
+    };
+
+    static constexpr int kMaxConcurrentRequests = 2;
+    static constexpr int kMaxConcurrentSpeculativeRequests = kMaxConcurrentRequests - 1;
+
+    GenerationService();
+    ~GenerationService();
+
+    // Registers a plugin instance. Spans for its requests go to the given tracer,
+    // which is kept alive for as long as one of its requests is still unwinding.
+    int registerClient(std::shared_ptr<PerformanceTracer> tracer);
+    // Drops the client's queued requests and aborts its running ones. Only waits
+    // if one of its callbacks is running right now, which is quick, so this can be
+    // called from the message thread. Its callbacks never fire after this returns.
+    void unregisterClient(int clientId);
+
+    // Queues a request for the client.
+    void submit(int clientId, Request request, Callback onDone, ProgressCallback onProgress = nullptr);
+    // Drops the client's queued requests and aborts its running one, without
+    // waiting for it to unwind. Its callback still fires, with a failed result.
+    void cancel(int clientId);
+
+    // Queues a low priority request whose result just goes into the cache.
+    void submitSpeculative(int clientId, Request request);
+    // Drops the client's queued speculative requests and aborts the running ones.
+    void cancelSpeculative(int clientId);
+    SpeculationStats getSpeculationStats(int clientId) const;
+
+    // If true, requests are sent to the RiffusionHelper process instead of running
+    // in the DAW's process. Applies to every instance.
+    void setUseHelperProcess(bool shouldUseHelper);
+    bool getUseHelperProcess() const { return shared->useHelperProcess; }
+
+private:
+    struct Job
+    {
+        int clientId = 0;
+        Request request;
+        Callback onDone;
+        ProgressCallback onProgress;
+        juce::int64 cacheKey = 0;
+        bool isSpeculative = false;
+        std::shared_ptr<CancellationToken> token = std::make_shared<CancellationToken>();
+    };
+    struct Client
+    {
+        std::shared_ptr<PerformanceTracer> tracer;
+        std::deque<Job> queue;
+        std::deque<Job> speculativeQueue;
+        bool isRunning = false;
+        int numSpeculativeRunning = 0;
+        // Tokens of the jobs running right now, so they can be aborted.
+        std::shared_ptr<CancellationToken> runningToken;
+        std::vector<std::shared_ptr<CancellationToken>> speculativeTokens;
+        // Callbacks into the plugin instance running right now.
+        int numCallbacksRunning = 0;
+        SpeculationStats speculation;
+    };
+    struct CacheEntry
+    {
+        juce::int64 key = 0;
+        std::shared_ptr<const juce::AudioBuffer<float>> audio;
+        // The client whose speculative request produced this, until someone asks for it.
+        int speculativeClientId = 0;
+    };
+    // The queues, the cache and the protocol client: everything the workers touch. The
+    // workers hold on to it as well as the service, so one stuck somewhere that can't be
+    // cancelled is left to finish by itself after the service has gone, rather than
+    // being killed.
+    struct Shared
+    {
+        // A worker's loop. Returns once shouldExit is set and it isn't in a job.
+        void runWorker();
+        // Picks the next job round-robin over the clients. Returns false if there's nothing to do.
+        // Speculative jobs are only picked when no client has a regular one waiting.
+        bool popNextJob(Job& job, std::shared_ptr<PerformanceTracer>& tracer);
+        void finishJob(const Job& job);
+        Result runJob(const Job& job, PerformanceTracer& tracer);
+        // Returns false if the client is gone, in which case the callback must not be called.
+        bool beginCallback(int clientId);
+        void endCallback(int clientId);
+        // Blocks while a speculative job with this key is running.
+        void waitForSpeculativeJob(juce::int64 key, CancellationToken& token);
+        // Counts a hit if the entry came from a speculative request nobody had used yet.
+        std::shared_ptr<const juce::AudioBuffer<float>> findInCache(juce::int64 key, bool countAsHit);
+        void addToCache(juce::int64 key, std::shared_ptr<const juce::AudioBuffer<float>> audio, int speculativeClientId);
+
+        mutable juce::CriticalSection lock;
+        std::map<int, Client> clients;
+        int nextClientId = 1;
+        // The client that was served last, so the next pick starts after it.
+        int lastServedClient = 0;
+        // Signalled whenever a job is queued.
+        juce::WaitableEvent workAvailable;
+        // Signalled whenever a job or a callback finishes.
+        juce::WaitableEvent jobFinished;
+        // Set when the service goes away.
+        std::atomic<bool> shouldExit { false };
+        // Workers that haven't returned from runWorker() yet.
+        std::atomic<int> numWorkersRunning { 0 };
+        int numSpeculativeRunning = 0;
+        // Cache keys of the speculative jobs currently running.
+        std::multiset<juce::int64> runningSpeculativeKeys;
+        // Most recently used first.
+        std::list<CacheEntry> cache;
+        RiffusionClient client;
+        HelperProcessConnection helperProcess;
+        std::atomic<bool> useHelperProcess { false };
+        // How long to wait for the helper. Server jobs can take much longer than one HTTP
+        // request, and the helper gives up by itself if the server stops answering polls.
+        const int helperTimeoutMs = 30 * 60 * 1000;
+    };
+
+    static juce::int64 computeCacheKey(const Request& request);
+
+    std::shared_ptr<Shared> shared = std::make_shared<Shared>();
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (GenerationService)
+};
@@ -0,0 +1,189 @@
+/*
+  ==============================================================================
+
+    HelperProcessConnection.cpp
+    Runs generation requests in the separate RiffusionHelper process.
+
+  ==============================================================================
+*/
+
+#include "HelperProcessConnection.h"
+#include "HelperProtocol.h"
+
+namespace {
+    // How often a request waiting on the helper checks whether it was cancelled.
+    constexpr int kCancelCheckMs = 20;
+}  // namespace
+
+//==============================================================================
+HelperProcessConnection::HelperProcessConnection()
+{
+}
+
+HelperProcessConnection::~HelperProcessConnection()
+{
+    killWorkerProcess();
+    handleConnectionLost();
+}
+
+bool HelperProcessConnection::ensureRunning()
+{
+    const juce::ScopedLock scopedLaunchLock(launchLock);
+    if (connected) {
+        return true;
+    }
+    if (!ring) {
+        juce::File ringFile = juce::File::getSpecialLocation(juce::File::tempDirectory)
+            .getChildFile("riffusion_ring_" + juce::String::toHexString(juce::Random::getSystemRandom().nextInt64()));
+        ring = std::make_unique<SharedAudioRing>(ringFile, HelperProtocol::kRingCapacity, true);
+        if (!ring->isValid()) {
+            ring.reset();
+            return false;
+        }
+    }
+    juce::File executable = findHelperExecutable();
+    if (!executable.existsAsFile()) {
+        return false;
+    }
+    if (!launchWorkerProcess(executable, HelperProtocol::kCommandLineUid, HelperProtocol::kLaunchTimeoutMs)) {
+        return false;
+    }
+    connected = true;
+    juce::DynamicObject::Ptr init = new juce::DynamicObject();
+    init->setProperty("type", "init");
+    init->setProperty("ring", ring->getFile().getFullPathName());
+    init->setProperty("capacity", ring->getCapacity());
+    if (!sendJson(juce::var(init.get()))) {
+        killWorkerProcess();
+        connected = false;
+    }
+    return connected;
+}
+
+bool HelperProcessConnection::generate(const juce::String& serverAddress, const juce::var& params,
+    const juce::AudioBuffer<float>& audio, double sampleRate, int timeoutMs,
+    std::shared_ptr<juce::AudioBuffer<float>>* result, juce::String* message,
+    PerformanceTracer& tracer, CancellationToken* token)
+{
+    if (!ensureRunning()) {
+        *message = "Failed to start the helper process.";
+        return false;
+    }
+    const int numSamples = audio.getNumSamples();
+    const int offset = ring->allocate(SharedAudioRing::Direction::ToHelper, numSamples);
+    if (offset < 0) {
+        *message = "Recording is too long for the helper process.";
+        return false;
+    }
+    juce::FloatVectorOperations::copy(ring->getSamples(SharedAudioRing::Direction::ToHelper, offset), audio.getReadPointer(0), numSamples);
+
+    PendingJob job;
+    int jobId = 0;
+    {
+        const juce::ScopedLock scopedLock(lock);
+        jobId = nextJobId++;
+        pendingJobs[jobId] = &job;
+    }
+    juce::DynamicObject::Ptr request = new juce::DynamicObject();
+    request->setProperty("type", "generate");
+    request->setProperty("job", jobId);
+    request->setProperty("server", serverAddress);
+    request->setProperty("params", params);
+    request->setProperty("sampleRate", sampleRate);
+    request->setProperty("offset", offset);
+    request->setProperty("numSamples", numSamples);
+    const double startUs = tracer.nowUs();
+    bool replied = false;
+    bool cancelled = false;
+    if (sendJson(juce::var(request.get()))) {
+        const double deadline = juce::Time::getMillisecondCounterHiRes() + timeoutMs;
+        while (!replied && !cancelled && juce::Time::getMillisecondCounterHiRes() < deadline) {
+            replied = job.done.wait(kCancelCheckMs);
+            cancelled = !replied && token != nullptr && token->isCancelled();
+        }
+    }
+    {
+        const juce::ScopedLock scopedLock(lock);
+        pendingJobs.erase(jobId);
+    }
+    if (cancelled) {
+        // The helper's reply, whenever it comes, will find nobody waiting for it.
+        juce::DynamicObject::Ptr cancel = new juce::DynamicObject();
+        cancel->setProperty("type", "cancel");
+        cancel->setProperty("job", jobId);
+        sendJson(juce::var(cancel.get()));
+        *message = "Cancelled.";
+        return false;
+    }
+    if (!replied) {
+        *message = "The helper process didn't respond.";
+        return false;
+    }
+
+    // Fold the helper's own spans into our trace, shifted to when we sent the job.
+    const juce::var& events = job.reply["trace"]["traceEvents"];
+    if (const juce::Array<juce::var>* eventArray = events.getArray()) {
+        for (const juce::var& event : *eventArray) {
+            tracer.addSpan("helper " + event["name"].toString(),
+                startUs + static_cast<double>(event["ts"]), static_cast<double>(event["dur"]));
+        }
+    }
+    *message = job.reply["message"].toString();
+    if (!static_cast<bool>(job.reply["success"])) {
+        return false;
+    }
+    const int resultOffset = job.reply["offset"];
+    const int resultSamples = job.reply["numSamples"];
+    if (resultOffset < 0 || resultSamples <= 0 || resultOffset + resultSamples > ring->getCapacity()) {
+        *message = "The helper process sent back bad audio.";
+        return false;
+    }
+    *result = std::make_shared<juce::AudioBuffer<float>>(1, resultSamples);
+    (*result)->copyFrom(0, 0, ring->getSamples(SharedAudioRing::Direction::FromHelper, resultOffset), resultSamples);
+    return true;
+}
+
+void HelperProcessConnection::handleMessageFromWorker(const juce::MemoryBlock& message)
+{
+    juce::var reply = juce::JSON::parse(message.toString());
+    if (reply["type"].toString() != "result") {
+        return;
+    }
+    const juce::ScopedLock scopedLock(lock);
+    auto it = pendingJobs.find(static_cast<int>(reply["job"]));
+    if (it != pendingJobs.end()) {
+        it->second->reply = reply;
+        it->second->done.signal();
+    }
+}
+
+void HelperProcessConnection::handleConnectionLost()
+{
+    connected = false;
+    // Everybody still waiting gets a failure straight away rather than a timeout.
+    const juce::ScopedLock scopedLock(lock);
+    for (auto& [jobId, job] : pendingJobs) {
+        juce::DynamicObject::Ptr reply = new juce::DynamicObject();
+        reply->setProperty("success", false);
+        reply->setProperty("message", "The helper process exited.");
+        job->reply = juce::var(reply.get());
+        job->done.signal();
+    }
+}
+
+bool HelperProcessConnection::sendJson(const juce::var& json)
+{
+    juce::String text = juce::JSON::toString(json, true);
+    return sendMessageToWorker(juce::MemoryBlock(text.toRawUTF8(), text.getNumBytesAsUTF8()));
+}
+
+juce::File HelperProcessConnection::findHelperExecutable()
+{
+    juce::String overridePath = juce::SystemStats::getEnvironmentVariable(HelperProtocol::kExecutableEnvironmentVariable, {});
+    if (overridePath.isNotEmpty()) {
+        return juce::File(overridePath);
+    }
+    // When running as a plugin this is the plugin binary, so the helper is expected next to it.
+    return juce::File::getSpecialLocation(juce::File::currentExecutableFile)
+        .getSiblingFile(HelperProtocol::kExecutableName);
+}
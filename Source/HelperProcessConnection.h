@@ -0,0 +1,69 @@
+/*
+  ==============================================================================
+
+    HelperProcessConnection.h
+    Runs generation requests in the separate RiffusionHelper process.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "CancellationToken.h"
+#include "PerformanceTracer.h"
+#include "SharedAudioRing.h"
+
+#include <atomic>
+#include <map>
+#include <memory>
+
+//==============================================================================
+/**
+    Launches and talks to the RiffusionHelper executable, which does all of the
+    networking, JSON and base64 work outside of the DAW process. If the server
+    hangs or a malformed response crashes the decoder, only the helper goes down.
+
+    Audio goes both ways through a SharedAudioRing. The pipe only carries small
+    JSON control messages.
+*/
+class HelperProcessConnection : private juce::ChildProcessCoordinator
+{
+public:
+    HelperProcessConnection();
+    ~HelperProcessConnection() override;
+
+    // Starts the helper if it isn't already running. Returns false if it couldn't be started.
+    bool ensureRunning();
+    bool isConnected() const { return connected; }
+
+    // Same contract as RiffusionClient::generate, but runs in the helper. Blocks
+    // the calling thread until the helper replies, dies, times out or the token is
+    // cancelled, in which case the helper is told to abort the request too.
+    bool generate(const juce::String& serverAddress, const juce::var& params,
+        const juce::AudioBuffer<float>& audio, double sampleRate, int timeoutMs,
+        std::shared_ptr<juce::AudioBuffer<float>>* result, juce::String* message,
+        PerformanceTracer& tracer, CancellationToken* token = nullptr);
+
+private:
+    void handleMessageFromWorker(const juce::MemoryBlock& message) override;
+    void handleConnectionLost() override;
+    bool sendJson(const juce::var& json);
+    static juce::File findHelperExecutable();
+
+    struct PendingJob
+    {
+        juce::WaitableEvent done;
+        juce::var reply;
+    };
+    // Held while starting the helper, so two workers don't both launch one.
+    juce::CriticalSection launchLock;
+    juce::CriticalSection lock;
+    // Jobs waiting on a reply from the helper, by job id.
+    std::map<int, PendingJob*> pendingJobs;
+    int nextJobId = 1;
+    std::unique_ptr<SharedAudioRing> ring;
+    std::atomic<bool> connected { false };
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (HelperProcessConnection)
+};
@@ -0,0 +1,38 @@
+/*
+  ==============================================================================
+
+    HelperProtocol.h
+    Names shared by the plugin and the RiffusionHelper process.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+
+//==============================================================================
+// Control messages between the plugin and the helper are small JSON objects with a
+// "type" field. Audio never goes through the pipe, only offsets into the
+// SharedAudioRing.
+//
+//   plugin -> helper  {"type": "init", "ring": path, "capacity": samples}
+//   plugin -> helper  {"type": "generate", "job": id, "server": url, "params": {...},
+//                      "sampleRate": hz, "offset": o, "numSamples": n}
+//   helper -> plugin  {"type": "result", "job": id, "success": bool, "message": text,
+//                      "offset": o, "numSamples": n, "trace": {chrome trace}}
+namespace HelperProtocol {
+    // Passed on the helper's command line so it knows it was launched by us.
+    constexpr const char* kCommandLineUid = "riffusionhelper";
+    constexpr const char* kExecutableName =
+   #if JUCE_WINDOWS
+        "RiffusionHelper.exe";
+   #else
+        "RiffusionHelper";
+   #endif
+    // Overrides where the plugin looks for the helper, handy when testing.
+    constexpr const char* kExecutableEnvironmentVariable = "RIFFUSION_HELPER";
+    // Samples in each direction of the shared ring. About 95 seconds at 44100 hz.
+    constexpr int kRingCapacity = 1 << 22;
+    constexpr int kLaunchTimeoutMs = 5000;
+}  // namespace HelperProtocol
@@ -0,0 +1,123 @@
+/*
+  ==============================================================================
+
+    LookbackCapture.cpp
+    Always-on input history and a cheap onset detector for starting takes.
+
+  ==============================================================================
+*/
+
+#include "LookbackCapture.h"
+
+namespace {
+    // 5 ms, short enough that the pre-roll covers the attack.
+    constexpr double kHopSeconds = 0.005;
+    // How quickly the background level follows the input.
+    constexpr double kBackgroundSeconds = 0.3;
+    // A hop this many times the background energy (about 9 dB) is an onset...
+    constexpr float kOnsetRatio = 8.0f;
+    // ...as long as it's above -50 dBFS, so noise floor wobbles don't count.
+    constexpr float kMinOnsetEnergy = 1.0e-5f;
+    // No more onsets for this long after one is reported.
+    constexpr double kHoldOffSeconds = 0.5;
+
+    // Four independent accumulators so the compiler can keep this in SIMD registers
+    // without needing fast-math.
+    float sumOfSquares(const float* x, int n) {
+        float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+        int i = 0;
+        for (; i + 4 <= n; i += 4) {
+            s0 += x[i] * x[i];
+            s1 += x[i + 1] * x[i + 1];
+            s2 += x[i + 2] * x[i + 2];
+            s3 += x[i + 3] * x[i + 3];
+        }
+        for (; i < n; ++i) {
+            s0 += x[i] * x[i];
+        }
+        return (s0 + s1) + (s2 + s3);
+    }
+}  // namespace
+
+//==============================================================================
+void LookbackBuffer::prepare(int capacity)
+{
+    ring.assign(static_cast<size_t>(std::max(1, capacity)), 0.0f);
+    reset();
+}
+
+void LookbackBuffer::reset()
+{
+    writePos = 0;
+    numAvailable = 0;
+}
+
+void LookbackBuffer::push(const float* samples, int numSamples)
+{
+    const int capacity = static_cast<int>(ring.size());
+    // Only the newest samples can survive anyway.
+    if (numSamples > capacity) {
+        samples += numSamples - capacity;
+        numSamples = capacity;
+    }
+    const int firstPart = std::min(numSamples, capacity - writePos);
+    juce::FloatVectorOperations::copy(ring.data() + writePos, samples, firstPart);
+    juce::FloatVectorOperations::copy(ring.data(), samples + firstPart, numSamples - firstPart);
+    writePos = (writePos + numSamples) % capacity;
+    numAvailable = std::min(capacity, numAvailable + numSamples);
+}
+
+void LookbackBuffer::copyLatest(float* dest, int numSamples, int skipNewest) const
+{
+    jassert(numSamples >= 0 && numSamples + skipNewest <= numAvailable);
+    const int capacity = static_cast<int>(ring.size());
+    const int start = ((writePos - skipNewest - numSamples) % capacity + capacity) % capacity;
+    const int firstPart = std::min(numSamples, capacity - start);
+    juce::FloatVectorOperations::copy(dest, ring.data() + start, firstPart);
+    juce::FloatVectorOperations::copy(dest + firstPart, ring.data(), numSamples - firstPart);
+}
+
+//==============================================================================
+void OnsetDetector::prepare(double sampleRate)
+{
+    hopSize = std::max(16, juce::roundToInt(sampleRate * kHopSeconds));
+    backgroundCoefficient = static_cast<float>(1.0 - std::exp(-hopSize / (kBackgroundSeconds * sampleRate)));
+    holdOffLength = juce::roundToInt(kHoldOffSeconds * sampleRate / hopSize);
+    reset();
+}
+
+void OnsetDetector::reset()
+{
+    hopPosition = 0;
+    hopEnergy = 0.0f;
+    background = 0.0f;
+    holdOffHops = 0;
+}
+
+bool OnsetDetector::process(const float* samples, int numSamples, int* onsetPosition)
+{
+    bool onset = false;
+    int i = 0;
+    while (i < numSamples) {
+        const int numToAdd = std::min(numSamples - i, hopSize - hopPosition);
+        hopEnergy += sumOfSquares(samples + i, numToAdd);
+        hopPosition += numToAdd;
+        i += numToAdd;
+        if (hopPosition < hopSize) {
+            break;
+        }
+        const float energy = hopEnergy / hopSize;
+        if (holdOffHops > 0) {
+            holdOffHops--;
+        }
+        else if (!onset && energy > kMinOnsetEnergy && energy > kOnsetRatio * background) {
+            onset = true;
+            *onsetPosition = i - hopSize;
+            holdOffHops = holdOffLength;
+        }
+        background += backgroundCoefficient * (energy - background);
+        hopPosition = 0;
+        hopEnergy = 0.0f;
+    }
+    return onset;
+}
@@ -0,0 +1,82 @@
+/*
+  ==============================================================================
+
+    LookbackCapture.h
+    Always-on input history and a cheap onset detector for starting takes.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+
+#include <vector>
+
+//==============================================================================
+/**
+    Ring buffer holding the most recent input, written on every processBlock so a
+    phrase played before anyone hit "Record" can still be turned into a take.
+    Storage is allocated in prepare(); pushing and copying never allocate.
+*/
+class LookbackBuffer
+{
+public:
+    LookbackBuffer() = default;
+
+    // Not for the audio thread. Holds the last capacity samples.
+    void prepare(int capacity);
+    void reset();
+
+    // Audio thread.
+    void push(const float* samples, int numSamples);
+    // How many samples have been pushed, up to the capacity.
+    int getNumAvailable() const { return numAvailable; }
+    // Copies numSamples samples ending skipNewest samples before the newest one.
+    // The caller makes sure numSamples + skipNewest <= getNumAvailable().
+    void copyLatest(float* dest, int numSamples, int skipNewest = 0) const;
+    size_t getMemoryUsage() const { return ring.size() * sizeof(float); }
+
+private:
+    std::vector<float> ring;
+    // Where the next sample goes.
+    int writePos = 0;
+    int numAvailable = 0;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (LookbackBuffer)
+};
+
+//==============================================================================
+/**
+    Energy based onset detector. The input is cut into fixed hops, and an onset is
+    reported when a hop is much louder than the slowly tracked background level.
+    Cost is one multiply-add per sample plus a few operations per hop, so it stays
+    the same however the host slices up the blocks.
+*/
+class OnsetDetector
+{
+public:
+    OnsetDetector() = default;
+
+    void prepare(double sampleRate);
+    void reset();
+
+    // Audio thread. Returns true if there was an onset in this block, with where the
+    // hop that triggered started in onsetPosition. That's negative if the hop began
+    // in an earlier block.
+    bool process(const float* samples, int numSamples, int* onsetPosition);
+
+private:
+    int hopSize = 256;
+    // Samples of the current hop seen so far, and their summed energy.
+    int hopPosition = 0;
+    float hopEnergy = 0.0f;
+    // Mean energy per sample, tracked with a one pole filter over the hops.
+    float background = 0.0f;
+    float backgroundCoefficient = 0.0f;
+    // Hops left before another onset can be reported.
+    int holdOffHops = 0;
+    int holdOffLength = 0;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (OnsetDetector)
+};
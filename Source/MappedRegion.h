@@ -0,0 +1,49 @@
+/*
+  ==============================================================================
+
+    MappedRegion.h
+    A read only mapping of part of a file, as the take store and scratch file use.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+
+//==============================================================================
+/**
+    Maps numBytes of a file, starting at offset, read only. The OS maps whole
+    pages, so the mapping may start before offset; getData() points at offset
+    itself. Files written to be mapped like this keep what's in them on
+    kAlignment boundaries, which every platform can map from.
+*/
+class MappedRegion
+{
+public:
+    // Windows maps from 64k boundaries, everything else from smaller ones.
+    static constexpr juce::int64 kAlignment = 1 << 16;
+
+    // The first boundary at or after position.
+    static juce::int64 align(juce::int64 position)
+    {
+        return (position + kAlignment - 1) / kAlignment * kAlignment;
+    }
+
+    MappedRegion(const juce::File& file, juce::int64 offset, juce::int64 numBytes)
+        : mapping(file, { offset, offset + numBytes }, juce::MemoryMappedFile::readOnly)
+    {
+        if (mapping.getData() != nullptr) {
+            data = static_cast<const char*>(mapping.getData()) + (offset - mapping.getRange().getStart());
+        }
+    }
+
+    // nullptr if the file couldn't be mapped.
+    const char* getData() const { return data; }
+
+private:
+    juce::MemoryMappedFile mapping;
+    const char* data = nullptr;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (MappedRegion)
+};
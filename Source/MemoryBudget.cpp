@@ -0,0 +1,204 @@
+/*
+  ==============================================================================
+
+    MemoryBudget.cpp
+    Caps the memory held by every plugin instance, spilling idle takes to disk.
+
+  ==============================================================================
+*/
+
+#include "MemoryBudget.h"
+#include "MappedRegion.h"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+namespace {
+    constexpr int kCheckIntervalMs = 2000;
+    // Audio used more recently than this is never spilled, however tight the budget.
+    constexpr juce::uint32 kIdleMs = 60000;
+
+    size_t readBudget() {
+        const int megabytes = juce::SystemStats::getEnvironmentVariable("RIFFUSION_MEMORY_BUDGET_MB", {}).getIntValue();
+        return static_cast<size_t>(megabytes > 0 ? megabytes : MemoryBudget::kDefaultBudgetMB) << 20;
+    }
+}  // namespace
+
+//==============================================================================
+MemoryBudget::SpilledBuffer::SpilledBuffer(MemoryBudget& budgetToUse, juce::Range<juce::int64> regionToUse,
+    int channels, int samples)
+    : owner(budgetToUse), region(regionToUse), numChannels(channels), numSamples(samples)
+{
+}
+
+MemoryBudget::SpilledBuffer::~SpilledBuffer()
+{
+    owner.release(region);
+}
+
+bool MemoryBudget::SpilledBuffer::restore(juce::AudioBuffer<float>& dest) const
+{
+    const juce::int64 numBytes = static_cast<juce::int64>(getNumBytes());
+    dest.setSize(numChannels, numSamples);
+    if (numBytes == 0) {
+        return true;
+    }
+    const MappedRegion mapped(owner.scratchFile, region.getStart(), numBytes);
+    const char* data = mapped.getData();
+    if (data == nullptr) {
+        return false;
+    }
+    const size_t channelBytes = static_cast<size_t>(numSamples) * sizeof(float);
+    for (int channel = 0; channel < numChannels; ++channel) {
+        std::memcpy(dest.getWritePointer(channel), data + channel * channelBytes, channelBytes);
+    }
+    return true;
+}
+
+//==============================================================================
+MemoryBudget::MemoryBudget() : budget(readBudget())
+{
+    startTimer(kCheckIntervalMs);
+}
+
+MemoryBudget::~MemoryBudget()
+{
+    stopTimer();
+    if (scratchFile != juce::File()) {
+        scratchFile.deleteFile();
+    }
+}
+
+void MemoryBudget::addClient(Client* client)
+{
+    const juce::ScopedLock scopedLock(clientsLock);
+    clients.addIfNotAlreadyThere(client);
+}
+
+void MemoryBudget::removeClient(Client* client)
+{
+    const juce::ScopedLock scopedLock(clientsLock);
+    clients.removeFirstMatchingValue(client);
+}
+
+std::unique_ptr<MemoryBudget::SpilledBuffer> MemoryBudget::spill(const juce::AudioBuffer<float>& buffer)
+{
+    const juce::int64 numBytes = static_cast<juce::int64>(buffer.getNumChannels()) * buffer.getNumSamples() * sizeof(float);
+    // Spills start on a boundary every platform can map from.
+    const juce::int64 regionSize = MappedRegion::align(numBytes);
+    const juce::ScopedLock scopedLock(scratchLock);
+    if (scratchFile == juce::File()) {
+        scratchFile = juce::File::getSpecialLocation(juce::File::tempDirectory)
+            .getNonexistentChildFile("RiffusionScratch", ".bin", false);
+        if (!scratchFile.create()) {
+            scratchFile = juce::File();
+            return nullptr;
+        }
+    }
+    // First fit among the freed regions, otherwise on the end of the file.
+    juce::Range<juce::int64> region;
+    auto reusable = std::find_if(freeRegions.begin(), freeRegions.end(),
+        [regionSize](const juce::Range<juce::int64>& free) { return free.getLength() >= regionSize; });
+    if (reusable != freeRegions.end()) {
+        region = reusable->withLength(regionSize);
+        if (reusable->getLength() > regionSize) {
+            *reusable = reusable->withStart(region.getEnd());
+        }
+        else {
+            freeRegions.erase(reusable);
+        }
+    }
+    else {
+        region = { scratchEnd, scratchEnd + regionSize };
+        scratchEnd = region.getEnd();
+    }
+
+    juce::FileOutputStream out(scratchFile);
+    bool written = out.openedOk() && out.setPosition(region.getStart());
+    for (int channel = 0; written && channel < buffer.getNumChannels(); ++channel) {
+        written = out.write(buffer.getReadPointer(channel), static_cast<size_t>(buffer.getNumSamples()) * sizeof(float));
+    }
+    if (written) {
+        out.flush();
+        written = out.getStatus().wasOk();
+    }
+    if (!written) {
+        freeRegions.push_back(region);
+        return nullptr;
+    }
+    return std::unique_ptr<SpilledBuffer>(new SpilledBuffer(*this, region, buffer.getNumChannels(), buffer.getNumSamples()));
+}
+
+void MemoryBudget::release(juce::Range<juce::int64> region)
+{
+    const juce::ScopedLock scopedLock(scratchLock);
+    freeRegions.push_back(region);
+}
+
+//==============================================================================
+size_t MemoryBudget::getTotalUsage()
+{
+    const juce::ScopedLock scopedLock(clientsLock);
+    size_t total = 0;
+    for (Client* client : clients) {
+        total += client->getMemoryUsage();
+    }
+    return total;
+}
+
+int MemoryBudget::getNumClients()
+{
+    const juce::ScopedLock scopedLock(clientsLock);
+    return clients.size();
+}
+
+int MemoryBudget::getNumSpilled()
+{
+    const juce::ScopedLock scopedLock(clientsLock);
+    int numSpilled = 0;
+    for (Client* client : clients) {
+        numSpilled += client->isSpilled() ? 1 : 0;
+    }
+    return numSpilled;
+}
+
+juce::int64 MemoryBudget::getScratchFileSize()
+{
+    const juce::ScopedLock scopedLock(scratchLock);
+    return scratchEnd;
+}
+
+void MemoryBudget::timerCallback()
+{
+    // Held throughout, so a client can't be deleted while it's spilling.
+    const juce::ScopedLock scopedLock(clientsLock);
+    size_t total = 0;
+    for (Client* client : clients) {
+        total += client->getMemoryUsage();
+    }
+    if (total <= budget) {
+        return;
+    }
+    const juce::uint32 now = juce::Time::getMillisecondCounter();
+    std::vector<std::pair<juce::uint32, Client*>> idle;
+    for (Client* client : clients) {
+        const juce::uint32 lastUsed = client->getLastUsedMs();
+        if (client->getSpillableBytes() > 0 && now - lastUsed >= kIdleMs) {
+            idle.emplace_back(lastUsed, client);
+        }
+    }
+    // Least recently used first.
+    std::sort(idle.begin(), idle.end(),
+        [now](const std::pair<juce::uint32, Client*>& a, const std::pair<juce::uint32, Client*>& b) {
+            return now - a.first > now - b.first;
+        });
+    for (const auto& entry : idle) {
+        if (total <= budget) {
+            break;
+        }
+        const size_t before = entry.second->getMemoryUsage();
+        entry.second->spill();
+        total -= before - std::min(before, entry.second->getMemoryUsage());
+    }
+}
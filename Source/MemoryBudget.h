@@ -0,0 +1,109 @@
+/*
+  ==============================================================================
+
+    MemoryBudget.h
+    Caps the memory held by every plugin instance, spilling idle takes to disk.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+
+#include <memory>
+#include <vector>
+
+//==============================================================================
+/**
+    One budget shared by every plugin instance in the process (through
+    juce::SharedResourcePointer). Instances register as clients and report what
+    they hold. Every few seconds, if the total is over the budget, the clients
+    that have gone longest without using their spillable audio are asked to spill
+    it, oldest first, until the total fits again.
+
+    Spilled audio goes to a scratch file in the temp directory, shared by every
+    client. Space freed by one spill is reused by the next, and the file is
+    deleted when the last instance goes. Reading a spill back maps just its part
+    of the file, so nothing stays resident once it's been copied out.
+
+    The budget defaults to kDefaultBudgetMB, and can be set in megabytes with the
+    RIFFUSION_MEMORY_BUDGET_MB environment variable.
+*/
+class MemoryBudget : private juce::Timer
+{
+public:
+    static constexpr int kDefaultBudgetMB = 512;
+
+    class Client
+    {
+    public:
+        virtual ~Client() = default;
+        // Bytes held right now, spilled or not.
+        virtual size_t getMemoryUsage() = 0;
+        // Bytes spill() would free, or 0 if now isn't a good time (e.g. it's playing).
+        virtual size_t getSpillableBytes() = 0;
+        // Millisecond counter of the last time the spillable audio was used.
+        virtual juce::uint32 getLastUsedMs() = 0;
+        virtual bool isSpilled() = 0;
+        // Message thread. Moves what it can to the scratch file.
+        virtual void spill() = 0;
+    };
+
+    // A buffer written to the scratch file. Its space is freed when this is deleted.
+    class SpilledBuffer
+    {
+    public:
+        ~SpilledBuffer();
+
+        // Any thread but the audio thread. Reads the buffer back into dest, resizing
+        // it to fit. Returns false if the scratch file couldn't be read.
+        bool restore(juce::AudioBuffer<float>& dest) const;
+        size_t getNumBytes() const { return static_cast<size_t>(numChannels) * numSamples * sizeof(float); }
+
+    private:
+        friend class MemoryBudget;
+        SpilledBuffer(MemoryBudget& owner, juce::Range<juce::int64> region, int numChannels, int numSamples);
+
+        MemoryBudget& owner;
+        juce::Range<juce::int64> region;
+        int numChannels = 0;
+        int numSamples = 0;
+
+        JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (SpilledBuffer)
+    };
+
+    MemoryBudget();
+    ~MemoryBudget() override;
+
+    void addClient(Client* client);
+    void removeClient(Client* client);
+
+    // Any thread but the audio thread. Writes the buffer to the scratch file, or
+    // returns nullptr if it couldn't be written. The budget has to outlive the spill.
+    std::unique_ptr<SpilledBuffer> spill(const juce::AudioBuffer<float>& buffer);
+
+    size_t getBudget() const { return budget; }
+    // What every client holds, spilled audio not included.
+    size_t getTotalUsage();
+    int getNumClients();
+    int getNumSpilled();
+    // Size of the scratch file, including space waiting to be reused.
+    juce::int64 getScratchFileSize();
+
+private:
+    void timerCallback() override;
+    void release(juce::Range<juce::int64> region);
+
+    const size_t budget;
+    juce::CriticalSection clientsLock;
+    juce::Array<Client*> clients;
+
+    juce::CriticalSection scratchLock;
+    juce::File scratchFile;
+    juce::int64 scratchEnd = 0;
+    // Parts of the scratch file no spill is using, to be handed out again.
+    std::vector<juce::Range<juce::int64>> freeRegions;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (MemoryBudget)
+};
@@ -0,0 +1,304 @@
+/*
+  ==============================================================================
+
+    MorphEngine.cpp
+    Blends generated takes in the STFT domain, without asking the server again.
+
+  ==============================================================================
+*/
+
+#include "MorphEngine.h"
+
+namespace {
+    // Frames overlapping any one sample.
+    constexpr int kOverlap = MorphEngine::fftSize / MorphEngine::hopSize;
+    // A periodic Hann window squared sums to 1.5 at 75% overlap.
+    constexpr float kOverlapGain = 1.5f;
+    // When synced to the DAW the start sample comes from the play head, which can be a
+    // sample or two off from where the last block ended. Seeking costs a few inverse
+    // FFTs, so offsets up to this are played through instead.
+    constexpr int kSeekToleranceSamples = 64;
+}  // namespace
+
+//==============================================================================
+MorphEngine::MorphEngine()
+    : analysisFft(fftOrder),
+      analysisData(2 * fftSize),
+      synthesisFft(fftOrder),
+      synthesisData(2 * fftSize),
+      accumulator(fftSize),
+      finished(hopSize),
+      analysisWindow(fftSize),
+      synthesisWindow(fftSize)
+{
+    for (int i = 0; i < fftSize; ++i) {
+        analysisWindow[i] = 0.5f - 0.5f * std::cos(juce::MathConstants<float>::twoPi * i / fftSize);
+        synthesisWindow[i] = analysisWindow[i] / kOverlapGain;
+    }
+    worker->addClient(this);
+}
+
+MorphEngine::~MorphEngine()
+{
+    worker->removeClient(this);
+}
+
+void MorphEngine::addTake(std::shared_ptr<const juce::AudioBuffer<float>> take, bool startNewSet)
+{
+    if (take == nullptr || take->getNumSamples() == 0 || take->getNumChannels() == 0) {
+        return;
+    }
+    {
+        const juce::ScopedLock scopedLock(takesLock);
+        if (startNewSet) {
+            takes.clear();
+            spilledTakes.clear();
+            numSpilledTakes = 0;
+        }
+        restoreSpilledTakes();
+        takes.push_back(std::move(take));
+        if (static_cast<int>(takes.size()) > maxTakes) {
+            takes.erase(takes.begin());
+        }
+        ++takesVersion;
+    }
+    worker->wake();
+}
+
+bool MorphEngine::suspend(MemoryBudget& budget)
+{
+    {
+        const juce::ScopedLock scopedLock(takesLock);
+        if (takes.empty()) {
+            return true;
+        }
+        std::vector<std::unique_ptr<MemoryBudget::SpilledBuffer>> spilled;
+        for (const auto& take : takes) {
+            auto written = budget.spill(*take);
+            if (written == nullptr) {
+                return false;
+            }
+            spilled.push_back(std::move(written));
+        }
+        spilledTakes = std::move(spilled);
+        numSpilledTakes = static_cast<int>(spilledTakes.size());
+        takes.clear();
+        ++takesVersion;
+    }
+    // The worker drops the spectra when it sees there are no takes.
+    worker->wake();
+    return true;
+}
+
+void MorphEngine::resume()
+{
+    {
+        const juce::ScopedLock scopedLock(takesLock);
+        if (spilledTakes.empty()) {
+            return;
+        }
+        restoreSpilledTakes();
+        ++takesVersion;
+    }
+    worker->wake();
+}
+
+void MorphEngine::restoreSpilledTakes()
+{
+    for (const auto& spilled : spilledTakes) {
+        auto take = std::make_shared<juce::AudioBuffer<float>>();
+        if (spilled->restore(*take)) {
+            takes.push_back(std::move(take));
+        }
+    }
+    spilledTakes.clear();
+    numSpilledTakes = 0;
+}
+
+size_t MorphEngine::getMemoryUsage() const
+{
+    size_t bytes = analysedBytes;
+    const juce::ScopedLock scopedLock(takesLock);
+    for (const auto& take : takes) {
+        bytes += static_cast<size_t>(take->getNumChannels()) * take->getNumSamples() * sizeof(float);
+    }
+    return bytes;
+}
+
+int MorphEngine::getNumFrames(int numSamples)
+{
+    return (numSamples + hopSize - 1) / hopSize + kOverlap - 1;
+}
+
+//==============================================================================
+bool MorphEngine::doWork()
+{
+    handoff.collectGarbage();
+    if (takesVersion.load() == analysedVersion) {
+        return false;
+    }
+    if (takesVersion.load() != pendingVersion) {
+        // Start over with the takes as they are now.
+        const juce::ScopedLock scopedLock(takesLock);
+        pendingTakes = takes;
+        pendingVersion = takesVersion.load();
+        pendingAnalysed.clear();
+    }
+    // Takes that were analysed before are picked up as they are. At most one new
+    // one is analysed per slice.
+    while (pendingAnalysed.size() < pendingTakes.size()) {
+        const auto& take = pendingTakes[pendingAnalysed.size()];
+        std::shared_ptr<const Spectrum> spectrum;
+        for (const auto& entry : analysed) {
+            if (entry.first == take) {
+                spectrum = entry.second;
+                break;
+            }
+        }
+        if (spectrum != nullptr) {
+            pendingAnalysed.emplace_back(take, std::move(spectrum));
+            continue;
+        }
+        auto fresh = std::make_shared<Spectrum>();
+        analyse(*take, *fresh);
+        pendingAnalysed.emplace_back(take, std::move(fresh));
+        return true;
+    }
+    auto next = std::make_unique<Analysis>();
+    next->version = pendingVersion;
+    size_t bytes = 0;
+    for (const auto& entry : pendingAnalysed) {
+        next->takes.push_back(entry.second);
+        next->numFrames = std::max(next->numFrames, getNumFrames(entry.first->getNumSamples()));
+        bytes += entry.second->size() * sizeof(std::complex<float>);
+    }
+    analysed = std::move(pendingAnalysed);
+    pendingAnalysed.clear();
+    pendingTakes.clear();
+    analysedBytes = bytes;
+    numAnalysedTakes = static_cast<int>(next->takes.size());
+    handoff.publish(std::move(next));
+    analysedVersion = pendingVersion;
+    return true;
+}
+
+void MorphEngine::analyse(const juce::AudioBuffer<float>& take, Spectrum& spectrum)
+{
+    const int numSamples = take.getNumSamples();
+    const int numFrames = getNumFrames(numSamples);
+    const float* samples = take.getReadPointer(0);
+    spectrum.resize(static_cast<size_t>(numFrames) * numBins);
+    for (int frame = 0; frame < numFrames; ++frame) {
+        // The first few frames hang off the start of the take, the last few off the end.
+        const int start = (frame - (kOverlap - 1)) * hopSize;
+        const int first = std::max(0, -start);
+        const int last = std::min(fftSize, numSamples - start);
+        std::fill(analysisData.begin(), analysisData.end(), 0.0f);
+        if (last > first) {
+            juce::FloatVectorOperations::multiply(analysisData.data() + first, samples + start + first,
+                analysisWindow.data() + first, last - first);
+        }
+        analysisFft.performRealOnlyForwardTransform(analysisData.data(), true);
+        std::complex<float>* bins = spectrum.data() + static_cast<size_t>(frame) * numBins;
+        for (int bin = 0; bin < numBins; ++bin) {
+            bins[bin] = { analysisData[2 * bin], analysisData[2 * bin + 1] };
+        }
+    }
+}
+
+//==============================================================================
+bool MorphEngine::render(float* dest, int startSample, int numSamples, float amount)
+{
+    const Analysis* analysis = handoff.acquire();
+    if (analysis == nullptr || analysis->takes.size() < 2 || startSample < 0) {
+        return false;
+    }
+    amount = juce::jlimit(0.0f, 1.0f, amount);
+    if (analysis->version != renderedVersion || std::abs(startSample - nextSample) > kSeekToleranceSamples) {
+        seek(*analysis, startSample, amount);
+        renderedVersion = analysis->version;
+    }
+    else {
+        // Close enough to carry on from where the last block ended.
+        startSample = nextSample;
+    }
+    int written = 0;
+    while (written < numSamples) {
+        if (finishedPos == hopSize) {
+            addFrame(*analysis, accumulatorHop, amount);
+            advance();
+        }
+        const int numToCopy = std::min(numSamples - written, hopSize - finishedPos);
+        juce::FloatVectorOperations::copy(dest + written, finished.data() + finishedPos, numToCopy);
+        finishedPos += numToCopy;
+        written += numToCopy;
+    }
+    nextSample = startSample + numSamples;
+    return true;
+}
+
+void MorphEngine::seek(const Analysis& analysis, int startSample, float amount)
+{
+    // The hop containing startSample is finished once the frames starting in the
+    // hops before it have been added, so those are synthesised first.
+    const int hop = startSample / hopSize;
+    std::fill(accumulator.begin(), accumulator.end(), 0.0f);
+    accumulatorHop = hop - (kOverlap - 1);
+    while (accumulatorHop < hop) {
+        addFrame(analysis, accumulatorHop, amount);
+        advance();
+    }
+    addFrame(analysis, accumulatorHop, amount);
+    advance();
+    finishedPos = startSample - hop * hopSize;
+}
+
+void MorphEngine::addFrame(const Analysis& analysis, int hop, float amount)
+{
+    const int frame = hop + kOverlap - 1;
+    if (frame < 0 || frame >= analysis.numFrames) {
+        return;
+    }
+    // Only the two takes either side of the amount take part.
+    const int numTakes = static_cast<int>(analysis.takes.size());
+    const float position = amount * (numTakes - 1);
+    const int lower = std::min(static_cast<int>(position), numTakes - 2);
+    const float fraction = position - lower;
+    const Spectrum& a = *analysis.takes[lower];
+    const Spectrum& b = *analysis.takes[lower + 1];
+    const size_t offset = static_cast<size_t>(frame) * numBins;
+    // Takes can be different lengths. Past the end of one, it's silence.
+    const bool hasA = offset < a.size();
+    const bool hasB = offset < b.size();
+    if (!hasA && !hasB) {
+        return;
+    }
+    for (int bin = 0; bin < numBins; ++bin) {
+        const std::complex<float> x = hasA ? a[offset + bin] : std::complex<float>();
+        const std::complex<float> y = hasB ? b[offset + bin] : std::complex<float>();
+        const float magnitudeA = std::sqrt(std::norm(x));
+        const float magnitudeB = std::sqrt(std::norm(y));
+        const float weightedA = (1.0f - fraction) * magnitudeA;
+        const float weightedB = fraction * magnitudeB;
+        // Interpolated magnitude, with the phase of whichever take dominates the bin.
+        const bool useA = weightedA >= weightedB;
+        const float dominantMagnitude = useA ? magnitudeA : magnitudeB;
+        std::complex<float> out;
+        if (dominantMagnitude > 0.0f) {
+            out = (useA ? x : y) * ((weightedA + weightedB) / dominantMagnitude);
+        }
+        synthesisData[2 * bin] = out.real();
+        synthesisData[2 * bin + 1] = out.imag();
+    }
+    synthesisFft.performRealOnlyInverseTransform(synthesisData.data());
+    juce::FloatVectorOperations::addWithMultiply(accumulator.data(), synthesisData.data(), synthesisWindow.data(), fftSize);
+}
+
+void MorphEngine::advance()
+{
+    juce::FloatVectorOperations::copy(finished.data(), accumulator.data(), hopSize);
+    std::copy(accumulator.begin() + hopSize, accumulator.end(), accumulator.begin());
+    std::fill(accumulator.end() - hopSize, accumulator.end(), 0.0f);
+    ++accumulatorHop;
+    finishedPos = 0;
+}
@@ -0,0 +1,153 @@
+/*
+  ==============================================================================
+
+    MorphEngine.h
+    Blends generated takes in the STFT domain, without asking the server again.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "BackgroundWorker.h"
+#include "MemoryBudget.h"
+#include "RealtimeHandoff.h"
+
+#include <atomic>
+#include <complex>
+#include <memory>
+#include <vector>
+
+//==============================================================================
+/**
+    Morphs between the last few takes generated from the same recording, so the
+    blend between prompts can be swept (or automated by the host) in real time.
+
+    Each take is analysed once, on the shared BackgroundWorker, into a sequence of
+    STFT frames. Playback then synthesises one frame per hop on the audio thread: the
+    magnitudes of the two neighbouring takes are interpolated, and each bin keeps
+    the phase of whichever take contributes more to it. Borrowing phases rather
+    than accumulating them keeps every frame independent of the last, so playback
+    can jump anywhere (e.g. when the DAW relocates) and a take played at either
+    end of the range comes back exactly as it was generated.
+*/
+class MorphEngine : private BackgroundWorker::Client
+{
+public:
+    static constexpr int fftOrder = 11;
+    static constexpr int fftSize = 1 << fftOrder;
+    // 75% overlap, so a frame synthesised with a new morph amount fades in over
+    // four hops.
+    static constexpr int hopSize = fftSize / 4;
+    static constexpr int numBins = fftSize / 2 + 1;
+    // Older takes are dropped when a new one arrives.
+    static constexpr int maxTakes = 4;
+
+    MorphEngine();
+    ~MorphEngine() override;
+
+    // Any thread but the audio thread. Adds a take to morph between, or if
+    // startNewSet is true, replaces all the takes with this one.
+    void addTake(std::shared_ptr<const juce::AudioBuffer<float>> take, bool startNewSet);
+
+    // Audio thread. Lock free. Writes numSamples of the morph, starting at
+    // startSample in the takes, into dest. amount goes from the oldest take at 0
+    // to the newest at 1. Returns false, and leaves dest alone, until at least two
+    // takes have been analysed.
+    bool render(float* dest, int startSample, int numSamples, float amount);
+    // Audio thread. Lock free. Moves on to the newest analysis without rendering, so
+    // the one it replaces can be freed.
+    void acquire() { handoff.acquire(); }
+    // Any thread but the audio thread. Frees analyses the audio thread has moved on from.
+    void collectGarbage() { handoff.collectGarbage(); }
+
+    // Any thread. How many takes are ready to be morphed between.
+    int getNumTakes() const { return numAnalysedTakes; }
+
+    // Any thread but the audio thread. Writes the takes to the budget's scratch file
+    // and frees them, along with their analysis, until resume() (or a new take)
+    // reads them back. Nothing can be morphed in between. Returns false, and keeps
+    // everything as it was, if the takes couldn't be written.
+    bool suspend(MemoryBudget& budget);
+    void resume();
+    bool isSuspended() const { return numSpilledTakes > 0; }
+    // Any thread but the audio thread. Bytes held by the takes and their analysis.
+    size_t getMemoryUsage() const;
+
+private:
+    // One analysed take: numFrames * numBins bins, frame by frame.
+    using Spectrum = std::vector<std::complex<float>>;
+
+    struct Analysis
+    {
+        // Oldest first.
+        std::vector<std::shared_ptr<const Spectrum>> takes;
+        int numFrames = 0;
+        // The takesVersion this was made from.
+        int version = -1;
+    };
+
+    // BackgroundWorker::Client. Analyses one take, or publishes the analysis once
+    // every take has been.
+    bool doWork() override;
+    void analyse(const juce::AudioBuffer<float>& take, Spectrum& spectrum);
+    // Number of frames needed to cover numSamples. The first frames start before
+    // the take, so every sample is covered by the same number of frames.
+    static int getNumFrames(int numSamples);
+    // Reads suspended takes back in. Called with takesLock held.
+    void restoreSpilledTakes();
+
+    // Audio thread. Synthesises the frame starting at hop and adds it to the
+    // accumulator.
+    void addFrame(const Analysis& analysis, int hop, float amount);
+    // Audio thread. Moves the accumulator on by a hop, keeping the finished samples.
+    void advance();
+    // Audio thread. Prepares to render from startSample.
+    void seek(const Analysis& analysis, int startSample, float amount);
+
+    juce::SharedResourcePointer<BackgroundWorker> worker;
+    juce::CriticalSection takesLock;
+    std::vector<std::shared_ptr<const juce::AudioBuffer<float>>> takes;
+    // The takes while suspended, oldest first.
+    std::vector<std::unique_ptr<MemoryBudget::SpilledBuffer>> spilledTakes;
+    std::atomic<int> numSpilledTakes { 0 };
+    // Bumped every time the takes change.
+    std::atomic<int> takesVersion { 0 };
+    std::atomic<int> numAnalysedTakes { 0 };
+    std::atomic<size_t> analysedBytes { 0 };
+    RealtimeHandoff<Analysis> handoff;
+
+    // Used by the worker.
+    juce::dsp::FFT analysisFft;
+    std::vector<float> analysisData;
+    // Takes already analysed, kept so a new take doesn't mean analysing them all again.
+    using AnalysedTakes = std::vector<std::pair<std::shared_ptr<const juce::AudioBuffer<float>>, std::shared_ptr<const Spectrum>>>;
+    AnalysedTakes analysed;
+    int analysedVersion = -1;
+    // The takes being analysed for the next publish, and how far along that is.
+    std::vector<std::shared_ptr<const juce::AudioBuffer<float>>> pendingTakes;
+    AnalysedTakes pendingAnalysed;
+    int pendingVersion = -1;
+
+    // Used by the audio thread. Allocated up front.
+    juce::dsp::FFT synthesisFft;
+    std::vector<float> synthesisData;
+    // Overlap-add of the frames covering the fftSize samples from accumulatorHop on.
+    std::vector<float> accumulator;
+    // The last finished hop of output, and how much of it has been handed out.
+    std::vector<float> finished;
+    int finishedPos = hopSize;
+    // Hop index of the start of the accumulator.
+    int accumulatorHop = 0;
+    // Where the next render is expected to start, and the version of the analysis
+    // it was rendering. Anything else means seeking, unless it's only off by a few
+    // samples, which is the DAW's sample position jittering.
+    int nextSample = -1;
+    int renderedVersion = -1;
+    // Periodic Hann. The synthesis window is scaled so the overlap-add sums to one.
+    std::vector<float> analysisWindow;
+    std::vector<float> synthesisWindow;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (MorphEngine)
+};
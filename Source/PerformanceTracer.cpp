@@ -0,0 +1,155 @@
+/*
+  ==============================================================================
+
+    PerformanceTracer.cpp
+    Timing spans for the generation lifecycle and a processBlock histogram.
+
+  ==============================================================================
+*/
+
+#include "PerformanceTracer.h"
+
+namespace {
+    constexpr size_t kMaxSpans = 4096;
+
+    juce::int64 currentThreadId() {
+        return static_cast<juce::int64>(reinterpret_cast<juce::pointer_sized_int>(juce::Thread::getCurrentThreadId()));
+    }
+}  // namespace
+
+//==============================================================================
+PerformanceTracer::PerformanceTracer() : originMs(juce::Time::getMillisecondCounterHiRes())
+{
+    clear();
+}
+
+double PerformanceTracer::nowUs() const
+{
+    return (juce::Time::getMillisecondCounterHiRes() - originMs) * 1000.0;
+}
+
+void PerformanceTracer::addSpan(const juce::String& name, double startUs, double durationUs)
+{
+    const juce::ScopedLock scopedLock(lock);
+    spans.push_back({ name, startUs, durationUs, currentThreadId() });
+    while (spans.size() > kMaxSpans) {
+        spans.pop_front();
+    }
+}
+
+void PerformanceTracer::addProcessBlock(double durationUs, int numSamples)
+{
+    int bucket = 0;
+    while (bucket < numHistogramBuckets - 1 && durationUs >= static_cast<double>(1 << bucket)) {
+        bucket++;
+    }
+    processBlockHistogram[bucket]++;
+    // There's only ever one audio thread writing these, so load/store is enough.
+    processBlockTotalUs.store(processBlockTotalUs.load() + durationUs);
+    processBlockTotalSamples.store(processBlockTotalSamples.load() + numSamples);
+    if (durationUs > processBlockWorstUs.load()) {
+        processBlockWorstUs.store(durationUs);
+    }
+}
+
+juce::String PerformanceTracer::getHudText() const
+{
+    juce::String text;
+    {
+        // Latest duration of every span name, in the order they were last seen.
+        const juce::ScopedLock scopedLock(lock);
+        juce::StringArray names;
+        juce::Array<double> durations;
+        for (auto it = spans.rbegin(); it != spans.rend(); ++it) {
+            if (!names.contains(it->name)) {
+                names.add(it->name);
+                durations.add(it->durationUs);
+            }
+        }
+        for (int i = names.size() - 1; i >= 0; --i) {
+            text << names[i] << ": " << juce::String(durations[i] / 1000.0, 2) << " ms\n";
+        }
+    }
+    juce::int64 numSamples = processBlockTotalSamples.load();
+    if (numSamples > 0) {
+        text << "processBlock: " << juce::String(processBlockTotalUs.load() * 1000.0 / numSamples, 1) << " ns/sample, worst "
+             << juce::String(processBlockWorstUs.load(), 0) << " us\n";
+    }
+    for (int bucket = 0; bucket < numHistogramBuckets; ++bucket) {
+        juce::uint32 count = processBlockHistogram[bucket].load();
+        if (count == 0) {
+            continue;
+        }
+        juce::String range = (bucket == numHistogramBuckets - 1)
+            ? ">= " + juce::String(1 << (bucket - 1)) + " us"
+            : "< " + juce::String(1 << bucket) + " us";
+        text << "  " << range << ": " << juce::String(count) << "\n";
+    }
+    return text;
+}
+
+juce::String PerformanceTracer::toChromeTraceJson() const
+{
+    juce::Array<juce::var> events;
+    {
+        const juce::ScopedLock scopedLock(lock);
+        for (const Span& span : spans) {
+            juce::DynamicObject::Ptr event = new juce::DynamicObject();
+            event->setProperty("name", span.name);
+            event->setProperty("cat", "generation");
+            event->setProperty("ph", "X");
+            event->setProperty("ts", span.startUs);
+            event->setProperty("dur", span.durationUs);
+            event->setProperty("pid", 1);
+            event->setProperty("tid", span.threadId);
+            events.add(juce::var(event.get()));
+        }
+    }
+    juce::Array<juce::var> histogram;
+    for (const auto& bucket : processBlockHistogram) {
+        histogram.add(static_cast<int>(bucket.load()));
+    }
+    juce::DynamicObject::Ptr otherData = new juce::DynamicObject();
+    otherData->setProperty("processBlockHistogramLog2Us", histogram);
+    otherData->setProperty("processBlockWorstUs", processBlockWorstUs.load());
+
+    juce::DynamicObject::Ptr trace = new juce::DynamicObject();
+    trace->setProperty("traceEvents", events);
+    trace->setProperty("displayTimeUnit", "ms");
+    trace->setProperty("otherData", juce::var(otherData.get()));
+    return juce::JSON::toString(juce::var(trace.get()));
+}
+
+void PerformanceTracer::clear()
+{
+    const juce::ScopedLock scopedLock(lock);
+    spans.clear();
+    for (auto& bucket : processBlockHistogram) {
+        bucket.store(0);
+    }
+    processBlockTotalUs.store(0.0);
+    processBlockTotalSamples.store(0);
+    processBlockWorstUs.store(0.0);
+}
+
+//==============================================================================
+PerformanceTracer::ScopedSpan::ScopedSpan(PerformanceTracer& t, const juce::String& n)
+    : tracer(t), name(n), startUs(t.nowUs())
+{
+}
+
+PerformanceTracer::ScopedSpan::~ScopedSpan()
+{
+    tracer.addSpan(name, startUs, tracer.nowUs() - startUs);
+}
+
+PerformanceTracer::ScopedBlockTimer::ScopedBlockTimer(PerformanceTracer& t, int n)
+    : tracer(t), numSamples(n), startTicks(juce::Time::getHighResolutionTicks())
+{
+}
+
+PerformanceTracer::ScopedBlockTimer::~ScopedBlockTimer()
+{
+    double seconds = juce::Time::highResolutionTicksToSeconds(juce::Time::getHighResolutionTicks() - startTicks);
+    tracer.addProcessBlock(seconds * 1.0e6, numSamples);
+}
@@ -0,0 +1,93 @@
+/*
+  ==============================================================================
+
+    PerformanceTracer.h
+    Timing spans for the generation lifecycle and a processBlock histogram.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+
+#include <array>
+#include <atomic>
+#include <deque>
+
+//==============================================================================
+/**
+    Collects named timing spans (recording encode, URL building, the phases of the
+    HTTP request, decoding, ...) plus a histogram of processBlock durations. The
+    spans can be shown in the editor HUD or exported in the Chrome trace event
+    format, which chrome://tracing and Perfetto can open.
+*/
+class PerformanceTracer
+{
+public:
+    // Bucket i counts blocks that took between 2^(i-1) and 2^i microseconds. The
+    // last bucket catches everything slower.
+    static constexpr int numHistogramBuckets = 16;
+
+    PerformanceTracer();
+
+    // Microseconds since the tracer was created.
+    double nowUs() const;
+
+    // Records a finished span. Not for the audio thread.
+    void addSpan(const juce::String& name, double startUs, double durationUs);
+
+    // Records one processBlock call. Lock free, safe to call from the audio thread.
+    void addProcessBlock(double durationUs, int numSamples);
+
+    // Multi-line summary for the editor HUD.
+    juce::String getHudText() const;
+
+    // All recorded spans as a Chrome trace JSON document.
+    juce::String toChromeTraceJson() const;
+
+    void clear();
+
+    // Records a span covering its own lifetime.
+    class ScopedSpan
+    {
+    public:
+        ScopedSpan(PerformanceTracer& tracer, const juce::String& name);
+        ~ScopedSpan();
+    private:
+        PerformanceTracer& tracer;
+        juce::String name;
+        double startUs;
+    };
+
+    // Times a processBlock call, including any early returns.
+    class ScopedBlockTimer
+    {
+    public:
+        ScopedBlockTimer(PerformanceTracer& tracer, int numSamples);
+        ~ScopedBlockTimer();
+    private:
+        PerformanceTracer& tracer;
+        int numSamples;
+        juce::int64 startTicks;
+    };
+
+private:
+    struct Span
+    {
+        juce::String name;
+        double startUs;
+        double durationUs;
+        juce::int64 threadId;
+    };
+    const double originMs;
+    mutable juce::CriticalSection lock;
+    // Oldest spans are dropped once this gets too long.
+    std::deque<Span> spans;
+    std::array<std::atomic<juce::uint32>, numHistogramBuckets> processBlockHistogram;
+    std::atomic<double> processBlockTotalUs { 0.0 };
+    std::atomic<juce::int64> processBlockTotalSamples { 0 };
+    std::atomic<double> processBlockWorstUs { 0.0 };
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (PerformanceTracer)
+};
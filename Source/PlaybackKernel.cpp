@@ -0,0 +1,94 @@
+/*
+  ==============================================================================
+
+    PlaybackKernel.cpp
+    The inner loop of playback, specialised on channel count and DAW sync.
+
+  ==============================================================================
+*/
+
+#include "PlaybackKernel.h"
+
+namespace {
+    // Block sizes the benchmark runs through, doubling from the smallest, and how
+    // much audio it plays at each.
+    constexpr int kMinBlockSize = 32;
+    constexpr int kMaxBlockSize = 2048;
+    constexpr int kSamplesPerRun = 1 << 19;
+    // Five seconds at 44.1k, as long as a take.
+    constexpr int kTakeSamples = 220500;
+    constexpr double kSampleRate = 44100.0;
+    constexpr int kStopTimeoutMs = 2000;
+}  // namespace
+
+//==============================================================================
+PlaybackBenchmark::PlaybackBenchmark() : juce::Thread("Riffusion Benchmark")
+{
+    startThread();
+}
+
+PlaybackBenchmark::~PlaybackBenchmark()
+{
+    stopThread(kStopTimeoutMs);
+}
+
+void PlaybackBenchmark::run()
+{
+    juce::AudioBuffer<float> take(1, kTakeSamples);
+    juce::Random random(1);
+    for (int i = 0; i < take.getNumSamples(); ++i) {
+        take.setSample(0, i, random.nextFloat() * 2.0f - 1.0f);
+    }
+    PlaybackKernel::Source source;
+    source.audio = &take;
+    source.length = take.getNumSamples();
+    source.sampleRate = kSampleRate;
+    const juce::Optional<juce::AudioPlayHead::PositionInfo> noPosition;
+    const double cyclesPerNs = juce::SystemStats::getCpuSpeedInMegahertz() / 1000.0;
+
+    // Nanoseconds per sample of playing back through one kernel.
+    auto timeKernel = [&](auto&& playBlock, juce::AudioBuffer<float>& block) {
+        const int numBlocks = kSamplesPerRun / block.getNumSamples();
+        int playbackPosition = 0;
+        // Once round first, so the caches are warm for the timed run.
+        for (int i = 0; i < numBlocks; ++i) {
+            playbackPosition = playBlock(block, playbackPosition);
+        }
+        const juce::int64 start = juce::Time::getHighResolutionTicks();
+        for (int i = 0; i < numBlocks; ++i) {
+            playbackPosition = playBlock(block, playbackPosition);
+        }
+        const double seconds = juce::Time::highResolutionTicksToSeconds(juce::Time::getHighResolutionTicks() - start);
+        return seconds * 1.0e9 / (static_cast<double>(numBlocks) * block.getNumSamples());
+    };
+    auto describe = [cyclesPerNs](double nsPerSample) {
+        juce::String text = juce::String(nsPerSample, 2) + " ns";
+        if (cyclesPerNs > 0.0) {
+            text << " (" << juce::String(nsPerSample * cyclesPerNs, 1) << " cyc)";
+        }
+        return text;
+    };
+
+    juce::String text;
+    text << "playback per sample, generic -> specialised:\n";
+    for (int numChannels : { 1, 2 }) {
+        juce::AudioBuffer<float> buffer(numChannels, kMaxBlockSize);
+        for (int blockSize = kMinBlockSize; blockSize <= kMaxBlockSize; blockSize *= 2) {
+            if (threadShouldExit()) {
+                return;
+            }
+            juce::AudioBuffer<float> block(buffer.getArrayOfWritePointers(), numChannels, blockSize);
+            const double generic = timeKernel([&](juce::AudioBuffer<float>& b, int position) {
+                return PlaybackKernel::playGeneric(b, source, position, false, noPosition, numChannels);
+            }, block);
+            // Called through a pointer, as processBlock calls its kernels.
+            const auto kernel = (numChannels == 1) ? &PlaybackKernel::play<1, false> : &PlaybackKernel::play<2, false>;
+            const double specialised = timeKernel([&](juce::AudioBuffer<float>& b, int position) {
+                return kernel(b, source, position, noPosition, numChannels);
+            }, block);
+            text << "  " << numChannels << "ch x " << blockSize << ": " << describe(generic) << " -> " << describe(specialised) << "\n";
+        }
+    }
+    results = text;
+    finished = true;
+}
@@ -0,0 +1,169 @@
+/*
+  ==============================================================================
+
+    PlaybackKernel.h
+    The inner loop of playback, specialised on channel count and DAW sync.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+
+#include <algorithm>
+#include <atomic>
+
+//==============================================================================
+/**
+    What processBlock does with a take once it has picked which one to play: works
+    out where in it the block starts, and copies it to every channel.
+
+    findRange() and copyToChannels() are templates on whether the DAW sets the
+    position and on the channel count, so processBlock's kernels don't re-check
+    either every block; play() is the two together. playGeneric() is playback as
+    processBlock did it before that, with both checked at run time, and is only kept
+    for PlaybackBenchmark to measure against.
+*/
+namespace PlaybackKernel
+{
+    // The take a block plays from.
+    struct Source
+    {
+        const juce::AudioBuffer<float>* audio = nullptr;
+        // How much of audio is the take, and the tempo it was recorded at.
+        int length = 0;
+        double bpm = 0.0;
+        // Where the take starts on the DAW's timeline, in beats, or negative if unknown.
+        double startBeats = -1.0;
+        double sampleRate = 44100.0;
+    };
+
+    // Where in the source a block plays from. Nothing plays if offset is negative.
+    struct Range
+    {
+        int offset = -1;
+        int numSamples = 0;
+    };
+
+    // Where a block of blockSize samples plays from, carrying on from playbackPosition,
+    // or from wherever the DAW says it is if dawSync.
+    template <bool dawSync>
+    Range findRange(const Source& source, int playbackPosition, int blockSize,
+        const juce::Optional<juce::AudioPlayHead::PositionInfo>& position)
+    {
+        int sampleOffset = playbackPosition;
+        if (dawSync && position && source.startBeats >= 0.0) {
+            const double tBeats = position->getPpqPosition().orFallback(-1.0);
+            if (tBeats >= 0.0 && source.bpm > 0.0) {
+                const double deltaTSeconds = (tBeats - source.startBeats) / source.bpm * 60.0;
+                sampleOffset = static_cast<int>(deltaTSeconds * source.sampleRate);
+            }
+        }
+        if (sampleOffset < 0) {
+            // Playback is happening before the take. It can't be played here.
+            return {};
+        }
+        int samplesToEnd = source.length - sampleOffset;
+        if (samplesToEnd <= 0) {
+            sampleOffset = 0;
+            samplesToEnd = source.audio->getNumSamples();
+        }
+        const int minBufferSize = std::min(source.audio->getNumSamples(), blockSize);
+        return { sampleOffset, std::min(std::min(minBufferSize, source.length), samplesToEnd) };
+    }
+
+    // numChannels is 1 or 2, or 0 for numInputChannels. A fixed trip count for mono
+    // and stereo, so this unrolls into plain copies. Skips a channel samples already is.
+    template <int numChannels>
+    void copyToChannels(juce::AudioBuffer<float>& buffer, const float* samples, int numSamples, int numInputChannels)
+    {
+        const int channels = (numChannels > 0) ? numChannels : numInputChannels;
+        for (int channel = 0; channel < channels; ++channel) {
+            if (buffer.getReadPointer(channel) == samples) {
+                continue;
+            }
+            buffer.copyFrom(channel, 0, samples, numSamples);
+        }
+    }
+
+    // Plays one block of source into buffer, and returns where the next one carries on.
+    template <int numChannels, bool dawSync>
+    int play(juce::AudioBuffer<float>& buffer, const Source& source, int playbackPosition,
+        const juce::Optional<juce::AudioPlayHead::PositionInfo>& position, int numInputChannels)
+    {
+        const Range range = findRange<dawSync>(source, playbackPosition, buffer.getNumSamples(), position);
+        if (range.offset < 0) {
+            return playbackPosition;
+        }
+        copyToChannels<numChannels>(buffer, source.audio->getReadPointer(0) + range.offset, range.numSamples, numInputChannels);
+        return range.offset + range.numSamples;
+    }
+
+    // The same, the way processBlock did it before it was specialised.
+    inline int playGeneric(juce::AudioBuffer<float>& buffer, const Source& source, int playbackPosition, bool dawSync,
+        const juce::Optional<juce::AudioPlayHead::PositionInfo>& position, int numInputChannels)
+    {
+        int sampleOffset = playbackPosition;
+        if (dawSync && position && (source.startBeats >= 0.0)) {
+            double tBeats = position->getPpqPosition().orFallback(-1.0);
+            double bpm = source.bpm;
+            if (tBeats >= 0.0 && bpm > 0.0) {
+                double deltaTBeats = tBeats - source.startBeats;
+                double deltaTSeconds = deltaTBeats / bpm * 60.0;
+                sampleOffset = static_cast<int>(deltaTSeconds * source.sampleRate);
+            }
+        }
+        if (sampleOffset < 0) {
+            return playbackPosition;
+        }
+        int samplesToEnd = source.length - sampleOffset;
+        if (samplesToEnd <= 0) {
+            sampleOffset = 0;
+            samplesToEnd = source.audio->getNumSamples();
+        }
+        int minBufferSize = std::min(source.audio->getNumSamples(),
+            buffer.getNumSamples());
+        int blockSize = std::min(std::min(minBufferSize, source.length), samplesToEnd);
+        const float* playSamples = source.audio->getReadPointer(0) + sampleOffset;
+        for (int channel = 0; channel < numInputChannels; ++channel)
+        {
+            if (buffer.getNumChannels() == 0 || buffer.getReadPointer(channel) == playSamples) {
+                continue;
+            }
+            buffer.copyFrom(channel, 0,
+                playSamples,
+                blockSize
+            );
+        }
+        return sampleOffset + blockSize;
+    }
+}  // namespace PlaybackKernel
+
+//==============================================================================
+/**
+    Times PlaybackKernel::play against playGeneric at block sizes from 32 to 2048
+    samples, mono and stereo, on a thread of its own and a take of its own, so
+    neither the editor nor playback is held up. Destroying it stops the run.
+*/
+class PlaybackBenchmark : private juce::Thread
+{
+public:
+    PlaybackBenchmark();
+    ~PlaybackBenchmark() override;
+
+    // Message thread. True once the results are in.
+    bool isFinished() const { return finished; }
+    // Message thread. A table of nanoseconds (and roughly cycles) per sample, for the
+    // editor's HUD. Empty until isFinished().
+    juce::String getResults() const { return finished ? results : juce::String(); }
+
+private:
+    void run() override;
+
+    // Written before finished is set, and only read after.
+    juce::String results;
+    std::atomic<bool> finished { false };
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (PlaybackBenchmark)
+};
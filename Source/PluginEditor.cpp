@@ -13,8 +13,13 @@ namespace {
 	constexpr int kThumbNailSizePx = 256;
 	constexpr int kThumbNailCacheSize = 2;
 	constexpr int kDefaultWidth = 400;
-	constexpr int kDefaultHeight = 500;
+	constexpr int kDefaultHeight = 602;
 	constexpr int kUpdateRateMs = 30;
+	constexpr int kSpectrogramWidthPx = 128;
+	// Upper bound on columns drawn per update, so a backlog can't stall the UI.
+	constexpr int kMaxSpectrogramColumnsPerUpdate = 8;
+	// The HUD text is rebuilt every this many timer ticks.
+	constexpr int kHudUpdateTicks = 10;
 	const std::string kDefaultServerName = "http://127.0.0.1:3000";
 }  // namespace
 
@@ -22,16 +27,21 @@ namespace {
 RiffusionVSTAudioProcessorEditor::RiffusionVSTAudioProcessorEditor(RiffusionVSTAudioProcessor& p)
 	: AudioProcessorEditor(&p),
 	audioProcessor(p),
+	generationProgressBar(generationProgress),
 	updateTimer([this]() { this->onUpdate(); }),
 	thumbnailCache(kThumbNailCacheSize),
 	// Bounds will be initialized later.
 	recordingThumbnail{ juce::AudioThumbnail(kThumbNailSizePx, formatManager, thumbnailCache), juce::Rectangle<int>(0, 0, 0, 0) },
-	generatedThumbnail{ juce::AudioThumbnail(kThumbNailSizePx, formatManager, thumbnailCache), juce::Rectangle<int>(0, 0, 0, 0) }
+	generatedThumbnail{ juce::AudioThumbnail(kThumbNailSizePx, formatManager, thumbnailCache), juce::Rectangle<int>(0, 0, 0, 0) },
+	recordingSpectrogram{ juce::Image(juce::Image::RGB, kSpectrogramWidthPx, SpectrogramAnalyser::numBands, true), juce::Rectangle<int>(0, 0, 0, 0) },
+	generatedSpectrogram{ juce::Image(juce::Image::RGB, kSpectrogramWidthPx, SpectrogramAnalyser::numBands, true), juce::Rectangle<int>(0, 0, 0, 0) }
 
 {
 	// Make sure that before the constructor has finished, you've set the
 	// editor's size to whatever you need it to be.
 	setSize(kDefaultWidth, kDefaultHeight);
+	// Opening the editor counts as using the instance, so the thumbnails have something to show.
+	audioProcessor.ensureResident();
 	serverIp.setText(kDefaultServerName);
 	prompt1Text.setText("prompt 1");
 	prompt2Text.setText("prompt 2");
@@ -53,12 +63,44 @@ RiffusionVSTAudioProcessorEditor::RiffusionVSTAudioProcessorEditor(RiffusionVSTA
 		onPlayRecordingClicked();
 	};
 
+	onsetTriggerBox.setButtonText("Record on Onset");
+	onsetTriggerBox.setToggleable(true);
+	onsetTriggerBox.setToggleState(audioProcessor.onsetTriggersRecording, juce::dontSendNotification);
+	onsetTriggerBox.onClick = [this]()
+	{
+		audioProcessor.onsetTriggersRecording = onsetTriggerBox.getToggleState();
+	};
+
+	grabLookbackButton.setButtonText("Grab Last 5s");
+	grabLookbackButton.onClick = [this]()
+	{
+		audioProcessor.grabLookback();
+	};
+
 	playbackGenerationButton.setButtonText("Play Generated");
 	playbackGenerationButton.onClick = [this]()
 	{
 		onPlayGenerationClicked();
 	};
 
+	morphSlider.setTextValueSuffix(" Morph");
+	morphAttachment = std::make_unique<juce::SliderParameterAttachment>(audioProcessor.getMorphParameter(), morphSlider);
+	morphSlider.setEnabled(false);
+
+	takeBox.setTextWhenNothingSelected("No takes yet");
+	takeBox.onChange = [this]()
+	{
+		audioProcessor.selectTake(takeBox.getSelectedId() - 1);
+		updateThumbnails();
+	};
+	takeABButton.setButtonText("A/B");
+	takeABButton.onClick = [this]()
+	{
+		audioProcessor.selectPreviousTake();
+		updateTakeBox();
+		updateThumbnails();
+	};
+
 	alphaSlider.setTextValueSuffix(" Blend");
 	alphaSlider.setValue(0.5);
 	alphaSlider.setRange(0.0, 1.0, 0.1);
@@ -82,6 +124,69 @@ RiffusionVSTAudioProcessorEditor::RiffusionVSTAudioProcessorEditor(RiffusionVSTA
 	{
 		audioProcessor.doesDAWControlTiming = dawControlTimingBox.getToggleState();
 	};
+	// Show what the processor was last told, e.g. from a saved project. If it hasn't
+	// been told anything yet, it gets the defaults, so it can generate by itself.
+	RiffusionVSTAudioProcessor::ProcessParams savedParams;
+	if (audioProcessor.getProcessParams(&savedParams)) {
+		serverIp.setText(savedParams.serverAddress, juce::dontSendNotification);
+		prompt1Text.setText(savedParams.promptA, juce::dontSendNotification);
+		prompt2Text.setText(savedParams.promptB, juce::dontSendNotification);
+		seedText.setText(savedParams.seedText, juce::dontSendNotification);
+		alphaSlider.setValue(savedParams.alpha, juce::dontSendNotification);
+		strengthSlider.setValue(savedParams.guidance, juce::dontSendNotification);
+		denoisingSlider.setValue(savedParams.denoising, juce::dontSendNotification);
+		itersSlider.setValue(savedParams.numInferenceSteps, juce::dontSendNotification);
+	}
+	else {
+		audioProcessor.setProcessParams(getParamsFromUI());
+	}
+	// Keep the processor up to date, it needs the params to generate by itself
+	// (e.g. during an offline bounce) when nobody clicks "Generate New".
+	for (juce::TextEditor* text : { &serverIp, &prompt1Text, &prompt2Text, &seedText }) {
+		text->onTextChange = [this]() { onParamsChanged(); };
+	}
+	for (juce::Slider* slider : { &alphaSlider, &strengthSlider, &denoisingSlider, &itersSlider }) {
+		slider->onValueChange = [this]() { onParamsChanged(); };
+	}
+	perfHudBox.setButtonText("Perf HUD");
+	perfHudBox.setToggleable(true);
+	perfHudBox.onClick = [this]()
+	{
+		perfHud.setVisible(perfHudBox.getToggleState());
+		hudUpdateCounter = kHudUpdateTicks;
+	};
+	helperProcessBox.setButtonText("Isolated Helper");
+	helperProcessBox.setToggleable(true);
+	helperProcessBox.setToggleState(audioProcessor.getUseHelperProcess(), juce::dontSendNotification);
+	helperProcessBox.onClick = [this]()
+	{
+		audioProcessor.setUseHelperProcess(helperProcessBox.getToggleState());
+	};
+	speculativeBox.setButtonText("Speculate");
+	speculativeBox.setToggleable(true);
+	speculativeBox.setToggleState(audioProcessor.getSpeculativeGeneration(), juce::dontSendNotification);
+	speculativeBox.onClick = [this]()
+	{
+		audioProcessor.setSpeculativeGeneration(speculativeBox.getToggleState());
+	};
+	benchmarkButton.setButtonText("Benchmark");
+	benchmarkButton.onClick = [this]()
+	{
+		// Takes a moment, on a thread of its own. onUpdate picks the results up.
+		benchmark = std::make_unique<PlaybackBenchmark>();
+		benchmarkText = "benchmark running...\n";
+		benchmarkButton.setEnabled(false);
+		perfHudBox.setToggleState(true, juce::sendNotification);
+	};
+	exportTraceButton.setButtonText("Export Trace");
+	exportTraceButton.onClick = [this]()
+	{
+		onExportTraceClicked();
+	};
+	perfHud.setMultiLine(true);
+	perfHud.setReadOnly(true);
+	perfHud.setCaretVisible(false);
+	perfHud.setColour(juce::TextEditor::backgroundColourId, juce::Colours::black.withAlpha(0.8f));
 	addAndMakeVisible(&serverIp);
 	addAndMakeVisible(&prompt1Text);
 	addAndMakeVisible(&prompt2Text);
@@ -94,8 +199,20 @@ RiffusionVSTAudioProcessorEditor::RiffusionVSTAudioProcessorEditor(RiffusionVSTA
 	addAndMakeVisible(&playbackRecordingButton);
 	addAndMakeVisible(&generateButton);
 	addAndMakeVisible(&playbackGenerationButton);
+	addAndMakeVisible(&morphSlider);
+	addAndMakeVisible(&takeBox);
+	addAndMakeVisible(&takeABButton);
 	addAndMakeVisible(&dawControlTimingBox);
 	addAndMakeVisible(&messageText);
+	addAndMakeVisible(&perfHudBox);
+	addAndMakeVisible(&exportTraceButton);
+	addAndMakeVisible(&onsetTriggerBox);
+	addAndMakeVisible(&grabLookbackButton);
+	addAndMakeVisible(&helperProcessBox);
+	addAndMakeVisible(&speculativeBox);
+	addAndMakeVisible(&benchmarkButton);
+	addChildComponent(&perfHud);
+	addChildComponent(&generationProgressBar);
 	updateTimer.startTimer(kUpdateRateMs);
 	recordingThumbnail.thumbnail.addChangeListener(this);
 	generatedThumbnail.thumbnail.addChangeListener(this);
@@ -118,18 +235,29 @@ void RiffusionVSTAudioProcessorEditor::LambdaTimer::timerCallback() {
 	m_lambda();
 }
 
+RiffusionVSTAudioProcessor::ProcessParams RiffusionVSTAudioProcessorEditor::getParamsFromUI() const {
+	RiffusionVSTAudioProcessor::ProcessParams params;
+	params.alpha = alphaSlider.getValue();
+	params.denoising = denoisingSlider.getValue();
+	params.guidance = strengthSlider.getValue();
+	params.numInferenceSteps = static_cast<int>(itersSlider.getValue());
+	params.promptA = prompt1Text.getText().toStdString();
+	params.promptB = prompt2Text.getText().toStdString();
+	params.serverAddress = serverIp.getText().toStdString();
+	params.seedText = seedText.getText().toStdString();
+	params.seed = static_cast<int>(std::hash<std::string>()(params.seedText));
+	return params;
+}
+
+void RiffusionVSTAudioProcessorEditor::onParamsChanged() {
+	audioProcessor.setProcessParams(getParamsFromUI());
+}
+
 void RiffusionVSTAudioProcessorEditor::onGenerateClicked() {
 	if (state != RecordingState::Generating) {
 		state = RecordingState::Generating;
-		RiffusionVSTAudioProcessor::ProcessParams params;
-		params.alpha = alphaSlider.getValue();
-		params.denoising = denoisingSlider.getValue();
-		params.guidance = strengthSlider.getValue();
-		params.numInferenceSteps = static_cast<int>(itersSlider.getValue());
-		params.promptA = prompt1Text.getText().toStdString();
-		params.promptB = prompt2Text.getText().toStdString();
-		params.serverAddress = serverIp.getText().toStdString();
-		params.seed = static_cast<int>(std::hash<std::string>()(seedText.getText().toStdString()));
+		RiffusionVSTAudioProcessor::ProcessParams params = getParamsFromUI();
+		audioProcessor.setProcessParams(params);
 		audioProcessor.startGenerating(params);
 	}
 	else {
@@ -175,13 +303,55 @@ void RiffusionVSTAudioProcessorEditor::onPlayGenerationClicked() {
 	reconcileUIState();
 }
 
+void RiffusionVSTAudioProcessorEditor::onExportTraceClicked() {
+	traceChooser = std::make_unique<juce::FileChooser>("Export Chrome Trace",
+		juce::File::getSpecialLocation(juce::File::userDocumentsDirectory).getChildFile("riffusion_trace.json"),
+		"*.json");
+	traceChooser->launchAsync(juce::FileBrowserComponent::saveMode | juce::FileBrowserComponent::canSelectFiles,
+		[this](const juce::FileChooser& chooser)
+		{
+			juce::File file = chooser.getResult();
+			if (file == juce::File()) {
+				return;
+			}
+			if (file.replaceWithText(audioProcessor.getTracer().toChromeTraceJson())) {
+				audioProcessor.setMessage("Saved trace to " + file.getFileName());
+			}
+			else {
+				audioProcessor.setMessage("Failed to save trace.");
+			}
+		});
+}
+
 RiffusionVSTAudioProcessorEditor::~RiffusionVSTAudioProcessorEditor()
 {
 }
 
 void RiffusionVSTAudioProcessorEditor::updateThumbnails() {
 	recordingThumbnail.thumbnail.setSource(audioProcessor.getRecordingBuffer(), audioProcessor.getCurrentSampleRate(), thumbHash++);
-	generatedThumbnail.thumbnail.setSource(audioProcessor.getGenerationBuffer(), audioProcessor.getCurrentSampleRate(), thumbHash++);
+	// The selected take comes from the store, which also covers takes from before a reload.
+	shownTake = audioProcessor.getSelectedTakeAudio();
+	generatedThumbnail.thumbnail.setSource(shownTake != nullptr ? shownTake.get() : audioProcessor.getGenerationBuffer(),
+		audioProcessor.getCurrentSampleRate(), thumbHash++);
+}
+
+void RiffusionVSTAudioProcessorEditor::updateTakeBox() {
+	const int numTakes = audioProcessor.getNumTakes();
+	const int selectedId = audioProcessor.getSelectedTake() + 1;
+	if (takeBox.getNumItems() != numTakes) {
+		takeBox.clear(juce::dontSendNotification);
+		for (int i = 0; i < numTakes; ++i) {
+			const juce::var params = audioProcessor.getTakeInfo(i).params;
+			juce::String name;
+			name << (i + 1) << ": " << params["promptA"].toString() << " / " << params["promptB"].toString()
+				<< ", blend " << juce::String(static_cast<double>(params["alpha"]), 1) << ", seed " << params["seed"].toString();
+			takeBox.addItem(name, i + 1);
+		}
+	}
+	if (takeBox.getSelectedId() != selectedId) {
+		takeBox.setSelectedId(selectedId, juce::dontSendNotification);
+	}
+	takeABButton.setEnabled(numTakes >= 2);
 }
 
 void RiffusionVSTAudioProcessorEditor::reconcileUIState() {
@@ -196,6 +366,7 @@ void RiffusionVSTAudioProcessorEditor::reconcileUIState() {
 			playbackGenerationButton.setEnabled(true);
 			recordButton.setEnabled(true);
 			generateButton.setEnabled(true);
+			grabLookbackButton.setEnabled(true);
 			break;
 		}
 		case RiffusionVSTAudioProcessorEditor::RecordingState::Recording: {
@@ -206,12 +377,14 @@ void RiffusionVSTAudioProcessorEditor::reconcileUIState() {
 			playbackRecordingButton.setEnabled(false);
 			generateButton.setEnabled(false);
 			playbackGenerationButton.setEnabled(false);
+			grabLookbackButton.setEnabled(false);
 			break;
 		}
 		case RiffusionVSTAudioProcessorEditor::RecordingState::Generating: {
 			recordButton.setEnabled(false);
 			playbackRecordingButton.setEnabled(false);
 			playbackGenerationButton.setEnabled(false);
+			grabLookbackButton.setEnabled(false);
 			generateButton.setButtonText("Stop");
 			recordButton.setButtonText("Record");
 			playbackGenerationButton.setButtonText("Play Generated");
@@ -241,14 +414,37 @@ void RiffusionVSTAudioProcessorEditor::reconcileUIState() {
 			}
 			recordButton.setEnabled(false);
 			generateButton.setEnabled(false);
+			grabLookbackButton.setEnabled(false);
 			break;
 		}
 	}
 }
 
 void RiffusionVSTAudioProcessorEditor::onUpdate() {
-	messageText.setText(audioProcessor.message);
+	messageText.setText(audioProcessor.getMessage());
+	if (recordingSpectrogram.update(audioProcessor.getRecordingSpectrogram())) {
+		repaint(recordingSpectrogram.bounds);
+	}
+	if (generatedSpectrogram.update(audioProcessor.getGenerationSpectrogram())) {
+		repaint(generatedSpectrogram.bounds);
+	}
+	if (benchmark != nullptr && benchmark->isFinished()) {
+		benchmarkText = benchmark->getResults();
+		benchmark.reset();
+		benchmarkButton.setEnabled(true);
+		hudUpdateCounter = kHudUpdateTicks;
+	}
+	if (perfHud.isVisible() && ++hudUpdateCounter >= kHudUpdateTicks) {
+		hudUpdateCounter = 0;
+		perfHud.setText(audioProcessor.getTracer().getHudText() + audioProcessor.getUploadSummary()
+			+ audioProcessor.getSpeculationSummary() + audioProcessor.getMemorySummary()
+			+ RealtimeSafetyChecker::getSummary() + benchmarkText, false);
+	}
 
+	if (audioProcessor.getLookbackGrabCount() != lastLookbackGrabCount) {
+		lastLookbackGrabCount = audioProcessor.getLookbackGrabCount();
+		updateThumbnails();
+	}
 	if (!audioProcessor.getIsRecording() && state == RecordingState::Recording) {
 		state = RecordingState::Idle;
 		reconcileUIState();
@@ -273,6 +469,16 @@ void RiffusionVSTAudioProcessorEditor::onUpdate() {
 		reconcileUIState();
 		updateThumbnails();
 	}
+	// e.g. a server job resumed when the project was loaded.
+	else if (audioProcessor.getIsGenerating() && state == RecordingState::Idle) {
+		state = RecordingState::Generating;
+		reconcileUIState();
+	}
+	// Nothing to morph between until two takes have come back for this recording.
+	morphSlider.setEnabled(audioProcessor.getNumMorphTakes() >= 2);
+	updateTakeBox();
+	generationProgress = audioProcessor.getGenerationProgress();
+	generationProgressBar.setVisible(audioProcessor.getIsGenerating());
 }
 
 void RiffusionVSTAudioProcessorEditor::AudioThumbnailWidget::paint(juce::Graphics& g) {
@@ -282,6 +488,27 @@ void RiffusionVSTAudioProcessorEditor::AudioThumbnailWidget::paint(juce::Graphic
 	thumbnail.drawChannels(g, bounds, 0.0, thumbnail.getTotalLength(), 1.0f);
 }
 
+bool RiffusionVSTAudioProcessorEditor::SpectrogramWidget::update(SpectrogramAnalyser& analyser) {
+	std::array<float, SpectrogramAnalyser::numBands> column;
+	const int w = image.getWidth();
+	const int h = image.getHeight();
+	int numColumns = 0;
+	while (numColumns < kMaxSpectrogramColumnsPerUpdate && analyser.popColumn(column.data())) {
+		image.moveImageSection(0, 0, 1, 0, w - 1, h);
+		juce::Image::BitmapData pixels(image, w - 1, 0, 1, h, juce::Image::BitmapData::writeOnly);
+		for (int band = 0; band < SpectrogramAnalyser::numBands; ++band) {
+			// Lowest band at the bottom.
+			pixels.setPixelColour(0, h - 1 - band, juce::Colours::black.interpolatedWith(juce::Colours::lightgreen, column[band]));
+		}
+		numColumns++;
+	}
+	return numColumns > 0;
+}
+
+void RiffusionVSTAudioProcessorEditor::SpectrogramWidget::paint(juce::Graphics& g) {
+	g.drawImage(image, bounds.toFloat());
+}
+
 //==============================================================================
 void RiffusionVSTAudioProcessorEditor::paint(juce::Graphics& g)
 {
@@ -294,6 +521,8 @@ void RiffusionVSTAudioProcessorEditor::paint(juce::Graphics& g)
 	g.drawFittedText("Server IP: ", serverIp.getPosition().x - 120, serverIp.getPosition().y, 100, 30, juce::Justification::right, 1);
 	recordingThumbnail.paint(g);
 	generatedThumbnail.paint(g);
+	recordingSpectrogram.paint(g);
+	generatedSpectrogram.paint(g);
 }
 
 void RiffusionVSTAudioProcessorEditor::resized()
@@ -325,15 +554,35 @@ void RiffusionVSTAudioProcessorEditor::resized()
 	denoisingSlider.setBounds(l, next_row(), r, elementHeight);
 	itersSlider.setBounds(l, next_row(), r, elementHeight);
 	int recording_buffer_row = next_row();
-	recordingThumbnail.bounds = juce::Rectangle<int>(l, recording_buffer_row, r, elementHeight);
+	recordingThumbnail.bounds = juce::Rectangle<int>(l, recording_buffer_row, r / 2, elementHeight);
+	recordingSpectrogram.bounds = juce::Rectangle<int>(l + r / 2, recording_buffer_row, r / 2, elementHeight);
 	int recording_row = next_row();
 	recordButton.setBounds(l, recording_row, r / 2, elementHeight);
 	playbackRecordingButton.setBounds(l + r / 2, recording_row, r / 2, elementHeight);
+	int lookback_row = next_row();
+	onsetTriggerBox.setBounds(l, lookback_row, r / 2, elementHeight);
+	grabLookbackButton.setBounds(l + r / 2, lookback_row, r / 2, elementHeight);
 	int gen_buffer_row = next_row();
-	generatedThumbnail.bounds = juce::Rectangle<int>(l, gen_buffer_row, r, elementHeight);
+	generatedThumbnail.bounds = juce::Rectangle<int>(l, gen_buffer_row, r / 2, elementHeight);
+	generatedSpectrogram.bounds = juce::Rectangle<int>(l + r / 2, gen_buffer_row, r / 2, elementHeight);
 	int gen_row = next_row();
 	generateButton.setBounds(l, gen_row, r / 2, elementHeight);
 	playbackGenerationButton.setBounds(l + r / 2, gen_row, r / 2, elementHeight);
-	dawControlTimingBox.setBounds(l, next_row(), r, elementHeight);
-	messageText.setBoundingBox(juce::Parallelogram(juce::Rectangle<float>(l, next_row(), r, elementHeight)));
+	int morph_row = next_row();
+	morphSlider.setBounds(l, morph_row, r / 2, elementHeight);
+	takeBox.setBounds(l + r / 2, morph_row, r / 3, elementHeight);
+	takeABButton.setBounds(l + r / 2 + r / 3, morph_row, r / 6, elementHeight);
+	int options_row = next_row();
+	dawControlTimingBox.setBounds(l, options_row, r / 2, elementHeight);
+	perfHudBox.setBounds(l + r / 2, options_row, r / 4, elementHeight);
+	exportTraceButton.setBounds(l + 3 * r / 4, options_row, r / 4, elementHeight);
+	// The HUD sits on top of everything between the server row and the options row.
+	perfHud.setBounds(l, row(1), r, options_row - row(1) - row_padding);
+	int settings_row = next_row();
+	helperProcessBox.setBounds(l, settings_row, r / 3, elementHeight);
+	speculativeBox.setBounds(l + r / 3, settings_row, r / 3, elementHeight);
+	benchmarkButton.setBounds(l + 2 * r / 3, settings_row, r / 3, elementHeight);
+	int message_row = next_row();
+	messageText.setBoundingBox(juce::Parallelogram(juce::Rectangle<float>(l, message_row, 2 * r / 3, elementHeight)));
+	generationProgressBar.setBounds(l + 2 * r / 3, message_row, r / 3, elementHeight);
 }
@@ -37,10 +37,13 @@ private:
         Playing
     };
 
+    RiffusionVSTAudioProcessor::ProcessParams getParamsFromUI() const;
+    void onParamsChanged();
     void onGenerateClicked();
     void onRecordClicked();
     void onPlayRecordingClicked();
     void onPlayGenerationClicked();
+    void onExportTraceClicked();
 
     juce::TextEditor serverIp;
     juce::TextEditor prompt1Text;
@@ -52,10 +55,37 @@ private:
     juce::Slider itersSlider;
     juce::TextButton recordButton;
     juce::TextButton playbackRecordingButton;
+    juce::ToggleButton onsetTriggerBox;
+    juce::TextButton grabLookbackButton;
     juce::TextButton generateButton;
     juce::TextButton playbackGenerationButton;
+    // Bound to the processor's morph parameter, so it follows host automation.
+    juce::Slider morphSlider;
+    std::unique_ptr<juce::SliderParameterAttachment> morphAttachment;
+    // Every generated take, newest last, and a button flipping back to the last one.
+    juce::ComboBox takeBox;
+    juce::TextButton takeABButton;
     juce::DrawableText messageText;
     juce::ToggleButton dawControlTimingBox;
+    juce::ToggleButton perfHudBox;
+    juce::ToggleButton helperProcessBox;
+    juce::ToggleButton speculativeBox;
+    juce::TextButton exportTraceButton;
+    juce::TextButton benchmarkButton;
+    // Overlay showing the processor's PerformanceTracer summary.
+    juce::TextEditor perfHud;
+    // Counts timer ticks so the HUD text is only rebuilt every few updates.
+    int hudUpdateCounter = 0;
+    // Results of the last block kernel benchmark, shown at the bottom of the HUD.
+    juce::String benchmarkText;
+    // The benchmark while it's running, polled by onUpdate.
+    std::unique_ptr<PlaybackBenchmark> benchmark;
+    // Copied from the processor on every update. Negative shows a busy bar.
+    double generationProgress = -1.0;
+    juce::ProgressBar generationProgressBar;
+    // The processor's grab count when the thumbnails were last refreshed.
+    int lastLookbackGrabCount = 0;
+    std::unique_ptr<juce::FileChooser> traceChooser;
     RecordingState state = RecordingState::Idle;
     class LambdaTimer : public juce::Timer {
         public:
@@ -77,10 +107,27 @@ private:
     AudioThumbnailWidget recordingThumbnail;
     // Waveform of the generation buffer.
     AudioThumbnailWidget generatedThumbnail;
+    struct SpectrogramWidget {
+        // One pixel per column, one row per band. Scrolls left as columns arrive.
+        juce::Image image;
+        juce::Rectangle<int> bounds;
+        // Pulls any finished columns out of the analyser and draws them into the
+        // image. Returns true if the image changed.
+        bool update(SpectrogramAnalyser& analyser);
+        void paint(juce::Graphics& g);
+    };
+    // Scrolling spectrogram of the audio going into the recording buffer.
+    SpectrogramWidget recordingSpectrogram;
+    // Scrolling spectrogram of the generated audio as it plays back.
+    SpectrogramWidget generatedSpectrogram;
     // This is just a number indicating a kind of change counter to the thumbnails. Gets
     // incremented every time we want to change the thumbnail.
     int thumbHash = 0;
     void updateThumbnails();
+    // The selected take shown in the generated thumbnail, kept alive while it's shown.
+    std::shared_ptr<const juce::AudioBuffer<float>> shownTake;
+    // Refills takeBox if the processor's takes or selection have changed.
+    void updateTakeBox();
 
     void reconcileUIState();
 
@@ -13,25 +13,48 @@
 
 #define JucePlugin_IsSynth 1
 
+namespace {
+    // The processBlock specialisations: every block mode, mono, stereo or any number
+    // of channels, and free running or synced to the DAW.
+    constexpr int kNumKernelModes = 4;
+    constexpr int kNumKernelLayouts = 3;
+    constexpr int kKernelLayoutChannels[kNumKernelLayouts] = { 1, 2, 0 };
+    constexpr int kNumKernelSyncModes = 2;
+    // How often the message thread checks for requests from the audio thread.
+    constexpr int kRequestPollMs = 20;
+
+    size_t getNumBytes(const juce::AudioBuffer<float>& buffer) {
+        return static_cast<size_t>(buffer.getNumChannels()) * buffer.getNumSamples() * sizeof(float);
+    }
+
+    juce::String toMegabytes(size_t bytes) {
+        return juce::String(static_cast<double>(bytes) / (1 << 20), 1);
+    }
+}  // namespace
+
 //==============================================================================
 RiffusionVSTAudioProcessor::RiffusionVSTAudioProcessor()
      : AudioProcessor (BusesProperties()
                        .withInput  ("Input",  juce::AudioChannelSet::mono(), true)
                        .withOutput ("Output", juce::AudioChannelSet::mono(), true)
                        )
-    ,recordingBuffer(1, maxRecordingBufferSize), generationBuffer(1, maxRecordingBufferSize)
 {
-    wavInterface.reset(new juce::WavAudioFormat());
-    wavWriteBuffer.resize(maxRecordingBufferSize * sizeof(uint16_t), 0);
+    addParameter(morphAmount = new juce::AudioParameterFloat(juce::ParameterID { "morph", 1 }, "Morph", 0.0f, 1.0f, 1.0f));
+    generationClientId = generationService->registerClient(tracer);
+    spectrogramThread->addAnalyser(&recordingSpectrogram);
+    spectrogramThread->addAnalyser(&generationSpectrogram);
+    memoryBudget->addClient(this);
+    startTimer(kRequestPollMs);
 }
 
 RiffusionVSTAudioProcessor::~RiffusionVSTAudioProcessor()
 {
-    // Kill the thread.
-    std::lock_guard<std::mutex> lock(internetRequestMutex);
-    if (internetRequestThread.joinable()) {
-        internetRequestThread.join();
-    }
+    stopTimer();
+    memoryBudget->removeClient(this);
+    spectrogramThread->removeAnalyser(&recordingSpectrogram);
+    spectrogramThread->removeAnalyser(&generationSpectrogram);
+    // Aborts any request of ours that's still running, without waiting for it to unwind.
+    generationService->unregisterClient(generationClientId);
 }
 
 //==============================================================================
@@ -102,16 +125,63 @@ void RiffusionVSTAudioProcessor::prepareToPlay (double sampleRate, int samplesPe
     // Use this method as the place to do any pre-playback
     // initialisation that you need..
     currentSampleRate = sampleRate;
-    // Reset the sample rate if applicable.
-    if (prevSampleRate != currentSampleRate) {
-        prevSampleRate = currentSampleRate;
-        maxRecordingBufferSize = static_cast<int>(maxRecordingBufferLengthSeconds * currentSampleRate);
-        recordingBuffer = juce::AudioBuffer<float>(1, maxRecordingBufferSize);
-        generationBuffer = juce::AudioBuffer<float>(1, maxRecordingBufferSize);
+    {
+        // The buffers are only resized here if something has already needed them.
+        const juce::ScopedLock scopedLock(allocationLock);
+        // Reset the sample rate if applicable.
+        if (prevSampleRate != currentSampleRate) {
+            prevSampleRate = currentSampleRate;
+            maxRecordingBufferSize = static_cast<int>(maxRecordingBufferLengthSeconds * currentSampleRate);
+            if (buffersAllocated) {
+                allocateBuffers();
+            }
+        }
     }
+    // The lookback always listens, so it's allocated here rather than lazily.
+    lookback.prepare(maxRecordingBufferSize);
+    onsetDetector.prepare(currentSampleRate);
     hasAnyAudio = true;
 }
 
+void RiffusionVSTAudioProcessor::ensureBuffersAllocated()
+{
+    const juce::ScopedLock scopedLock(allocationLock);
+    if (buffersAllocated) {
+        return;
+    }
+    allocateBuffers();
+    buffersAllocated.store(true, std::memory_order_release);
+}
+
+void RiffusionVSTAudioProcessor::allocateBuffers()
+{
+    recordingBuffer = juce::AudioBuffer<float>(1, maxRecordingBufferSize);
+    juce::AudioBuffer<float> freshGeneration(1, maxRecordingBufferSize);
+    {
+        // Anything spilled was the old size.
+        const juce::ScopedLock spillScope(spillLock);
+        spilledGeneration.reset();
+        const juce::SpinLock::ScopedLockType generationScope(generationLock);
+        std::swap(generationBuffer, freshGeneration);
+        generationSpilled = false;
+    }
+}
+
+void RiffusionVSTAudioProcessor::ensureResident()
+{
+    ensureBuffersAllocated();
+    wakeFromSpill();
+    selectRestoredTake();
+}
+
+void RiffusionVSTAudioProcessor::selectRestoredTake()
+{
+    const int take = restoredTake.exchange(-1);
+    if (take >= 0) {
+        selectTake(take);
+    }
+}
+
 void RiffusionVSTAudioProcessor::releaseResources()
 {
     // When playback stops, you can use this as an opportunity to free up any
@@ -153,9 +223,9 @@ bool RiffusionVSTAudioProcessor::appendBlock(const juce::AudioBuffer<float>& inp
     // Append a block of data into the recording buffer.
     int numToCopy = std::min(maxRecordingBufferSize - recordingStartPtr, input.getNumSamples());
     recordingBuffer.copyFrom(0, recordingStartPtr, input.getReadPointer(0), numToCopy);
+    recordingSpectrogram.pushSamples(input.getReadPointer(0), numToCopy);
     recordingStartPtr += numToCopy;
-    double s = recordingStartPtr / currentSampleRate;
-    message = std::to_string(s) + "/" + std::to_string(maxRecordingBufferLengthSeconds);
+    setAudioStatus(AudioStatus::Recording);
     return recordingStartPtr < maxRecordingBufferSize;
 }
 
@@ -165,24 +235,35 @@ void RiffusionVSTAudioProcessor::startRecording() {
     }
     isRecording = true;
     recordingStartPtr = 0;
+    recordingPrerollSamples = 0;
     recordingBuffer.clear();
+    ++recordingCount;
+    // Whatever was speculated on the last take is no use for this one.
+    if (speculativeGeneration) {
+        speculationRequested = false;
+        speculationCancelRequested = true;
+    }
 }
 
 void RiffusionVSTAudioProcessor::stopRecording() {
     isRecording = false;
-    message = "Stopped Recording";
-    if (wavWriteBuffer.size() < maxRecordingBufferSize * sizeof(uint16_t)) {
-        wavWriteBuffer.resize(maxRecordingBufferSize * sizeof(uint16_t), 0);
-    }
-    juce::MemoryOutputStream* memStream = new juce::MemoryOutputStream(maxRecordingBufferSize * sizeof(uint16_t));
-    std::unique_ptr<juce::AudioFormatWriter> writer(wavInterface->createWriterFor(memStream, outputSampleRate, 1, 16, juce::StringPairArray(), 0));
-    if (!writer) {
-        delete memStream;
-        return;
+    setAudioStatus(AudioStatus::StoppedRecording);
+    if (speculativeGeneration && !isNonRealtime()) {
+        speculationRequested = true;
+    }
+    // During an offline bounce nobody is there to click "Generate New", and the host
+    // will wait for us anyway, so get going on the take straight away.
+    if (isNonRealtime()) {
+        ProcessParams params;
+        {
+            std::lock_guard<std::mutex> lock(processParamsMutex);
+            if (!hasProcessParams) {
+                return;
+            }
+            params = processParams;
+        }
+        startGenerating(params);
     }
-    writer->writeFromAudioSampleBuffer(recordingBuffer, 0, recordingBuffer.getNumSamples());
-    writer->flush();
-    base64Wav = juce::Base64::toBase64(memStream->getData(), memStream->getDataSize());
 }
 
 void RiffusionVSTAudioProcessor::startPlaying(PlayState state) {
@@ -191,20 +272,50 @@ void RiffusionVSTAudioProcessor::startPlaying(PlayState state) {
     }
     playbackStartPtr = 0;
     playState = state;
-    message = "Started Playing";
+    setAudioStatus(AudioStatus::StartedPlaying);
 }
 
 void RiffusionVSTAudioProcessor::stopPlaying() 
 {
     playState = PlayState::NotPlaying;
-    message = "Stopped Playing";
+    setAudioStatus(AudioStatus::StoppedPlaying);
+}
+
+void RiffusionVSTAudioProcessor::setMessage(const juce::String& text) {
+    const juce::ScopedLock scopedLock(messageLock);
+    message = text;
+    audioStatus = AudioStatus::None;
+}
+
+juce::String RiffusionVSTAudioProcessor::getMessage() const {
+    switch (audioStatus.load()) {
+        case AudioStatus::Recording:
+            return juce::String(recordingStartPtr / currentSampleRate, 2) + "/" + juce::String(maxRecordingBufferLengthSeconds, 2);
+        case AudioStatus::StoppedRecording: return "Stopped Recording";
+        case AudioStatus::StartedPlaying: return "Started Playing";
+        case AudioStatus::StoppedPlaying: return "Stopped Playing";
+        case AudioStatus::WaitingForDaw: return "Waiting for DAW...";
+        case AudioStatus::Waiting: return "Waiting...";
+        case AudioStatus::OnsetDetected: return "Onset Detected";
+        case AudioStatus::None: break;
+    }
+    const juce::ScopedLock scopedLock(messageLock);
+    return message;
 }
 
 void RiffusionVSTAudioProcessor::processBlock(juce::AudioBuffer<float>& buffer, juce::MidiBuffer& midiMessages)
 {
     juce::ScopedNoDenormals noDenormals;
+    // Offline, blocking on a pending generation is allowed, and expected.
+    RealtimeSafetyChecker::ScopedRealtime realtime(!isNonRealtime());
+    PerformanceTracer::ScopedBlockTimer blockTimer(*tracer, buffer.getNumSamples());
     auto totalNumInputChannels = getTotalNumInputChannels();
     auto totalNumOutputChannels = getTotalNumOutputChannels();
+    // Picked up every block, even when nothing plays them, so whatever they replace
+    // (a spilled take's render, say) is retired for the timer to free.
+    timeStretch.acquire();
+    morph.acquire();
+    takeHistory.acquire();
 
     for (const juce::MidiMessageMetadata& midiMessage : midiMessages) {
         juce::MidiMessage message = midiMessage.getMessage();
@@ -225,12 +336,36 @@ void RiffusionVSTAudioProcessor::processBlock(juce::AudioBuffer<float>& buffer,
             }
         }
     }
+    // Nothing has needed the buffers yet. Offline they can be allocated right here,
+    // otherwise the timer does it on the message thread.
+    if (!buffersAllocated.load(std::memory_order_acquire)) {
+        const bool needsBuffers = isRecording || playState != PlayState::NotPlaying || onsetTriggersRecording
+            || grabLookbackRequested;
+        if (needsBuffers && isNonRealtime()) {
+            ensureBuffersAllocated();
+            selectRestoredTake();
+        }
+        else if (needsBuffers) {
+            allocationRequested = true;
+        }
+    }
     auto currentPosition = getPlayHead()->getPosition();
+    if (hasAnyAudio && totalNumInputChannels > 0) {
+        processLookback(buffer, currentPosition);
+    }
+    // Until the buffers are there, blocks pass through untouched.
+    if (!buffersAllocated.load(std::memory_order_acquire)) {
+        return;
+    }
     bool waitForDAW = doesDAWControlTiming && (isRecording || playState != PlayState::NotPlaying);
     if (currentPosition) {
         if (isRecording && !wasRecordingLastBlock && currentPosition->getIsPlaying()) {
             timecodeStartOfRecording = currentPosition->getPpqPosition().orFallback(-1.0);
             bpmStartOfRecording = currentPosition->getBpm().orFallback(-1.0);
+            // Any pre-roll in the take was played before this block.
+            if (timecodeStartOfRecording >= 0.0 && bpmStartOfRecording > 0.0) {
+                timecodeStartOfRecording -= recordingPrerollSamples / currentSampleRate * bpmStartOfRecording / 60.0;
+            }
         }
     }
     if (waitForDAW) {
@@ -239,7 +374,7 @@ void RiffusionVSTAudioProcessor::processBlock(juce::AudioBuffer<float>& buffer,
         }
         if (!currentPosition->getIsPlaying()) {
             if (!wasRecordingLastBlock) {
-                message = "Waiting for DAW...";
+                setAudioStatus(AudioStatus::WaitingForDaw);
                 return;
             }
             else if (isRecording && wasRecordingLastBlock) {
@@ -268,68 +403,206 @@ void RiffusionVSTAudioProcessor::processBlock(juce::AudioBuffer<float>& buffer,
         // the samples and the outer loop is handling the channels.
         // Alternatively, you can process the samples with the channels
         // interleaved by keeping the same state.
-        if (playState != PlayState::NotPlaying) {
-            const auto& playBuffer = ((playState == PlayState::PlayingRecorded)
-                ? recordingBuffer : generationBuffer);
-            int sampleOffset = playbackStartPtr;
-            // Compute a synchronizing sample offset so that we're playing at the precise time
-            // that the DAW tells us it is.
-            if (doesDAWControlTiming && currentPosition && (timecodeStartOfRecording >= 0.0)) {
-                double tBeats = currentPosition->getPpqPosition().orFallback(-1.0);
-                double bpm = bpmStartOfRecording;
-                if (tBeats >= 0.0 && bpm > 0.0) {
-                    // This is the offset time from the start of recording in beats.
-                    // Beats / 1
-                    double deltaTBeats = tBeats - timecodeStartOfRecording;
-                    // Seconds / 1 = Beats / 1 * (Beats / Minute) ^-1 * (Seconds / Minute)
-                    double deltaTSeconds = deltaTBeats / bpm * 60.0;
-                    // Samples / 1 = (Seconds / 1) * (Samples / Second)
-                    sampleOffset = static_cast<int>(deltaTSeconds * currentSampleRate);
-                }
-            }
-            if (sampleOffset < 0) {
-                // Playback is happening before the sample. We can't play it here.
-                return;
-            }
-            int samplesToEnd = recordingStartPtr - sampleOffset;
-            if (samplesToEnd <= 0) {
-                sampleOffset = 0;
-                samplesToEnd = playBuffer.getNumSamples();
+        if (playState == PlayState::PlayingGenerated && isNonRealtime() && isGenerating) {
+            waitForGenerationOffline();
+        }
+        if (playState == PlayState::PlayingGenerated && isNonRealtime() && generationSpilled) {
+            wakeFromSpill();
+        }
+        // Only looked up again when the state or layout changes.
+        const BlockMode mode = getBlockMode();
+        const int kernelKey = (static_cast<int>(mode) * 4 + std::min(totalNumInputChannels, 3)) * 2 + (doesDAWControlTiming ? 1 : 0);
+        if (kernelKey != blockKernelKey) {
+            blockKernelKey = kernelKey;
+            blockKernel = getBlockKernel(mode, totalNumInputChannels, doesDAWControlTiming);
+        }
+        (this->*blockKernel)(buffer, currentPosition, totalNumInputChannels);
+    }
+}
+
+RiffusionVSTAudioProcessor::BlockMode RiffusionVSTAudioProcessor::getBlockMode() const {
+    switch (playState) {
+        case PlayState::PlayingRecorded: return BlockMode::PlayingRecorded;
+        case PlayState::PlayingGenerated: return BlockMode::PlayingGenerated;
+        case PlayState::NotPlaying: break;
+    }
+    return isRecording ? BlockMode::Recording : BlockMode::Idle;
+}
+
+template <std::size_t... Indices>
+constexpr std::array<RiffusionVSTAudioProcessor::BlockKernel, sizeof...(Indices)>
+RiffusionVSTAudioProcessor::makeBlockKernels(std::index_sequence<Indices...>) {
+    return { { &RiffusionVSTAudioProcessor::renderBlock<
+        static_cast<BlockMode>(Indices / (kNumKernelLayouts * kNumKernelSyncModes)),
+        kKernelLayoutChannels[(Indices / kNumKernelSyncModes) % kNumKernelLayouts],
+        static_cast<SyncMode>(Indices % kNumKernelSyncModes)>... } };
+}
+
+RiffusionVSTAudioProcessor::BlockKernel RiffusionVSTAudioProcessor::getBlockKernel(BlockMode mode, int numInputChannels,
+    bool dawSync) {
+    static constexpr auto kernels = makeBlockKernels(std::make_index_sequence<kNumKernelModes * kNumKernelLayouts * kNumKernelSyncModes>());
+    const int layout = numInputChannels == 1 ? 0 : (numInputChannels == 2 ? 1 : 2);
+    return kernels[(static_cast<int>(mode) * kNumKernelLayouts + layout) * kNumKernelSyncModes + (dawSync ? 1 : 0)];
+}
+
+template <RiffusionVSTAudioProcessor::BlockMode mode, int numChannels, RiffusionVSTAudioProcessor::SyncMode sync>
+void RiffusionVSTAudioProcessor::renderBlock(juce::AudioBuffer<float>& buffer,
+    const juce::Optional<juce::AudioPlayHead::PositionInfo>& currentPosition, int numInputChannels) {
+    // Constants in every specialisation, so the branches on them fold away.
+    constexpr BlockMode blockMode = mode;
+    constexpr bool dawSync = sync == SyncMode::Daw;
+    const int channels = (numChannels > 0) ? numChannels : numInputChannels;
+    if (blockMode == BlockMode::Idle) {
+        return;
+    }
+    if (blockMode == BlockMode::Recording) {
+        if (hasAnyAudio) {
+            bool keepGoing = appendBlock(buffer);
+            if (!keepGoing) {
+                stopRecording();
             }
-            int minBufferSize = std::min(playBuffer.getNumSamples(),
-                buffer.getNumSamples());
-            int blockSize = std::min(std::min(minBufferSize, recordingStartPtr), samplesToEnd);
-            for (int channel = 0; channel < totalNumInputChannels; ++channel)
-            {
-                if (buffer.getNumChannels() == 0) {
-                    continue;
-                }
-                buffer.copyFrom(channel, 0,
-                    playBuffer.getReadPointer(0) + sampleOffset,
-                    blockSize
-                );
+        }
+        else {
+            setAudioStatus(AudioStatus::Waiting);
+        }
+        return;
+    }
+    const bool playingGenerated = blockMode == BlockMode::PlayingGenerated;
+    // An older take from the history plays straight from its mapped pages. Switching
+    // is just picking up the newest view.
+    const TakeHistory::View* selectedTake = playingGenerated ? takeHistory.acquire() : nullptr;
+    const bool playingOlderTake = selectedTake != nullptr && selectedTake->audio.getNumSamples() > 0;
+    // Nothing plays while the generated take is being replaced, or is spilled to disk
+    // and waiting to be read back on the message thread.
+    const bool usesGenerationBuffer = playingGenerated && !playingOlderTake;
+    const juce::SpinLock::ScopedTryLockType generationTryLock(generationLock, usesGenerationBuffer);
+    if (usesGenerationBuffer) {
+        if (!generationTryLock.isLocked() || generationSpilled) {
+            if (generationSpilled) {
+                wakeRequested = true;
             }
-            playbackStartPtr = sampleOffset;
-            playbackStartPtr += blockSize;
+            return;
         }
-        else if (isRecording) {
-            if (hasAnyAudio) {
-                bool keepGoing = appendBlock(buffer);
-                if (!keepGoing) {
-                    stopRecording();
-                }
+        lastGenerationUseMs = juce::Time::getMillisecondCounter();
+    }
+    const juce::AudioBuffer<float>* playBuffer = playingOlderTake ? &selectedTake->audio
+        : (playingGenerated ? &generationBuffer : &recordingBuffer);
+    // The generated take keeps the timing of the recording it came from.
+    int playLength = playingOlderTake ? selectedTake->recordedLength
+        : (usesGenerationBuffer ? generatedFrom.length : recordingStartPtr);
+    double playBpm = playingOlderTake ? selectedTake->recordedTempo
+        : (usesGenerationBuffer ? generatedFrom.tempo : bpmStartOfRecording);
+    // The morph plays at the tempo the takes were recorded at, so it's only used
+    // when they don't need stretching.
+    const float morphAmountNow = morphAmount->get();
+    const bool wantsMorph = usesGenerationBuffer && morphAmountNow < 1.0f && morph.getNumTakes() >= 2;
+    // When synced to the DAW, play the generated take stretched to the host's tempo
+    // if a render is ready. Until then, fall back to the unstretched take.
+    if (playingGenerated && dawSync && currentPosition) {
+        double hostBpm = currentPosition->getBpm().orFallback(-1.0);
+        const TimeStretchEngine::Rendered* stretched = nullptr;
+        if (hostBpm > 0.0 && isNonRealtime()) {
+            stretched = timeStretch.waitForTempo(hostBpm, maxOfflineWaitMs);
+        }
+        else {
+            if (hostBpm > 0.0) {
+                timeStretch.requestTempo(hostBpm);
             }
-            else {
-                message = "Waiting...";
+            stretched = timeStretch.acquire();
+        }
+        const bool morphCanPlay = wantsMorph && std::abs(hostBpm - playBpm) < morphTempoTolerance;
+        if (stretched != nullptr && stretched->audio.getNumSamples() > 0 && !morphCanPlay) {
+            playBuffer = &stretched->audio;
+            playLength = stretched->audio.getNumSamples();
+            playBpm = stretched->tempo;
+        }
+    }
+    PlaybackKernel::Source source;
+    source.audio = playBuffer;
+    source.length = playLength;
+    source.bpm = playBpm;
+    source.startBeats = playingOlderTake ? selectedTake->recordedStartBeats
+        : (usesGenerationBuffer ? generatedFrom.startBeats : timecodeStartOfRecording);
+    source.sampleRate = currentSampleRate;
+    const PlaybackKernel::Range range = PlaybackKernel::findRange<dawSync>(source, playbackStartPtr,
+        buffer.getNumSamples(), currentPosition);
+    if (range.offset < 0) {
+        return;
+    }
+    const float* playSamples = playBuffer->getReadPointer(0) + range.offset;
+    // Rendered straight into the first channel, and copied to the rest from there.
+    if (wantsMorph && playBuffer == &generationBuffer && channels > 0
+        && morph.render(buffer.getWritePointer(0), range.offset, range.numSamples, morphAmountNow)) {
+        playSamples = buffer.getReadPointer(0);
+    }
+    PlaybackKernel::copyToChannels<numChannels>(buffer, playSamples, range.numSamples, numInputChannels);
+    auto& spectrogram = playingGenerated ? generationSpectrogram : recordingSpectrogram;
+    spectrogram.pushSamples(playSamples, range.numSamples);
+    playbackStartPtr = range.offset + range.numSamples;
+}
+
+void RiffusionVSTAudioProcessor::processLookback(const juce::AudioBuffer<float>& input,
+    const juce::Optional<juce::AudioPlayHead::PositionInfo>& position) {
+    const float* samples = input.getReadPointer(0);
+    const int numSamples = input.getNumSamples();
+    lookback.push(samples, numSamples);
+    int onsetPosition = 0;
+    const bool onset = onsetDetector.process(samples, numSamples, &onsetPosition);
+    // The lookback runs from prepareToPlay on, but a take can't be made from it until
+    // the recording buffer is there. A grab waits for it.
+    if (!buffersAllocated.load(std::memory_order_acquire)) {
+        return;
+    }
+
+    if (grabLookbackRequested.exchange(false) && !isRecording) {
+        if (playState == PlayState::PlayingRecorded) {
+            stopPlaying();
+        }
+        const int numToGrab = std::min(lookback.getNumAvailable(), maxRecordingBufferSize);
+        recordingBuffer.clear();
+        lookback.copyLatest(recordingBuffer.getWritePointer(0), numToGrab);
+        recordingStartPtr = numToGrab;
+        recordingPrerollSamples = numToGrab;
+        ++recordingCount;
+        // Line the take up with where it was played, if the DAW is rolling.
+        timecodeStartOfRecording = -1.0;
+        if (position && position->getIsPlaying()) {
+            bpmStartOfRecording = position->getBpm().orFallback(-1.0);
+            double ppq = position->getPpqPosition().orFallback(-1.0);
+            if (ppq >= 0.0 && bpmStartOfRecording > 0.0) {
+                // The grab ends at the end of this block.
+                timecodeStartOfRecording = ppq - (numToGrab - numSamples) / currentSampleRate * bpmStartOfRecording / 60.0;
             }
         }
+        stopRecording();
+        ++lookbackGrabCount;
+        return;
+    }
+
+    // When the DAW controls timing, takes only start while it's rolling.
+    const bool dawAllowsRecording = !doesDAWControlTiming || (position && position->getIsPlaying());
+    if (onset && onsetTriggersRecording && dawAllowsRecording && !isRecording && playState == PlayState::NotPlaying) {
+        startRecording();
+        // Start the take a little before the onset. The current block is appended
+        // by the recording code as usual, so whatever of it comes before the onset
+        // already counts, and only the rest of the pre-roll is copied here.
+        const int preroll = std::min(lookback.getNumAvailable() - numSamples,
+            static_cast<int>(onsetPrerollSeconds * currentSampleRate) - onsetPosition);
+        if (preroll > 0) {
+            lookback.copyLatest(recordingBuffer.getWritePointer(0), preroll, numSamples);
+            recordingSpectrogram.pushSamples(recordingBuffer.getReadPointer(0), preroll);
+            recordingStartPtr = preroll;
+            recordingPrerollSamples = preroll;
+        }
+        setAudioStatus(AudioStatus::OnsetDetected);
     }
 }
 
-juce::URL RiffusionVSTAudioProcessor::buildURL(const RiffusionVSTAudioProcessor::ProcessParams& params) const {
-    // Make a bunch of JSON and put it in a POST payload.
-    juce::URL url(params.serverAddress);
-    url = url.getChildURL("/run_vst/");
+GenerationService::Request RiffusionVSTAudioProcessor::buildRequest(const RiffusionVSTAudioProcessor::ProcessParams& params,
+    UploadPreprocessor::Region* region) const {
+    // Make a bunch of JSON. The service adds the audio and puts it in a POST payload.
+    GenerationService::Request request;
+    request.serverAddress = params.serverAddress;
 
     juce::DynamicObject::Ptr jsonObject = new juce::DynamicObject(); // Apparently pointers are owned by var?
     jsonObject->setProperty("alpha", juce::var(params.alpha));
@@ -347,96 +620,454 @@ juce::URL RiffusionVSTAudioProcessor::buildURL(const RiffusionVSTAudioProcessor:
     fillPrompt(endJson.get(), params.promptB);
     jsonObject->setProperty("start", juce::var(startJson.get()));
     jsonObject->setProperty("end", juce::var(endJson.get()));
-    // The wav file bytes are literally just dumped into the POST data as a base64 string.
-    jsonObject->setProperty("audio", juce::var(base64Wav));
-    url = url.withPOSTData(juce::JSON::toString(juce::var(jsonObject.get()), true, 3));
-    return url;
+    request.params = juce::var(jsonObject.get());
+
+    // Only the part of the take that was recorded and isn't silence gets sent. This is
+    // deterministic, so speculative requests built from the same take share cache keys.
+    {
+        PerformanceTracer::ScopedSpan span(*tracer, "preprocessUpload");
+        const int numValidSamples = recordingStartPtr > 0 ? recordingStartPtr : recordingBuffer.getNumSamples();
+        const UploadPreprocessor::Region trimmed = UploadPreprocessor::process(recordingBuffer, numValidSamples, currentSampleRate,
+            request.audio);
+        if (region != nullptr) {
+            *region = trimmed;
+        }
+    }
+    // Riffusion only speaks 44100, the samples are labelled as such whatever the DAW runs at.
+    request.sampleRate = outputSampleRate;
+    return request;
 }
 
 void RiffusionVSTAudioProcessor::startGenerating(const RiffusionVSTAudioProcessor::ProcessParams& params) {
-    std::lock_guard<std::mutex> lock(internetRequestMutex);
+    setMessage("Waiting...");
+    UploadPreprocessor::Region region;
+    GenerationService::Request request = buildRequest(params, &region);
+    // The audio thread may start another take while this one is generating, so what's
+    // needed of this one is taken now.
+    submitGeneration(std::move(request), region, paramsToVar(params),
+        { recordingStartPtr, bpmStartOfRecording, timecodeStartOfRecording });
+}
+
+void RiffusionVSTAudioProcessor::resumeGeneration(const juce::String& serverAddress, const juce::String& jobId,
+    int uploadStart, const juce::var& takeParams, const Recorded& recorded) {
+    setMessage("Resuming...");
+    GenerationService::Request request;
+    request.serverAddress = serverAddress;
+    request.resumeJobId = jobId;
+    UploadPreprocessor::Region region;
+    region.start = uploadStart;
+    submitGeneration(std::move(request), region, takeParams, recorded);
+}
+
+juce::var RiffusionVSTAudioProcessor::paramsToVar(const ProcessParams& params) {
+    juce::DynamicObject::Ptr object = new juce::DynamicObject();
+    object->setProperty("serverAddress", juce::var(params.serverAddress));
+    object->setProperty("promptA", juce::var(params.promptA));
+    object->setProperty("promptB", juce::var(params.promptB));
+    object->setProperty("alpha", juce::var(params.alpha));
+    object->setProperty("denoising", juce::var(params.denoising));
+    object->setProperty("guidance", juce::var(params.guidance));
+    object->setProperty("seed", juce::var(params.seed));
+    object->setProperty("numInferenceSteps", juce::var(params.numInferenceSteps));
+    object->setProperty("seedText", juce::var(params.seedText));
+    return juce::var(object.get());
+}
+
+RiffusionVSTAudioProcessor::ProcessParams RiffusionVSTAudioProcessor::varToParams(const juce::var& json) {
+    ProcessParams params;
+    params.serverAddress = json["serverAddress"].toString().toStdString();
+    params.promptA = json["promptA"].toString().toStdString();
+    params.promptB = json["promptB"].toString().toStdString();
+    params.alpha = static_cast<float>(json["alpha"]);
+    params.denoising = static_cast<float>(json["denoising"]);
+    params.guidance = static_cast<float>(json["guidance"]);
+    params.seed = static_cast<int>(json["seed"]);
+    params.numInferenceSteps = static_cast<int>(json["numInferenceSteps"]);
+    params.seedText = json["seedText"].toString().toStdString();
+    return params;
+}
+
+void RiffusionVSTAudioProcessor::submitGeneration(GenerationService::Request request, const UploadPreprocessor::Region& region,
+    const juce::var& takeParams, const Recorded& recorded) {
     isGenerating = true;
-    message = "Waiting...";
-    if (internetRequestThread.joinable()) {
-        internetRequestThread.join();
+    generationProgress = -1.0;
+    // Bumped first, so the callback of whatever gets cancelled below is ignored.
+    const int generationId = ++latestGenerationId;
+    // Anything of ours still queued or running is stale now.
+    generationService->cancel(generationClientId);
+    const juce::String serverAddress = request.serverAddress;
+    {
+        std::lock_guard<std::mutex> lock(internetRequestMutex);
+        pendingJobId = request.resumeJobId;
+        pendingJobServer = serverAddress;
+        pendingUploadRegion = region;
+        pendingTakeParams = takeParams;
+        pendingRecorded = recorded;
     }
-    // Background thread that actually sends the request.
-    internetRequestThread = std::thread([this, params]()
+    generationService->submit(generationClientId, std::move(request),
+        [this, generationId, region, takeParams, recording = recordingCount.load(), recorded]
+        (const GenerationService::Result& result)
         {
-            juce::String response;
-            bool success = getHttpRequest(buildURL(params), &response);
-            std::lock_guard<std::mutex> innerLock(internetRequestMutex);
-            if (success) {
-                message = "Done Generating";
-                // Parse JSON from the server.
-                juce::var jsonObject = juce::JSON::parse(response);
-                if (jsonObject.hasProperty("audio")) {
-                    const juce::var& audio = jsonObject["audio"];
-                    if (audio.isString()) {
-                        juce::String wave64 = audio.toString();
-                        juce::MemoryOutputStream buffer(wavWriteBuffer.data(), wavWriteBuffer.size());
-                        // Try to convert the payload into actual data we can read. This is a .wav file.
-                        if (juce::Base64::convertFromBase64(buffer, wave64)) {
-                            // Create a virtual wave file file handle and try to read it.
-                            juce::MemoryBlock block(wavWriteBuffer.data(), wavWriteBuffer.size());
-                            juce::MemoryInputStream* inputBuffer = new juce::MemoryInputStream(block, false);
-         
-                            std::unique_ptr<juce::AudioFormatReader> reader(wavInterface->createReaderFor(inputBuffer, true));
-                            if (reader) {
-                                reader->read(&generationBuffer, 0, static_cast<int>(reader->lengthInSamples), 0, true, false);
-                            }
-                            else {
-                                message = "Failed to read memory for WAV file.";
-                                delete inputBuffer;
-                            }
-                        }
-                        else {
-                            message = "Failed to convert audio data.";
-                        }
-                    }
-                }
+            // Runs on a service worker, and unregistering waits for it, so it only hands
+            // the take over. Placing it, the disk write and the morph analysis are done
+            // by installCompletedGeneration, on the message thread or an offline bounce.
+            std::lock_guard<std::mutex> lock(internetRequestMutex);
+            // A newer generation was started (or this one was stopped) in the meantime.
+            if (generationId != latestGenerationId) {
+                return;
             }
-            else {
-                message = response.toStdString();
+            pendingJobId.clear();
+            generationProgress = -1.0;
+            setMessage(result.message);
+            if (result.success) {
+                completedGeneration = std::make_unique<CompletedGeneration>(CompletedGeneration {
+                    generationId, result.audio, region, takeParams, recording, recorded });
+                return;
             }
             isGenerating = false;
+            generationFinished.signal();
+        },
+        [this, generationId](const juce::String& jobId, const RiffusionClient::JobStatus& status)
+        {
+            std::lock_guard<std::mutex> lock(internetRequestMutex);
+            if (generationId != latestGenerationId) {
+                return;
+            }
+            // Remembered so the job can be picked up again if the plugin is reloaded.
+            pendingJobId = jobId;
+            if (status.numSteps > 0) {
+                generationProgress = static_cast<double>(status.step) / status.numSteps;
+                setMessage("Generating " + juce::String(status.step) + "/" + juce::String(status.numSteps));
+            }
+            else if (status.state == RiffusionClient::JobStatus::State::Queued) {
+                setMessage("Queued on server...");
+            }
         });
 }
 
-void RiffusionVSTAudioProcessor::stopGenerating() {
-    std::lock_guard<std::mutex> lock(internetRequestMutex);
-    if (internetRequestThread.joinable()) {
-        internetRequestThread.join();
+void RiffusionVSTAudioProcessor::installCompletedGeneration() {
+    const juce::ScopedLock installScope(installLock);
+    std::unique_ptr<CompletedGeneration> completed;
+    {
+        std::lock_guard<std::mutex> lock(internetRequestMutex);
+        completed = std::move(completedGeneration);
     }
-    isGenerating = false;
-    message = "";
-}
-
-bool RiffusionVSTAudioProcessor::getHttpRequest(const juce::URL& url, juce::String* content) {
-    // Does the entire HTTP POST request to the server. Returns the content as a string.
-    juce::StringPairArray responseHeaders;
-    juce::String extraHeader = "Accept: application/json\r\n"
-                                "Content-Type: application/json\r\n"
-                                "Sec-Fetch-Mode: cors\r\n";
-    int statusCode = 0;
-    auto options = juce::URL::InputStreamOptions(juce::URL::ParameterHandling::inPostData)
-        .withExtraHeaders(extraHeader)
-        .withConnectionTimeoutMs(timeoutRequestMs)
-        .withStatusCode(&statusCode)
-        .withNumRedirectsToFollow(32);
-    std::unique_ptr<juce::InputStream> stream = url.createInputStream(options);
-    if (stream != nullptr) {
-        *content = stream->readEntireStreamAsString();
-        return true;
-    }
-
-    if (statusCode != 0) {
-        *content = "Failed to connect, status code = " + juce::String(statusCode);
+    if (completed == nullptr) {
+        return;
+    }
+    // The server only saw the trimmed take, so its answer goes back where that
+    // started in the recording, with silence over the trimmed lead-in.
+    const UploadPreprocessor::Region& region = completed->region;
+    std::shared_ptr<const juce::AudioBuffer<float>> placed = completed->audio;
+    if (region.start > 0) {
+        auto shifted = std::make_shared<juce::AudioBuffer<float>>(placed->getNumChannels(),
+            region.start + placed->getNumSamples());
+        shifted->clear(0, region.start);
+        for (int channel = 0; channel < shifted->getNumChannels(); ++channel) {
+            shifted->copyFrom(channel, region.start, *completed->audio, channel, 0, completed->audio->getNumSamples());
+        }
+        placed = shifted;
+    }
+    // A job resumed from a state saved before the length was known.
+    Recorded recorded = completed->recorded;
+    if (recorded.length <= 0) {
+        recorded.length = std::min(placed->getNumSamples(), maxRecordingBufferSize);
+    }
+    // Copied off to the side and swapped in, so the audio thread only misses
+    // the block the swap lands in. A new take also replaces a spilled one.
+    ensureBuffersAllocated();
+    juce::AudioBuffer<float> freshGeneration(1, maxRecordingBufferSize);
+    freshGeneration.clear();
+    freshGeneration.copyFrom(0, 0, *placed, 0, 0, std::min(placed->getNumSamples(), maxRecordingBufferSize));
+    {
+        const juce::ScopedLock spillScope(spillLock);
+        spilledGeneration.reset();
+        const juce::SpinLock::ScopedLockType generationScope(generationLock);
+        std::swap(generationBuffer, freshGeneration);
+        generatedFrom = recorded;
+        generationSpilled = false;
+    }
+    lastGenerationUseMs = juce::Time::getMillisecondCounter();
+    timeStretch.setSource(placed, recorded.length, recorded.tempo);
+    // Takes from an earlier recording can't be morphed with this one.
+    morph.addTake(placed, completed->recording != morphRecordingCount);
+    morphRecordingCount = completed->recording;
+    // Kept for good, and selected, since it's what generationBuffer holds now.
+    const int take = takeHistory.append(*placed, completed->takeParams, recorded.length, recorded.tempo,
+        recorded.startBeats);
+    // If it couldn't be stored, it's still what plays.
+    liveTake = take;
+    // A take restored with the state but not selected yet is what this replaces.
+    const int restored = restoredTake.exchange(-1);
+    previousTake = restored >= 0 ? restored : takeHistory.getSelected();
+    takeHistory.select(take, true);
+    {
+        std::lock_guard<std::mutex> lock(internetRequestMutex);
+        lastUploadRegion = region;
+        // Unless it was stopped, or another one started, while this was going in.
+        if (completed->generationId == latestGenerationId) {
+            isGenerating = false;
+        }
+    }
+    generationFinished.signal();
+}
+
+void RiffusionVSTAudioProcessor::setProcessParams(const RiffusionVSTAudioProcessor::ProcessParams& params) {
+    std::lock_guard<std::mutex> lock(processParamsMutex);
+    // Speculation covers the blend, anything else changing makes it useless.
+    const bool speculationIsStale = hasProcessParams && (params.serverAddress != processParams.serverAddress
+        || params.promptA != processParams.promptA || params.promptB != processParams.promptB
+        || params.denoising != processParams.denoising || params.guidance != processParams.guidance
+        || params.seed != processParams.seed || params.numInferenceSteps != processParams.numInferenceSteps);
+    if (speculationIsStale) {
+        generationService->cancelSpeculative(generationClientId);
+    }
+    processParams = params;
+    hasProcessParams = true;
+}
+
+bool RiffusionVSTAudioProcessor::getProcessParams(ProcessParams* params) {
+    std::lock_guard<std::mutex> lock(processParamsMutex);
+    if (!hasProcessParams) {
         return false;
     }
+    *params = processParams;
+    return true;
+}
 
-    *content = "Failed to connect!";
-    return false;
+void RiffusionVSTAudioProcessor::setSpeculativeGeneration(bool shouldSpeculate) {
+    speculativeGeneration = shouldSpeculate;
+    if (!shouldSpeculate) {
+        generationService->cancelSpeculative(generationClientId);
+    }
+}
+
+void RiffusionVSTAudioProcessor::timerCallback() {
+    installCompletedGeneration();
+    timeStretch.collectGarbage();
+    morph.collectGarbage();
+    takeHistory.collectGarbage();
+    if (allocationRequested.exchange(false)) {
+        ensureBuffersAllocated();
+        selectRestoredTake();
+    }
+    if (wakeRequested.exchange(false)) {
+        wakeFromSpill();
+    }
+    if (speculationCancelRequested.exchange(false)) {
+        generationService->cancelSpeculative(generationClientId);
+    }
+    if (speculationRequested.exchange(false) && speculativeGeneration && !isRecording) {
+        startSpeculating();
+    }
+}
+
+void RiffusionVSTAudioProcessor::startSpeculating() {
+    ProcessParams params;
+    {
+        std::lock_guard<std::mutex> lock(processParamsMutex);
+        if (!hasProcessParams) {
+            return;
+        }
+        params = processParams;
+    }
+    generationService->cancelSpeculative(generationClientId);
+    // The most likely request first, then the neighbours working outwards.
+    generationService->submitSpeculative(generationClientId, buildRequest(params));
+    const int alphaIndex = juce::roundToInt(params.alpha / speculativeAlphaStep);
+    for (int distance = 1; distance <= numSpeculativeNeighbours; ++distance) {
+        for (int direction : { 1, -1 }) {
+            // Computed the same way the slider snaps, so the request (and its cache key) matches.
+            double alpha = speculativeAlphaStep * (alphaIndex + direction * distance);
+            if (alpha < 0.0 || alpha > 1.0) {
+                continue;
+            }
+            ProcessParams neighbour = params;
+            neighbour.alpha = static_cast<float>(alpha);
+            generationService->submitSpeculative(generationClientId, buildRequest(neighbour));
+        }
+    }
+}
+
+juce::String RiffusionVSTAudioProcessor::getUploadSummary() {
+    UploadPreprocessor::Region region;
+    {
+        std::lock_guard<std::mutex> lock(internetRequestMutex);
+        region = lastUploadRegion;
+    }
+    if (region.length == 0) {
+        return {};
+    }
+    juce::String text;
+    text << "upload: " << juce::String(region.length / currentSampleRate, 2) << " s sent, trimmed "
+         << juce::String(region.start / currentSampleRate, 2) << " s lead, "
+         << juce::String(region.trimmedEnd / currentSampleRate, 2) << " s tail, gain "
+         << juce::String(juce::Decibels::gainToDecibels(region.gain), 1) << " dB\n";
+    return text;
+}
+
+juce::String RiffusionVSTAudioProcessor::getSpeculationSummary() const {
+    GenerationService::SpeculationStats stats = generationService->getSpeculationStats(generationClientId);
+    if (stats.submitted == 0) {
+        return {};
+    }
+    // Finished speculative results that were never asked for.
+    const int wasted = stats.completed - stats.hits;
+    juce::String text;
+    text << "speculation: " << stats.submitted << " queued, " << stats.completed << " done, "
+         << stats.hits << " hits, " << stats.promoted << " promoted, " << stats.cancelled << " cancelled\n";
+    if (stats.completed > 0) {
+        text << "  hit " << juce::roundToInt(100.0 * stats.hits / stats.completed) << "%, waste "
+             << juce::roundToInt(100.0 * wasted / stats.completed) << "%\n";
+    }
+    return text;
+}
+
+size_t RiffusionVSTAudioProcessor::getMemoryUsage() {
+    const juce::ScopedLock allocationScope(allocationLock);
+    const juce::ScopedLock spillScope(spillLock);
+    return getNumBytes(recordingBuffer) + getNumBytes(generationBuffer) + lookback.getMemoryUsage()
+        + morph.getMemoryUsage() + timeStretch.getMemoryUsage();
+}
+
+size_t RiffusionVSTAudioProcessor::getSpillableBytes() {
+    const juce::ScopedLock scopedLock(spillLock);
+    // Only a take that's there, finished and not playing.
+    if (!buffersAllocated || generationSpilled || lastGenerationUseMs == 0 || isGenerating
+        || playState == PlayState::PlayingGenerated) {
+        return 0;
+    }
+    return getNumBytes(generationBuffer) + morph.getMemoryUsage() + timeStretch.getMemoryUsage();
+}
+
+void RiffusionVSTAudioProcessor::spill() {
+    const juce::ScopedLock scopedLock(spillLock);
+    if (getSpillableBytes() == 0) {
+        return;
+    }
+    std::unique_ptr<MemoryBudget::SpilledBuffer> spilled = memoryBudget->spill(generationBuffer);
+    if (spilled == nullptr) {
+        return;
+    }
+    // Freed when this goes out of scope, outside the spin lock.
+    juce::AudioBuffer<float> freed;
+    {
+        const juce::SpinLock::ScopedLockType generationScope(generationLock);
+        std::swap(generationBuffer, freed);
+        generationSpilled = true;
+    }
+    spilledGeneration = std::move(spilled);
+    // The stretched render and the morph are made from the take, so they go too.
+    timeStretch.setSource(nullptr, 0, 0.0);
+    morph.suspend(*memoryBudget);
+}
+
+void RiffusionVSTAudioProcessor::wakeFromSpill() {
+    const juce::ScopedLock scopedLock(spillLock);
+    if (!generationSpilled) {
+        return;
+    }
+    juce::AudioBuffer<float> restored;
+    if (!spilledGeneration->restore(restored)) {
+        // The scratch file has gone. There's no getting the take back.
+        restored.setSize(1, maxRecordingBufferSize);
+        restored.clear();
+        setMessage("Spilled take was lost");
+    }
+    auto source = std::make_shared<juce::AudioBuffer<float>>(restored);
+    {
+        const juce::SpinLock::ScopedLockType generationScope(generationLock);
+        std::swap(generationBuffer, restored);
+        generationSpilled = false;
+    }
+    spilledGeneration.reset();
+    // An older take may have been selected, which the stretch reads from the store.
+    const int selected = takeHistory.getSelected();
+    if (selected >= 0 && selected != liveTake) {
+        const TakeHistory::Info info = takeHistory.getInfo(selected);
+        timeStretch.setSource(takeHistory.getAudio(selected), info.recordedLength, info.recordedTempo);
+    }
+    else if (liveTake >= 0) {
+        // As it was recorded, which the audio thread may have moved on from since.
+        const TakeHistory::Info info = takeHistory.getInfo(liveTake);
+        timeStretch.setSource(std::move(source), info.recordedLength, info.recordedTempo);
+    }
+    else {
+        timeStretch.setSource(std::move(source), generatedFrom.length, generatedFrom.tempo);
+    }
+    morph.resume();
+    lastGenerationUseMs = juce::Time::getMillisecondCounter();
+}
+
+void RiffusionVSTAudioProcessor::selectTake(int index) {
+    const int current = takeHistory.getSelected();
+    if (index < 0 || index == current) {
+        return;
+    }
+    ensureResident();
+    if (!takeHistory.select(index, index == liveTake)) {
+        setMessage("Couldn't read take " + juce::String(index + 1));
+        return;
+    }
+    previousTake = current;
+    // The stretch is rendered from the store too, rather than from a copy on the heap.
+    const TakeHistory::Info info = takeHistory.getInfo(index);
+    timeStretch.setSource(takeHistory.getAudio(index), info.recordedLength, info.recordedTempo);
+    setMessage("Take " + juce::String(index + 1));
+}
+
+juce::String RiffusionVSTAudioProcessor::getMemorySummary() {
+    juce::String text;
+    if (!buffersAllocated) {
+        text << "memory: buffers not allocated yet\n";
+    }
+    else {
+        const juce::ScopedLock allocationScope(allocationLock);
+        const juce::ScopedLock spillScope(spillLock);
+        text << "memory: rec " << toMegabytes(getNumBytes(recordingBuffer))
+             << ", gen " << (generationSpilled ? juce::String("spilled") : toMegabytes(getNumBytes(generationBuffer)))
+             << ", lookback " << toMegabytes(lookback.getMemoryUsage())
+             << ", morph " << (morph.isSuspended() ? juce::String("spilled") : toMegabytes(morph.getMemoryUsage()))
+             << ", stretch " << toMegabytes(timeStretch.getMemoryUsage()) << " MB\n";
+    }
+    text << "  all " << memoryBudget->getNumClients() << " instances: " << toMegabytes(memoryBudget->getTotalUsage())
+         << " of " << toMegabytes(memoryBudget->getBudget()) << " MB, " << memoryBudget->getNumSpilled()
+         << " spilled, scratch " << toMegabytes(static_cast<size_t>(memoryBudget->getScratchFileSize())) << " MB\n";
+    if (takeHistory.getNumTakes() > 0) {
+        text << "takes: " << takeHistory.getNumTakes() << " stored, "
+             << toMegabytes(static_cast<size_t>(takeHistory.getStoreSize())) << " MB on disk, "
+             << takeHistory.getNumMapped() << " mapped\n";
+    }
+    return text;
+}
+
+void RiffusionVSTAudioProcessor::waitForGenerationOffline() {
+    // Every block of the bounce calls this, so the deadline is set by the first one to
+    // wait for this generation, not reset by each.
+    const int generationId = latestGenerationId;
+    if (generationId != offlineWaitGenerationId) {
+        offlineWaitGenerationId = generationId;
+        offlineWaitDeadline = juce::Time::getMillisecondCounterHiRes() + maxOfflineWaitMs;
+    }
+    while (isGenerating && generationId == latestGenerationId
+        && juce::Time::getMillisecondCounterHiRes() < offlineWaitDeadline) {
+        // The host is waiting on this block, so the take goes in here rather than
+        // whenever the message thread gets to it.
+        installCompletedGeneration();
+        generationFinished.wait(10);
+    }
+}
+
+void RiffusionVSTAudioProcessor::stopGenerating() {
+    std::lock_guard<std::mutex> lock(internetRequestMutex);
+    // Aborts whatever is running straight away. If its callback is already on the
+    // way, the generation id makes sure it's ignored.
+    generationService->cancel(generationClientId);
+    ++latestGenerationId;
+    isGenerating = false;
+    pendingJobId.clear();
+    generationProgress = -1.0;
+    setMessage({});
 }
 
 //==============================================================================
@@ -456,12 +1087,70 @@ void RiffusionVSTAudioProcessor::getStateInformation (juce::MemoryBlock& destDat
     // You should use this method to store your parameters in the memory block.
     // You could do that either as raw data, or use the XML or ValueTree classes
     // as intermediaries to make it easy to save and load complex data.
+    juce::XmlElement state("RiffusionVST");
+    {
+        // A job still running on the server is picked up again when the project is reopened.
+        std::lock_guard<std::mutex> lock(internetRequestMutex);
+        if (isGenerating && pendingJobId.isNotEmpty()) {
+            state.setAttribute("pendingJobId", pendingJobId);
+            state.setAttribute("pendingJobServer", pendingJobServer);
+            state.setAttribute("pendingUploadStart", pendingUploadRegion.start);
+            state.setAttribute("pendingTakeParams", juce::JSON::toString(pendingTakeParams, true));
+            state.setAttribute("pendingRecordedLength", pendingRecorded.length);
+            state.setAttribute("pendingRecordedTempo", pendingRecorded.tempo);
+            state.setAttribute("pendingRecordedStart", pendingRecorded.startBeats);
+        }
+    }
+    // The takes themselves stay in their store, which is opened again on load.
+    const juce::File takeStore = takeHistory.getFile();
+    if (takeStore != juce::File()) {
+        state.setAttribute("takeStore", takeStore.getFullPathName());
+        const int restored = restoredTake;
+        state.setAttribute("selectedTake", restored >= 0 ? restored : takeHistory.getSelected());
+        // From now on the store is kept when the instance goes away.
+        takeHistory.markSaved();
+    }
+    state.setAttribute("morph", morphAmount->get());
+    ProcessParams params;
+    if (getProcessParams(&params)) {
+        state.setAttribute("processParams", juce::JSON::toString(paramsToVar(params), true));
+    }
+    copyXmlToBinary(state, destData);
 }
 
 void RiffusionVSTAudioProcessor::setStateInformation (const void* data, int sizeInBytes)
 {
     // You should use this method to restore your parameters from this memory block,
     // whose contents will have been created by the getStateInformation() call.
+    std::unique_ptr<juce::XmlElement> state = getXmlFromBinary(data, sizeInBytes);
+    if (state == nullptr || !state->hasTagName("RiffusionVST")) {
+        return;
+    }
+    *morphAmount = static_cast<float>(state->getDoubleAttribute("morph", 1.0));
+    const juce::var params = juce::JSON::parse(state->getStringAttribute("processParams"));
+    if (params.isObject()) {
+        setProcessParams(varToParams(params));
+    }
+    const juce::String takeStore = state->getStringAttribute("takeStore");
+    restoredTake = -1;
+    if (juce::File::isAbsolutePath(takeStore) && takeHistory.open(juce::File(takeStore))) {
+        // None of the takes are in generationBuffer, so the selected one plays from the
+        // store. It isn't mapped until the instance is used, like the buffers.
+        liveTake = -1;
+        previousTake = -1;
+        restoredTake = state->getIntAttribute("selectedTake", takeHistory.getNumTakes() - 1);
+    }
+    juce::String jobId = state->getStringAttribute("pendingJobId");
+    if (jobId.isNotEmpty()) {
+        // States saved before these were kept have a length of 0, and the take's own is used.
+        Recorded recorded;
+        recorded.length = state->getIntAttribute("pendingRecordedLength", 0);
+        recorded.tempo = state->getDoubleAttribute("pendingRecordedTempo", 0.0);
+        recorded.startBeats = state->getDoubleAttribute("pendingRecordedStart", -1.0);
+        resumeGeneration(state->getStringAttribute("pendingJobServer"), jobId,
+            state->getIntAttribute("pendingUploadStart"), juce::JSON::parse(state->getStringAttribute("pendingTakeParams")),
+            recorded);
+    }
 }
 
 //==============================================================================
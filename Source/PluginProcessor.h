@@ -9,6 +9,20 @@
 #pragma once
 
 #include <JuceHeader.h>
+#include "GenerationService.h"
+#include "LookbackCapture.h"
+#include "MemoryBudget.h"
+#include "MorphEngine.h"
+#include "PerformanceTracer.h"
+#include "PlaybackKernel.h"
+#include "RealtimeSafetyChecker.h"
+#include "SpectrogramAnalyser.h"
+#include "TakeHistory.h"
+#include "TimeStretchEngine.h"
+#include "UploadPreprocessor.h"
+
+#include <array>
+#include <utility>
 
 //==============================================================================
 /**
@@ -17,6 +31,8 @@ class RiffusionVSTAudioProcessor : public juce::AudioProcessor
 #if JucePlugin_Enable_ARA
     , public juce::AudioProcessorARAExtension
 #endif
+    , private juce::Timer
+    , private MemoryBudget::Client
 {
 public:
     struct ProcessParams
@@ -29,6 +45,8 @@ public:
         float guidance;
         int seed;
         int numInferenceSteps;
+        // What was typed in the seed box, which seed is a hash of.
+        std::string seedText;
     };
 
     //==============================================================================
@@ -88,35 +106,194 @@ public:
     void startPlaying(PlayState playState);
     void stopPlaying();
     bool getIsGenerating() const { return isGenerating; }
+    // Between 0 and 1 while the server reports progress, negative when it doesn't.
+    double getGenerationProgress() const { return generationProgress; }
     // Start and stop the generation proccess.
     void startGenerating(const ProcessParams& params);
     void stopGenerating();
+    // The params to use when the processor starts a generation by itself, e.g. when a
+    // take finishes during an offline bounce. Saved with the plugin's state, so that
+    // still works when a project is reopened and bounced without opening the editor.
+    void setProcessParams(const ProcessParams& params);
+    // Returns false, and leaves params alone, if there haven't been any yet.
+    bool getProcessParams(ProcessParams* params);
 
-    // Message displayed in the bottom.
-    std::string message = "";
+    // Message displayed in the bottom. Any thread but the audio thread, which reports
+    // through setAudioStatus instead.
+    void setMessage(const juce::String& text);
+    // Message thread.
+    juce::String getMessage() const;
 
     const juce::AudioBuffer<float>* getRecordingBuffer() const { return &recordingBuffer; }
     const juce::AudioBuffer<float>* getGenerationBuffer() const { return &generationBuffer; }
     const int getCurrentSampleRate() const { return currentSampleRate; }
+    // Spectrograms of the audio going into the recording buffer and coming out of
+    // either buffer during playback. Columns are popped by the editor.
+    SpectrogramAnalyser& getRecordingSpectrogram() { return recordingSpectrogram; }
+    SpectrogramAnalyser& getGenerationSpectrogram() { return generationSpectrogram; }
+    // Timing of each stage of the generation lifecycle, shown in the editor's HUD.
+    PerformanceTracer& getTracer() { return *tracer; }
 
     // If true, any midi notes playing will be interpreted as starting and stopping recording.
     bool midiControlsRecording = false;
     // If true, any midi notes playing will be interpreted as starting and stopping playback.
     bool midiControlsPlayback = false;
+    // If true, a detected onset in the input starts recording, with the audio just
+    // before it already in the take.
+    bool onsetTriggersRecording = false;
+    // Turns the last few seconds of input into the recorded take, on the next block.
+    void grabLookback() { grabLookbackRequested = true; }
+    // Bumped every time a take is grabbed from the lookback, so the editor can refresh.
+    int getLookbackGrabCount() const { return lookbackGrabCount; }
     
+    // If true, server requests run in the separate RiffusionHelper process, so a
+    // hang or crash there can't take down the DAW. Shared by every instance.
+    void setUseHelperProcess(bool shouldUseHelper) { generationService->setUseHelperProcess(shouldUseHelper); }
+    bool getUseHelperProcess() const { return generationService->getUseHelperProcess(); }
+
+    // If true, as soon as a take is captured the current params and a few blend
+    // neighbours are queued at low priority, so "Generate New" is often answered
+    // from the cache. They're cancelled when a new take starts or the params change.
+    void setSpeculativeGeneration(bool shouldSpeculate);
+    bool getSpeculativeGeneration() const { return speculativeGeneration; }
+    // Hit and waste ratios of the speculative requests, for the editor's HUD.
+    juce::String getSpeculationSummary() const;
+
+    // What was trimmed off the last take that came back from the server, for the HUD.
+    juce::String getUploadSummary();
+
+    // Host automatable. Sweeps playback of the generated audio from the oldest take
+    // generated from the current recording (0) to the newest (1), blending between
+    // them locally. At 1, which is the default, the newest take plays as it is.
+    juce::RangedAudioParameter& getMorphParameter() { return *morphAmount; }
+    int getNumMorphTakes() const { return morph.getNumTakes(); }
+
+    // Every take the server has sent back, oldest first, with the params it was made
+    // with (see paramsToVar). Kept on disk, so the list survives reloading the project.
+    int getNumTakes() const { return takeHistory.getNumTakes(); }
+    TakeHistory::Info getTakeInfo(int index) const { return takeHistory.getInfo(index); }
+    int getSelectedTake() const { return takeHistory.getSelected(); }
+    // Message thread. Switches "Play Generated" over to another take, without a gap if
+    // it's already playing. Only the newest take can be morphed.
+    void selectTake(int index);
+    // Goes back to the take that was selected before this one, for A/B comparisons.
+    void selectPreviousTake() { selectTake(previousTake); }
+    // Message thread. The selected take, read from the store, or nullptr if there are none.
+    std::shared_ptr<const juce::AudioBuffer<float>> getSelectedTakeAudio() { return takeHistory.getAudio(getSelectedTake()); }
+
+    // The recording and generated buffers aren't allocated until something needs them, so an instance that's loaded but never used costs next to nothing.
+    // Message thread. Allocates them if that hasn't happened yet, reads back a
+    // generated take that was spilled to disk, and maps the take selected when the
+    // state was loaded. Called when the editor opens.
+    void ensureResident();
+    // What this instance holds, and how every instance stands against the budget, for
+    // the editor's HUD.
+    juce::String getMemorySummary();
+
     // If true, the plugin will wait for the DAW to start playing back audio to
     // start recording or play back generated audio.
     bool doesDAWControlTiming = false;
 
 private:
-    juce::URL buildURL(const ProcessParams& params) const;
-    bool getHttpRequest(const juce::URL& url, juce::String* content);
-    // If true, generation thread is running.
-    bool isGenerating = false;
-    // Background thread that handles the generation.
-    std::thread internetRequestThread;
-    // Mutex for the recording buffer overwritten by generation thread.
+    // Turns the params and the current recording into a request for the generation service.
+    // If region isn't null, it's set to the part of the recording that will be uploaded.
+    GenerationService::Request buildRequest(const ProcessParams& params, UploadPreprocessor::Region* region = nullptr) const;
+    // How much of the recording a take was generated from, the tempo it was recorded at,
+    // and where it started on the DAW's timeline in beats, or negative if unknown.
+    struct Recorded
+    {
+        int length = 0;
+        double tempo = 0.0;
+        double startBeats = -1.0;
+    };
+    // Sends a request to the generation service, with the result landing in generationBuffer
+    // at the place in the recording the uploaded region came from. takeParams and
+    // recorded are stored with the take in the history.
+    void submitGeneration(GenerationService::Request request, const UploadPreprocessor::Region& region,
+        const juce::var& takeParams, const Recorded& recorded);
+    // Picks up a server job started before the plugin was last saved, for a recording
+    // that was saved with it.
+    void resumeGeneration(const juce::String& serverAddress, const juce::String& jobId, int uploadStart,
+        const juce::var& takeParams, const Recorded& recorded);
+    // The params as stored in the take history and the plugin's state, and back.
+    static juce::var paramsToVar(const ProcessParams& params);
+    static ProcessParams varToParams(const juce::var& json);
+    std::atomic<double> generationProgress { -1.0 };
+    // The server job of the current generation, if the server has given it one.
+    // Guarded by internetRequestMutex.
+    juce::String pendingJobId;
+    juce::String pendingJobServer;
+    // The uploaded region of the pending generation, and of the last one to come back.
+    // Guarded by internetRequestMutex.
+    UploadPreprocessor::Region pendingUploadRegion;
+    UploadPreprocessor::Region lastUploadRegion;
+    // The params and recording of the pending generation, saved so a resumed job's take
+    // has them too. The recording itself is gone by then. Guarded by internetRequestMutex.
+    juce::var pendingTakeParams;
+    Recorded pendingRecorded;
+    // If true, a generation request is queued or running.
+    std::atomic<bool> isGenerating { false };
+    // Incremented for every generation started or stopped, so results that come back
+    // for a stale generation can be ignored.
+    std::atomic<int> latestGenerationId { 0 };
+    // Shared between every instance in the process. Declared before anything that
+    // might be holding spilled audio, so it's still there when that's freed.
+    juce::SharedResourcePointer<MemoryBudget> memoryBudget;
+    // Runs the requests. Shared between every instance in the process.
+    juce::SharedResourcePointer<GenerationService> generationService;
+    // Who we are to the generation service.
+    int generationClientId = 0;
+    // Mutex for the generation buffer overwritten by the generation service.
     std::mutex internetRequestMutex;
+    // A take that has come back from the server, handed over by the service's callback
+    // so the worker isn't held up by putting it in place.
+    struct CompletedGeneration
+    {
+        int generationId = 0;
+        std::shared_ptr<const juce::AudioBuffer<float>> audio;
+        UploadPreprocessor::Region region;
+        juce::var takeParams;
+        int recording = 0;
+        Recorded recorded;
+    };
+    // Guarded by internetRequestMutex.
+    std::unique_ptr<CompletedGeneration> completedGeneration;
+    // Not for the audio thread, unless it's rendering offline. Places the completed
+    // take, if there is one, in the generation buffer, the stretch, the morph and the
+    // history.
+    void installCompletedGeneration();
+    // Held while a take is being installed, from either thread that can do it.
+    juce::CriticalSection installLock;
+    // Signalled whenever a generation finishes, so an offline bounce can wait for it.
+    juce::WaitableEvent generationFinished;
+    // Last params set by the editor, and whether there have been any.
+    std::mutex processParamsMutex;
+    ProcessParams processParams;
+    bool hasProcessParams = false;
+    // When the host renders offline it waits for processBlock, so we can block on a
+    // pending generation (or time stretch) instead of rendering silence. Bounded in
+    // case the server never answers: maxOfflineWaitMs is the longest a bounce waits for
+    // any one generation in total, after which it carries on without it.
+    void waitForGenerationOffline();
+    const int maxOfflineWaitMs = 120000;
+    // Audio thread, offline. The generation being waited for, and when to give up on it.
+    int offlineWaitGenerationId = -1;
+    double offlineWaitDeadline = 0.0;
+    // Takes start and stop, and allocation and waking up are asked for, on the audio
+    // thread. It only sets a flag, which this polls on the message thread, where
+    // speculation is kicked off (or cancelled) and the buffers allocated. Posting a
+    // message from the audio thread would take a lock and allocate.
+    void timerCallback() override;
+    void startSpeculating();
+    std::atomic<bool> allocationRequested { false };
+    std::atomic<bool> wakeRequested { false };
+    std::atomic<bool> speculativeGeneration { false };
+    std::atomic<bool> speculationRequested { false };
+    std::atomic<bool> speculationCancelRequested { false };
+    // Blend neighbours either side of the current value to speculate on. The step
+    // matches the blend slider's interval, so the neighbours are values the user can pick.
+    const int numSpeculativeNeighbours = 1;
+    const double speculativeAlphaStep = 0.1;
     // If false, haven't even setup audio channels yet.
     bool hasAnyAudio = false;
     // Maintain sample rate. If the DAW messes with the sample rate,
@@ -125,24 +302,85 @@ private:
     double prevSampleRate = 44100;
     double currentSampleRate = 44100;
     const double outputSampleRate = 44100;
-    // Timeout to riffusion request.
-    const int timeoutRequestMs = 60000;
     // If true, we are recording live audio.
     bool isRecording = false;
     PlayState playState = PlayState::NotPlaying;
     double maxRecordingBufferLengthSeconds = 5.00;
     int maxRecordingBufferSize = 220500; // 5.00 seconds at 44100 hz.
+    // Not for the audio thread. Allocates the buffers, if nothing has yet.
+    void ensureBuffersAllocated();
+    // Allocates the buffers at maxRecordingBufferSize. Called with allocationLock held.
+    void allocateBuffers();
+    // What the audio thread last reported. Setting the message would allocate there,
+    // so it sets this instead and getMessage() spells it out. setMessage clears it.
+    enum class AudioStatus { None, Recording, StoppedRecording, StartedPlaying, StoppedPlaying, WaitingForDaw, Waiting, OnsetDetected };
+    std::atomic<AudioStatus> audioStatus { AudioStatus::None };
+    void setAudioStatus(AudioStatus status) { audioStatus = status; }
+    juce::String message;
+    mutable juce::CriticalSection messageLock;
+    // Guards the allocation, which can be asked for from the message thread, the
+    // generation service and prepareToPlay.
+    juce::CriticalSection allocationLock;
+    // Set once the buffers have been allocated. Until then, processBlock leaves them alone.
+    std::atomic<bool> buffersAllocated { false };
     // Single buffer of samples that we are recording to.
     juce::AudioBuffer<float> recordingBuffer;
+    // The last maxRecordingBufferSize samples of input, recording or not. Small enough
+    // to be allocated in prepareToPlay, so it's listening before anything else is.
+    LookbackBuffer lookback;
+    OnsetDetector onsetDetector;
+    // How much audio from before the onset goes into an onset-triggered take.
+    const double onsetPrerollSeconds = 0.25;
+    // Samples at the start of the take that were played before recording started.
+    int recordingPrerollSamples = 0;
+    std::atomic<bool> grabLookbackRequested { false };
+    std::atomic<int> lookbackGrabCount { 0 };
+    // What processBlock does after the transport and MIDI have been dealt with. It's a
+    // template specialised on the mode, the channel count and whether the DAW sets the
+    // position, picked from a table whenever one of those changes, so the steady state
+    // doesn't re-check them every block. PlaybackBenchmark measures the playback part
+    // of them against the way processBlock used to do it.
+    enum class BlockMode { Idle, Recording, PlayingRecorded, PlayingGenerated };
+    enum class SyncMode { Free, Daw };
+    using BlockKernel = void (RiffusionVSTAudioProcessor::*)(juce::AudioBuffer<float>&,
+        const juce::Optional<juce::AudioPlayHead::PositionInfo>&, int);
+    // numChannels is 1 or 2, or 0 for however many there are.
+    template <BlockMode mode, int numChannels, SyncMode sync>
+    void renderBlock(juce::AudioBuffer<float>& buffer, const juce::Optional<juce::AudioPlayHead::PositionInfo>& position,
+        int numInputChannels);
+    template <std::size_t... Indices>
+    static constexpr std::array<BlockKernel, sizeof...(Indices)> makeBlockKernels(std::index_sequence<Indices...>);
+    static BlockKernel getBlockKernel(BlockMode mode, int numInputChannels, bool dawSync);
+    BlockMode getBlockMode() const;
+    BlockKernel blockKernel = nullptr;
+    // Identifies the mode, layout and sync blockKernel was picked for.
+    int blockKernelKey = -1;
+    // Audio thread. Feeds the lookback and onset detector, and acts on either.
+    void processLookback(const juce::AudioBuffer<float>& input, const juce::Optional<juce::AudioPlayHead::PositionInfo>& position);
     // Single buffer of samples that was generated by riffusion.
     juce::AudioBuffer<float> generationBuffer;
-    // Buffer of data that the generated waveform is written to.
-    std::vector<uint8_t> wavWriteBuffer;
-    // A string containing base64 encoded ascii data of the wav file. It is literally
-    // the bytes of a wav file written in base 64 format.
-    juce::String base64Wav;
-    // Interface for reading and writing wav files.
-    std::unique_ptr<juce::WavAudioFormat> wavInterface;
+    // Held by whatever replaces or frees generationBuffer. The audio thread only tries
+    // it, and plays nothing if it can't get it.
+    juce::SpinLock generationLock;
+    // MemoryBudget::Client. A generated take nobody has played for a while can be
+    // written to the scratch file, and is read back when it's next needed.
+    size_t getMemoryUsage() override;
+    size_t getSpillableBytes() override;
+    juce::uint32 getLastUsedMs() override { return lastGenerationUseMs; }
+    bool isSpilled() override { return generationSpilled; }
+    void spill() override;
+    // Message thread. Reads the spilled take back.
+    void wakeFromSpill();
+    // Message thread, or the audio thread when rendering offline. Selects restoredTake,
+    // if there is one still waiting.
+    void selectRestoredTake();
+    // Guards spilledGeneration. Taken before generationLock.
+    juce::CriticalSection spillLock;
+    std::unique_ptr<MemoryBudget::SpilledBuffer> spilledGeneration;
+    std::atomic<bool> generationSpilled { false };
+    // Millisecond counter of the last time the generated take was played or replaced,
+    // or 0 if there hasn't been one.
+    std::atomic<juce::uint32> lastGenerationUseMs { 0 };
     // Sample where we are currently vomiting wav data into the buffer.
     int recordingStartPtr = 0;
     // Sample where we are currently outputting the audio data from the buffer.
@@ -153,6 +391,34 @@ private:
     double timecodeStartOfRecording = -1.0f;
     // If available, this is the BPM given by the DAW when we start recording.
     double bpmStartOfRecording = 0.0f;
+    // The recording the take in generationBuffer came from, which may not be the
+    // current one, or one from this session at all. Guarded by generationLock.
+    Recorded generatedFrom;
+    // Background thread doing the spectrogram FFTs, shared by every instance.
+    juce::SharedResourcePointer<SpectrogramAnalysisThread> spectrogramThread;
+    SpectrogramAnalyser recordingSpectrogram;
+    SpectrogramAnalyser generationSpectrogram;
+    // Conforms the generated take to the host tempo when the DAW controls timing.
+    TimeStretchEngine timeStretch;
+    // Every take ever generated, on disk, and which of them generationBuffer holds.
+    TakeHistory takeHistory;
+    std::atomic<int> liveTake { -1 };
+    std::atomic<int> previousTake { -1 };
+    // The take selected when the state was loaded. It's only selected (and mapped)
+    // once the instance is first used, and until then is what gets saved.
+    std::atomic<int> restoredTake { -1 };
+    // Every take generated from the current recording, for the morph to blend between.
+    MorphEngine morph;
+    juce::AudioParameterFloat* morphAmount = nullptr;
+    // Bumped for every new take recorded (or grabbed), so the morph can tell which
+    // generated takes belong together. morphRecordingCount is guarded by installLock.
+    std::atomic<int> recordingCount { 0 };
+    int morphRecordingCount = -1;
+    // How close the host tempo has to be to the recorded tempo to play the morph.
+    const double morphTempoTolerance = 0.01;
+    // Shared with the generation service, which may still be unwinding one of our
+    // requests after we're gone.
+    std::shared_ptr<PerformanceTracer> tracer { std::make_shared<PerformanceTracer>() };
 
     //==============================================================================
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (RiffusionVSTAudioProcessor)
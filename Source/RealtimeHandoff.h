@@ -0,0 +1,72 @@
+/*
+  ==============================================================================
+
+    RealtimeHandoff.h
+    Passes objects built on a background thread over to the audio thread.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+
+//==============================================================================
+/**
+    Hands ownership of objects from background threads to the audio thread without
+    the audio thread ever locking, allocating or freeing. The audio thread swaps in
+    the newest published object at the start of a block, and parks the one it was
+    using so a background thread can free it later.
+*/
+template <typename Object>
+class RealtimeHandoff
+{
+public:
+    RealtimeHandoff() = default;
+
+    ~RealtimeHandoff()
+    {
+        delete pending.exchange(nullptr);
+        delete retired.exchange(nullptr);
+        delete active;
+    }
+
+    // Background threads. Replaces anything published earlier that the audio thread
+    // hasn't picked up yet.
+    void publish(std::unique_ptr<Object> next)
+    {
+        collectGarbage();
+        delete pending.exchange(next.release());
+    }
+
+    // Background threads. Frees whatever the audio thread has stopped using.
+    void collectGarbage()
+    {
+        delete retired.exchange(nullptr);
+    }
+
+    // Audio thread only. Returns the newest object it is allowed to use, or nullptr
+    // if nothing has been published yet. The pointer stays valid until the next call.
+    Object* acquire()
+    {
+        // If the last retired object hasn't been freed yet there's nowhere to park
+        // the current one, so keep using it for another block.
+        if (retired.load() == nullptr) {
+            if (Object* next = pending.exchange(nullptr)) {
+                retired.store(active);
+                active = next;
+            }
+        }
+        return active;
+    }
+
+private:
+    std::atomic<Object*> pending { nullptr };
+    std::atomic<Object*> retired { nullptr };
+    // Only touched by the audio thread (and the destructor).
+    Object* active = nullptr;
+
+    RealtimeHandoff(const RealtimeHandoff&) = delete;
+    RealtimeHandoff& operator=(const RealtimeHandoff&) = delete;
+};
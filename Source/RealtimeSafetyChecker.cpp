@@ -0,0 +1,321 @@
+/*
+  ==============================================================================
+
+    RealtimeSafetyChecker.cpp
+    Catches allocations, locks and blocking calls made from the audio thread.
+
+  ==============================================================================
+*/
+
+#include "RealtimeSafetyChecker.h"
+
+#if RIFFUSION_RT_CHECKS
+
+#include <atomic>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+
+#if JUCE_LINUX
+ #include <dlfcn.h>
+ #include <poll.h>
+ #include <pthread.h>
+ #include <time.h>
+ #include <unistd.h>
+ // Thread locals in a dlopen'ed library are normally allocated on first use,
+ // through malloc, which would recurse straight back in here.
+ #define RIFFUSION_RT_THREAD_LOCAL __attribute__((tls_model("initial-exec"))) thread_local
+ // glibc's own allocator, underneath the malloc replaced below.
+ extern "C" void* __libc_malloc(std::size_t);
+ extern "C" void* __libc_calloc(std::size_t, std::size_t);
+ extern "C" void* __libc_realloc(void*, std::size_t);
+ extern "C" void __libc_free(void*);
+#else
+ #define RIFFUSION_RT_THREAD_LOCAL thread_local
+#endif
+
+namespace {
+    // Only the first few violations are logged with a stack trace, so a
+    // violation in every block doesn't drown everything else.
+    constexpr int kMaxLoggedViolations = 16;
+
+    RIFFUSION_RT_THREAD_LOCAL int realtimeDepth = 0;
+    // Set while a violation is being reported, which itself allocates and locks.
+    RIFFUSION_RT_THREAD_LOCAL bool isReporting = false;
+    std::atomic<int> numViolations { 0 };
+
+    const char* getKindName(RealtimeSafetyChecker::Kind kind) {
+        switch (kind) {
+            case RealtimeSafetyChecker::Kind::Allocation: return "allocation";
+            case RealtimeSafetyChecker::Kind::Deallocation: return "deallocation";
+            case RealtimeSafetyChecker::Kind::Lock: return "lock";
+            case RealtimeSafetyChecker::Kind::BlockingCall: return "blocking call";
+        }
+        return "";
+    }
+
+    std::mutex& getLastViolationLock() {
+        static std::mutex lock;
+        return lock;
+    }
+
+    juce::String& getLastViolation() {
+        static juce::String lastViolation;
+        return lastViolation;
+    }
+
+    void report(RealtimeSafetyChecker::Kind kind, const char* function) {
+        isReporting = true;
+        const int count = ++numViolations;
+        static const bool isFatal = juce::SystemStats::getEnvironmentVariable("RIFFUSION_RT_CHECKS_FATAL", {}).isNotEmpty();
+        // Scoped, so the strings are freed before the checks are back on.
+        {
+            juce::String description;
+            description << getKindName(kind) << " in " << function;
+            {
+                std::lock_guard<std::mutex> lock(getLastViolationLock());
+                getLastViolation() = description;
+            }
+            if (count <= kMaxLoggedViolations || isFatal) {
+                juce::Logger::outputDebugString("Real-time violation #" + juce::String(count) + ": " + description
+                    + " on the audio thread\n" + juce::SystemStats::getStackBacktrace());
+            }
+        }
+        if (isFatal) {
+            std::abort();
+        }
+        isReporting = false;
+    }
+
+    // Allocates without going through the checks again.
+    void* allocate(std::size_t size) {
+       #if JUCE_LINUX
+        return __libc_malloc(size == 0 ? 1 : size);
+       #else
+        return std::malloc(size == 0 ? 1 : size);
+       #endif
+    }
+
+    void deallocate(void* pointer) {
+       #if JUCE_LINUX
+        __libc_free(pointer);
+       #else
+        std::free(pointer);
+       #endif
+    }
+}  // namespace
+
+//==============================================================================
+RealtimeSafetyChecker::ScopedRealtime::ScopedRealtime(bool isRealtime) : isActive(isRealtime)
+{
+    if (isActive) {
+        ++realtimeDepth;
+    }
+}
+
+RealtimeSafetyChecker::ScopedRealtime::~ScopedRealtime()
+{
+    if (isActive) {
+        --realtimeDepth;
+    }
+}
+
+void RealtimeSafetyChecker::check(Kind kind, const char* function)
+{
+    if (realtimeDepth > 0 && !isReporting) {
+        report(kind, function);
+    }
+}
+
+int RealtimeSafetyChecker::getNumViolations()
+{
+    return numViolations;
+}
+
+juce::String RealtimeSafetyChecker::getSummary()
+{
+    juce::String text;
+    text << "rt checks: " << getNumViolations() << " violations\n";
+    std::lock_guard<std::mutex> lock(getLastViolationLock());
+    if (getLastViolation().isNotEmpty()) {
+        text << "  last: " << getLastViolation() << "\n";
+    }
+    return text;
+}
+
+//==============================================================================
+void* operator new(std::size_t size)
+{
+    RealtimeSafetyChecker::check(RealtimeSafetyChecker::Kind::Allocation, "operator new");
+    if (void* pointer = allocate(size)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+    RealtimeSafetyChecker::check(RealtimeSafetyChecker::Kind::Allocation, "operator new[]");
+    if (void* pointer = allocate(size)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    RealtimeSafetyChecker::check(RealtimeSafetyChecker::Kind::Allocation, "operator new");
+    return allocate(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    RealtimeSafetyChecker::check(RealtimeSafetyChecker::Kind::Allocation, "operator new[]");
+    return allocate(size);
+}
+
+void operator delete(void* pointer) noexcept
+{
+    if (pointer != nullptr) {
+        RealtimeSafetyChecker::check(RealtimeSafetyChecker::Kind::Deallocation, "operator delete");
+    }
+    deallocate(pointer);
+}
+
+void operator delete[](void* pointer) noexcept
+{
+    if (pointer != nullptr) {
+        RealtimeSafetyChecker::check(RealtimeSafetyChecker::Kind::Deallocation, "operator delete[]");
+    }
+    deallocate(pointer);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept
+{
+    operator delete(pointer);
+}
+
+void operator delete[](void* pointer, std::size_t) noexcept
+{
+    operator delete[](pointer);
+}
+
+//==============================================================================
+// A plugin is loaded with its symbols kept local, so its own calls only bind to
+// these if it's linked with -Wl,-Bsymbolic-functions. Without that, the host's
+// copies are called and only operator new and delete are checked.
+#if JUCE_LINUX
+namespace {
+    // Finds the function this one replaces. The cache is a plain atomic rather than
+    // a function static, whose initialisation guard could lock and recurse.
+    template <typename Function>
+    Function findNext(std::atomic<void*>& cache, const char* name) {
+        void* function = cache.load(std::memory_order_relaxed);
+        if (function == nullptr) {
+            function = dlsym(RTLD_NEXT, name);
+            cache.store(function, std::memory_order_relaxed);
+        }
+        return reinterpret_cast<Function>(function);
+    }
+}  // namespace
+
+extern "C" void* malloc(std::size_t size)
+{
+    RealtimeSafetyChecker::check(RealtimeSafetyChecker::Kind::Allocation, "malloc");
+    return allocate(size);
+}
+
+extern "C" void* calloc(std::size_t count, std::size_t size)
+{
+    RealtimeSafetyChecker::check(RealtimeSafetyChecker::Kind::Allocation, "calloc");
+    return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* pointer, std::size_t size)
+{
+    RealtimeSafetyChecker::check(RealtimeSafetyChecker::Kind::Allocation, "realloc");
+    return __libc_realloc(pointer, size);
+}
+
+extern "C" void free(void* pointer)
+{
+    if (pointer != nullptr) {
+        RealtimeSafetyChecker::check(RealtimeSafetyChecker::Kind::Deallocation, "free");
+    }
+    deallocate(pointer);
+}
+
+extern "C" int pthread_mutex_lock(pthread_mutex_t* mutex)
+{
+    static std::atomic<void*> next { nullptr };
+    RealtimeSafetyChecker::check(RealtimeSafetyChecker::Kind::Lock, "pthread_mutex_lock");
+    return findNext<int (*)(pthread_mutex_t*)>(next, "pthread_mutex_lock")(mutex);
+}
+
+extern "C" int pthread_cond_wait(pthread_cond_t* condition, pthread_mutex_t* mutex)
+{
+    static std::atomic<void*> next { nullptr };
+    RealtimeSafetyChecker::check(RealtimeSafetyChecker::Kind::BlockingCall, "pthread_cond_wait");
+    return findNext<int (*)(pthread_cond_t*, pthread_mutex_t*)>(next, "pthread_cond_wait")(condition, mutex);
+}
+
+extern "C" int pthread_cond_timedwait(pthread_cond_t* condition, pthread_mutex_t* mutex, const timespec* time)
+{
+    static std::atomic<void*> next { nullptr };
+    RealtimeSafetyChecker::check(RealtimeSafetyChecker::Kind::BlockingCall, "pthread_cond_timedwait");
+    return findNext<int (*)(pthread_cond_t*, pthread_mutex_t*, const timespec*)>(next, "pthread_cond_timedwait")(condition, mutex, time);
+}
+
+extern "C" int nanosleep(const timespec* duration, timespec* remaining)
+{
+    static std::atomic<void*> next { nullptr };
+    RealtimeSafetyChecker::check(RealtimeSafetyChecker::Kind::BlockingCall, "nanosleep");
+    return findNext<int (*)(const timespec*, timespec*)>(next, "nanosleep")(duration, remaining);
+}
+
+extern "C" int clock_nanosleep(clockid_t clock, int flags, const timespec* duration, timespec* remaining)
+{
+    static std::atomic<void*> next { nullptr };
+    RealtimeSafetyChecker::check(RealtimeSafetyChecker::Kind::BlockingCall, "clock_nanosleep");
+    return findNext<int (*)(clockid_t, int, const timespec*, timespec*)>(next, "clock_nanosleep")(clock, flags, duration, remaining);
+}
+
+extern "C" int usleep(useconds_t duration)
+{
+    static std::atomic<void*> next { nullptr };
+    RealtimeSafetyChecker::check(RealtimeSafetyChecker::Kind::BlockingCall, "usleep");
+    return findNext<int (*)(useconds_t)>(next, "usleep")(duration);
+}
+
+extern "C" ssize_t read(int file, void* data, std::size_t size)
+{
+    static std::atomic<void*> next { nullptr };
+    RealtimeSafetyChecker::check(RealtimeSafetyChecker::Kind::BlockingCall, "read");
+    return findNext<ssize_t (*)(int, void*, std::size_t)>(next, "read")(file, data, size);
+}
+
+extern "C" ssize_t write(int file, const void* data, std::size_t size)
+{
+    static std::atomic<void*> next { nullptr };
+    RealtimeSafetyChecker::check(RealtimeSafetyChecker::Kind::BlockingCall, "write");
+    return findNext<ssize_t (*)(int, const void*, std::size_t)>(next, "write")(file, data, size);
+}
+
+extern "C" int poll(pollfd* files, nfds_t numFiles, int timeoutMs)
+{
+    static std::atomic<void*> next { nullptr };
+    RealtimeSafetyChecker::check(RealtimeSafetyChecker::Kind::BlockingCall, "poll");
+    return findNext<int (*)(pollfd*, nfds_t, int)>(next, "poll")(files, numFiles, timeoutMs);
+}
+#endif
+
+#else
+
+//==============================================================================
+RealtimeSafetyChecker::ScopedRealtime::ScopedRealtime(bool) {}
+RealtimeSafetyChecker::ScopedRealtime::~ScopedRealtime() {}
+void RealtimeSafetyChecker::check(Kind, const char*) {}
+int RealtimeSafetyChecker::getNumViolations() { return 0; }
+juce::String RealtimeSafetyChecker::getSummary() { return {}; }
+
+#endif
@@ -0,0 +1,72 @@
+/*
+  ==============================================================================
+
+    RealtimeSafetyChecker.h
+    Catches allocations, locks and blocking calls made from the audio thread.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+
+// Set to 1 (the RTChecks configuration does) to build the plugin with the checker.
+// Otherwise everything here compiles down to nothing.
+#ifndef RIFFUSION_RT_CHECKS
+ #define RIFFUSION_RT_CHECKS 0
+#endif
+
+//==============================================================================
+/**
+    In a checker build, operator new and delete are replaced for the whole plugin,
+    and on Linux so are malloc and friends, pthread mutex locks and the common
+    blocking system calls. While a thread is inside a ScopedRealtime section, any
+    of those is a violation: it's counted, and the first few are logged with a
+    stack trace.
+
+    Only calls made by the plugin's own code are seen, not the host's (and on
+    Linux, only if the plugin is linked with -Wl,-Bsymbolic-functions). Reporting
+    allocates, which is fine for a diagnostic build but means a checker build
+    should never be shipped.
+
+    If the RIFFUSION_RT_CHECKS_FATAL environment variable is set, the first
+    violation aborts the process instead, so running the plugin through a
+    validator like pluginval fails on it.
+*/
+class RealtimeSafetyChecker
+{
+public:
+    enum class Kind
+    {
+        Allocation,
+        Deallocation,
+        Lock,
+        BlockingCall
+    };
+
+    // Marks the calling thread as real-time for as long as this exists. Pass false
+    // for code that is allowed to block, e.g. processBlock during an offline bounce.
+    class ScopedRealtime
+    {
+    public:
+        explicit ScopedRealtime(bool isRealtime = true);
+        ~ScopedRealtime();
+
+    private:
+       #if RIFFUSION_RT_CHECKS
+        bool isActive;
+       #endif
+
+        JUCE_DECLARE_NON_COPYABLE (ScopedRealtime)
+    };
+
+    // Called by the replaced functions. Records a violation if the calling thread
+    // is in a real-time section.
+    static void check(Kind kind, const char* function);
+
+    // Violations seen since the plugin was loaded, by every instance.
+    static int getNumViolations();
+    // A line or two for the editor's HUD. Empty unless this is a checker build.
+    static juce::String getSummary();
+};
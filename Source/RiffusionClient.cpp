@@ -0,0 +1,394 @@
+/*
+  ==============================================================================
+
+    RiffusionClient.cpp
+    Talks to the Riffusion server: WAV/base64 encoding, the requests and decoding.
+
+  ==============================================================================
+*/
+
+#include "RiffusionClient.h"
+
+namespace {
+    const juce::String kExtraHeaders = "Accept: application/json\r\n"
+                                       "Content-Type: application/json\r\n"
+                                       "Sec-Fetch-Mode: cors\r\n";
+    // Polls are tiny, so they get a much shorter timeout than the blocking POST.
+    constexpr int kPollTimeoutMs = 10000;
+    constexpr int kPollIntervalMs = 500;
+    // Give up on a job after this many polls in a row get no answer.
+    constexpr int kMaxFailedPolls = 10;
+    // Give up on a job that's still queued or running after this long, however well
+    // the polls are going, so nothing waiting on it waits forever.
+    constexpr juce::uint32 kMaxJobWaitMs = 30 * 60 * 1000;
+    // A server found without /jobs/ is asked again after this long, in case it's been
+    // upgraded in the meantime.
+    constexpr juce::uint32 kJobsRecheckMs = 10 * 60 * 1000;
+
+    bool isNotFound(int statusCode) {
+        return statusCode == 404 || statusCode == 405;
+    }
+
+    // Requests run without a token can't be cancelled.
+    bool isCancelled(CancellationToken* token) {
+        return token != nullptr && token->isCancelled();
+    }
+
+    // Sleeps for timeoutMs unless cancelled first. Returns true if cancelled.
+    bool waitForCancel(CancellationToken* token, int timeoutMs) {
+        if (token == nullptr) {
+            juce::Thread::sleep(timeoutMs);
+            return false;
+        }
+        return token->waitForCancel(timeoutMs);
+    }
+}  // namespace
+
+//==============================================================================
+bool RiffusionClient::generate(const juce::String& serverAddress, const juce::var& params,
+    const juce::AudioBuffer<float>& audio, double sampleRate,
+    std::shared_ptr<juce::AudioBuffer<float>>* result, juce::String* message,
+    PerformanceTracer& tracer, const ProgressCallback& onProgress, const juce::String& resumeJobId,
+    CancellationToken* token)
+{
+    juce::String response;
+    if (resumeJobId.isNotEmpty()) {
+        if (!waitForJob(serverAddress, resumeJobId, &response, onProgress, tracer, token)) {
+            *message = response;
+            return false;
+        }
+        return decodeResponse(response, result, message, tracer);
+    }
+
+    juce::String base64Wav;
+    if (!encodeAudio(audio, sampleRate, &base64Wav, tracer)) {
+        *message = "Failed to encode recording.";
+        return false;
+    }
+    if (isCancelled(token)) {
+        *message = "Cancelled.";
+        return false;
+    }
+    if (mayHaveJobs(serverAddress)) {
+        juce::URL jobURL;
+        {
+            PerformanceTracer::ScopedSpan span(tracer, "buildURL");
+            jobURL = buildURL(serverAddress, params, base64Wav, "/jobs/");
+        }
+        juce::String jobId;
+        bool serverHasJobs = true;
+        if (submitJob(jobURL, &jobId, &serverHasJobs, message, tracer, token)) {
+            if (onProgress) {
+                onProgress(jobId, JobStatus());
+            }
+            if (!waitForJob(serverAddress, jobId, &response, onProgress, tracer, token)) {
+                *message = response;
+                return false;
+            }
+            return decodeResponse(response, result, message, tracer);
+        }
+        if (serverHasJobs) {
+            return false;
+        }
+        rememberHasNoJobs(serverAddress);
+    }
+
+    // Older servers only have the blocking endpoint.
+    juce::URL url;
+    {
+        PerformanceTracer::ScopedSpan span(tracer, "buildURL");
+        url = buildURL(serverAddress, params, base64Wav);
+    }
+    if (!getHttpRequest(url, &response, tracer, token)) {
+        *message = response;
+        return false;
+    }
+    return decodeResponse(response, result, message, tracer);
+}
+
+bool RiffusionClient::mayHaveJobs(const juce::String& serverAddress) const
+{
+    const juce::ScopedLock scopedLock(serversWithoutJobsLock);
+    auto it = serversWithoutJobs.find(serverAddress);
+    return it == serversWithoutJobs.end() || juce::Time::getMillisecondCounter() - it->second > kJobsRecheckMs;
+}
+
+void RiffusionClient::rememberHasNoJobs(const juce::String& serverAddress)
+{
+    const juce::ScopedLock scopedLock(serversWithoutJobsLock);
+    serversWithoutJobs[serverAddress] = juce::Time::getMillisecondCounter();
+}
+
+bool RiffusionClient::encodeAudio(const juce::AudioBuffer<float>& audio, double sampleRate, juce::String* base64Wav, PerformanceTracer& tracer)
+{
+    PerformanceTracer::ScopedSpan span(tracer, "encodeRecording");
+    juce::MemoryOutputStream* memStream = new juce::MemoryOutputStream(audio.getNumSamples() * sizeof(juce::int16));
+    std::unique_ptr<juce::AudioFormatWriter> writer(wavFormat.createWriterFor(memStream, sampleRate, 1, 16, juce::StringPairArray(), 0));
+    if (!writer) {
+        delete memStream;
+        return false;
+    }
+    writer->writeFromAudioSampleBuffer(audio, 0, audio.getNumSamples());
+    writer->flush();
+    *base64Wav = juce::Base64::toBase64(memStream->getData(), memStream->getDataSize());
+    return true;
+}
+
+juce::URL RiffusionClient::buildURL(const juce::String& serverAddress, const juce::var& params, const juce::String& base64Wav,
+    const juce::String& endpoint) const
+{
+    juce::URL url(serverAddress);
+    url = url.getChildURL(endpoint);
+    // Copy the params so the caller's object isn't modified.
+    juce::DynamicObject::Ptr jsonObject = new juce::DynamicObject();
+    if (auto* paramsObject = params.getDynamicObject()) {
+        for (const auto& property : paramsObject->getProperties()) {
+            jsonObject->setProperty(property.name, property.value);
+        }
+    }
+    // The wav file bytes are literally just dumped into the POST data as a base64 string.
+    jsonObject->setProperty("audio", juce::var(base64Wav));
+    return url.withPOSTData(juce::JSON::toString(juce::var(jsonObject.get()), true, 3));
+}
+
+bool RiffusionClient::getHttpRequest(const juce::URL& url, juce::String* content, PerformanceTracer& tracer,
+    CancellationToken* token) {
+    // Does the entire HTTP POST request to the server. Returns the content as a string.
+    // The upload progress callback lets us split the time spent inside connect():
+    // the first callback means we're connected, the last one means the POST body is sent,
+    // and whatever is left until it returns is the server working on the request.
+    struct UploadListener : public juce::WebInputStream::Listener
+    {
+        UploadListener(PerformanceTracer& t, CancellationToken* c) : tracer(t), token(c) {}
+        bool postDataSendProgress(juce::WebInputStream&, int bytesSent, int totalBytes) override
+        {
+            double now = tracer.nowUs();
+            if (connectedUs < 0.0) {
+                connectedUs = now;
+            }
+            if (bytesSent >= totalBytes) {
+                sentUs = now;
+            }
+            // Returning false abandons the upload.
+            return !isCancelled(token);
+        }
+        PerformanceTracer& tracer;
+        CancellationToken* token;
+        double connectedUs = -1.0;
+        double sentUs = -1.0;
+    };
+    UploadListener listener(tracer, token);
+    const double startUs = tracer.nowUs();
+    juce::WebInputStream stream(url, true);
+    CancellationToken::ScopedStream registration(token, stream);
+    const bool connected = connect(stream, timeoutRequestMs, &listener);
+    const int statusCode = stream.getStatusCode();
+    const double respondedUs = tracer.nowUs();
+    if (listener.connectedUs < 0.0) {
+        listener.connectedUs = respondedUs;
+    }
+    if (listener.sentUs < 0.0) {
+        listener.sentUs = listener.connectedUs;
+    }
+    tracer.addSpan("connect", startUs, listener.connectedUs - startUs);
+    tracer.addSpan("send", listener.connectedUs, listener.sentUs - listener.connectedUs);
+    tracer.addSpan("wait", listener.sentUs, respondedUs - listener.sentUs);
+    if (isCancelled(token)) {
+        *content = "Cancelled.";
+        return false;
+    }
+    if (connected && statusCode < 400) {
+        PerformanceTracer::ScopedSpan span(tracer, "receive");
+        *content = stream.readEntireStreamAsString();
+        if (isCancelled(token)) {
+            *content = "Cancelled.";
+            return false;
+        }
+        return true;
+    }
+
+    if (statusCode != 0) {
+        *content = "Failed to connect, status code = " + juce::String(statusCode);
+        return false;
+    }
+
+    *content = "Failed to connect!";
+    return false;
+}
+
+bool RiffusionClient::submitJob(const juce::URL& url, juce::String* jobId, bool* serverHasJobs, juce::String* message,
+    PerformanceTracer& tracer, CancellationToken* token)
+{
+    PerformanceTracer::ScopedSpan span(tracer, "submitJob");
+    juce::String content;
+    int statusCode = 0;
+    const bool success = fetch(url, timeoutRequestMs, &content, &statusCode, token);
+    *serverHasJobs = !isNotFound(statusCode);
+    if (!*serverHasJobs) {
+        return false;
+    }
+    if (isCancelled(token)) {
+        *message = "Cancelled.";
+        return false;
+    }
+    if (!success) {
+        *message = statusCode != 0 ? "Failed to submit job, status code = " + juce::String(statusCode)
+                                   : juce::String("Failed to connect!");
+        return false;
+    }
+    *jobId = juce::JSON::parse(content)["job_id"].toString();
+    if (jobId->isEmpty()) {
+        *message = "Server didn't return a job ID.";
+        return false;
+    }
+    return true;
+}
+
+bool RiffusionClient::pollJob(const juce::String& serverAddress, const juce::String& jobId, JobStatus* status,
+    int* statusCode, CancellationToken* token)
+{
+    juce::String content;
+    if (!fetch(juce::URL(serverAddress).getChildURL("/jobs/" + jobId), kPollTimeoutMs, &content, statusCode, token)) {
+        return false;
+    }
+    juce::var json = juce::JSON::parse(content);
+    if (!json.isObject()) {
+        return false;
+    }
+    const juce::String state = json["status"].toString();
+    if (state == "done") {
+        status->state = JobStatus::State::Done;
+    }
+    else if (state == "failed") {
+        status->state = JobStatus::State::Failed;
+    }
+    else if (state == "running") {
+        status->state = JobStatus::State::Running;
+    }
+    else {
+        status->state = JobStatus::State::Queued;
+    }
+    status->step = static_cast<int>(json["step"]);
+    status->numSteps = static_cast<int>(json["num_steps"]);
+    status->error = json["error"].toString();
+    return true;
+}
+
+bool RiffusionClient::waitForJob(const juce::String& serverAddress, const juce::String& jobId, juce::String* response,
+    const ProgressCallback& onProgress, PerformanceTracer& tracer, CancellationToken* token)
+{
+    {
+        PerformanceTracer::ScopedSpan span(tracer, "waitForJob");
+        int numFailedPolls = 0;
+        const juce::uint32 startMs = juce::Time::getMillisecondCounter();
+        while (true) {
+            if (juce::Time::getMillisecondCounter() - startMs > kMaxJobWaitMs) {
+                *response = "Gave up on the job after " + juce::String(kMaxJobWaitMs / 60000) + " minutes.";
+                return false;
+            }
+            JobStatus status;
+            int statusCode = 0;
+            if (!pollJob(serverAddress, jobId, &status, &statusCode, token)) {
+                if (isCancelled(token)) {
+                    *response = "Cancelled.";
+                    return false;
+                }
+                // A 404 won't fix itself, a dropped poll might.
+                if (isNotFound(statusCode)) {
+                    *response = "The server doesn't know this job any more.";
+                    return false;
+                }
+                if (++numFailedPolls >= kMaxFailedPolls) {
+                    *response = "Lost contact with the server, status code = " + juce::String(statusCode);
+                    return false;
+                }
+            }
+            else {
+                numFailedPolls = 0;
+                if (onProgress) {
+                    onProgress(jobId, status);
+                }
+                if (status.state == JobStatus::State::Failed) {
+                    *response = status.error.isNotEmpty() ? status.error : juce::String("Generation failed on the server.");
+                    return false;
+                }
+                if (status.state == JobStatus::State::Done) {
+                    break;
+                }
+            }
+            if (waitForCancel(token, kPollIntervalMs)) {
+                *response = "Cancelled.";
+                return false;
+            }
+        }
+    }
+    PerformanceTracer::ScopedSpan span(tracer, "fetchResult");
+    int statusCode = 0;
+    if (!fetch(juce::URL(serverAddress).getChildURL("/jobs/" + jobId + "/result"), timeoutRequestMs, response,
+        &statusCode, token)) {
+        *response = isCancelled(token) ? juce::String("Cancelled.")
+                                       : "Failed to fetch result, status code = " + juce::String(statusCode);
+        return false;
+    }
+    return true;
+}
+
+bool RiffusionClient::connect(juce::WebInputStream& stream, int timeoutMs, juce::WebInputStream::Listener* listener)
+{
+    stream.withExtraHeaders(kExtraHeaders)
+        .withConnectionTimeout(timeoutMs)
+        .withNumRedirectsToFollow(32);
+    return stream.connect(listener);
+}
+
+bool RiffusionClient::fetch(const juce::URL& url, int timeoutMs, juce::String* content, int* statusCode,
+    CancellationToken* token)
+{
+    // POST if there's a body, otherwise GET.
+    juce::WebInputStream stream(url, url.getPostData().isNotEmpty());
+    CancellationToken::ScopedStream registration(token, stream);
+    const bool connected = connect(stream, timeoutMs, nullptr);
+    *statusCode = stream.getStatusCode();
+    if (!connected || *statusCode >= 400 || isCancelled(token)) {
+        return false;
+    }
+    *content = stream.readEntireStreamAsString();
+    return !isCancelled(token);
+}
+
+bool RiffusionClient::decodeResponse(const juce::String& response, std::shared_ptr<juce::AudioBuffer<float>>* result,
+    juce::String* message, PerformanceTracer& tracer)
+{
+    // Parse JSON from the server.
+    juce::var jsonObject;
+    {
+        PerformanceTracer::ScopedSpan span(tracer, "parseJson");
+        jsonObject = juce::JSON::parse(response);
+    }
+    if (!jsonObject.hasProperty("audio") || !jsonObject["audio"].isString()) {
+        *message = "Server response had no audio.";
+        return false;
+    }
+    // Try to convert the payload into actual data we can read. This is a .wav file.
+    juce::MemoryOutputStream wavBytes;
+    {
+        PerformanceTracer::ScopedSpan span(tracer, "decodeBase64");
+        if (!juce::Base64::convertFromBase64(wavBytes, jsonObject["audio"].toString())) {
+            *message = "Failed to convert audio data.";
+            return false;
+        }
+    }
+    PerformanceTracer::ScopedSpan span(tracer, "readWav");
+    // Create a virtual wave file file handle and try to read it.
+    std::unique_ptr<juce::AudioFormatReader> reader(wavFormat.createReaderFor(
+        new juce::MemoryInputStream(wavBytes.getData(), wavBytes.getDataSize(), false), true));
+    if (!reader) {
+        *message = "Failed to read memory for WAV file.";
+        return false;
+    }
+    const int numSamples = static_cast<int>(reader->lengthInSamples);
+    *result = std::make_shared<juce::AudioBuffer<float>>(1, numSamples);
+    reader->read(result->get(), 0, numSamples, 0, true, false);
+    *message = "Done Generating";
+    return true;
+}
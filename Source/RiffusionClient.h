@@ -0,0 +1,111 @@
+/*
+  ==============================================================================
+
+    RiffusionClient.h
+    Talks to the Riffusion server: WAV/base64 encoding, the requests and decoding.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "CancellationToken.h"
+#include "PerformanceTracer.h"
+
+#include <functional>
+#include <map>
+#include <memory>
+
+//==============================================================================
+/**
+    Everything needed to turn a recording into generated audio on a Riffusion
+    server. Used by the GenerationService when running in-process, and by the
+    RiffusionHelper executable when requests are isolated in a separate process.
+    Holds no per-request state, so one instance can serve several threads.
+
+    Servers that support it are driven through a job protocol, so no connection
+    has to stay open for the whole inference:
+        POST /jobs/                 same body as /run_vst/, returns { "job_id" }
+        GET  /jobs/<id>             returns { "status", "step", "num_steps", "error" }
+                                    where status is queued, running, done or failed
+        GET  /jobs/<id>/result      same response as /run_vst/
+    If the server doesn't know /jobs/, the single blocking POST to /run_vst/ is used,
+    and the server is remembered for a while so the next requests go straight there
+    rather than uploading everything twice.
+*/
+class RiffusionClient
+{
+public:
+    struct JobStatus
+    {
+        enum class State
+        {
+            Queued,
+            Running,
+            Done,
+            Failed
+        };
+        State state = State::Queued;
+        // Inference steps done so far and in total, or 0 if the server didn't say.
+        int step = 0;
+        int numSteps = 0;
+        juce::String error;
+    };
+    // Called on the requesting thread when a job is submitted and after every poll.
+    using ProgressCallback = std::function<void(const juce::String& jobId, const JobStatus& status)>;
+
+    RiffusionClient() = default;
+
+    // Runs one whole request. On success result holds the generated mono audio,
+    // otherwise message says what went wrong. If resumeJobId is set, the audio and
+    // params are ignored and that job (submitted earlier, maybe by another session)
+    // is waited for instead. Cancelling the token aborts the request wherever it is,
+    // including a connection blocked waiting on the server.
+    bool generate(const juce::String& serverAddress, const juce::var& params,
+        const juce::AudioBuffer<float>& audio, double sampleRate,
+        std::shared_ptr<juce::AudioBuffer<float>>* result, juce::String* message,
+        PerformanceTracer& tracer, const ProgressCallback& onProgress = nullptr,
+        const juce::String& resumeJobId = {}, CancellationToken* token = nullptr);
+
+    // The individual steps of generate().
+    bool encodeAudio(const juce::AudioBuffer<float>& audio, double sampleRate, juce::String* base64Wav, PerformanceTracer& tracer);
+    juce::URL buildURL(const juce::String& serverAddress, const juce::var& params, const juce::String& base64Wav,
+        const juce::String& endpoint = "/run_vst/") const;
+    bool getHttpRequest(const juce::URL& url, juce::String* content, PerformanceTracer& tracer,
+        CancellationToken* token = nullptr);
+    // serverHasJobs is set to false if the server doesn't support the job protocol.
+    bool submitJob(const juce::URL& url, juce::String* jobId, bool* serverHasJobs, juce::String* message,
+        PerformanceTracer& tracer, CancellationToken* token = nullptr);
+    // statusCode is 0 if there was no response at all.
+    bool pollJob(const juce::String& serverAddress, const juce::String& jobId, JobStatus* status, int* statusCode,
+        CancellationToken* token = nullptr);
+    // Polls until the job is done or failed, then downloads the response. Gives up if
+    // the job still hasn't finished after half an hour.
+    bool waitForJob(const juce::String& serverAddress, const juce::String& jobId, juce::String* response,
+        const ProgressCallback& onProgress, PerformanceTracer& tracer, CancellationToken* token = nullptr);
+    bool decodeResponse(const juce::String& response, std::shared_ptr<juce::AudioBuffer<float>>* result,
+        juce::String* message, PerformanceTracer& tracer);
+
+private:
+    // Sets the headers and timeout every request uses, then connects.
+    static bool connect(juce::WebInputStream& stream, int timeoutMs, juce::WebInputStream::Listener* listener);
+    // One whole request, POST if the URL has POST data. Fails on any HTTP error;
+    // statusCode is 0 if there was no response at all.
+    static bool fetch(const juce::URL& url, int timeoutMs, juce::String* content, int* statusCode,
+        CancellationToken* token);
+
+    // False if the server answered /jobs/ with not found recently.
+    bool mayHaveJobs(const juce::String& serverAddress) const;
+    void rememberHasNoJobs(const juce::String& serverAddress);
+
+    // Servers without /jobs/, and the millisecond counter when that was found out.
+    mutable juce::CriticalSection serversWithoutJobsLock;
+    std::map<juce::String, juce::uint32> serversWithoutJobs;
+    // Interface for reading and writing wav files.
+    juce::WavAudioFormat wavFormat;
+    // Timeout to riffusion request.
+    const int timeoutRequestMs = 60000;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (RiffusionClient)
+};
@@ -0,0 +1,66 @@
+/*
+  ==============================================================================
+
+    SharedAudioRing.cpp
+    Memory mapped sample ring shared between the plugin and the helper process.
+
+  ==============================================================================
+*/
+
+#include "SharedAudioRing.h"
+
+//==============================================================================
+SharedAudioRing::SharedAudioRing(const juce::File& f, int c, bool createFile)
+    : file(f), capacity(c), ownsFile(createFile)
+{
+    if (createFile) {
+        file.deleteFile();
+        // Seek to the end and write one byte, so the file has its full size without
+        // writing (or, on most file systems, even allocating) all of it.
+        juce::FileOutputStream out(file);
+        if (out.failedToOpen() || !out.setPosition(getFileSize(capacity) - 1)) {
+            return;
+        }
+        out.writeByte(0);
+        out.flush();
+    }
+    if (file.getSize() < getFileSize(capacity)) {
+        return;
+    }
+    mappedFile = std::make_unique<juce::MemoryMappedFile>(file, juce::MemoryMappedFile::readWrite, false);
+}
+
+SharedAudioRing::~SharedAudioRing()
+{
+    mappedFile.reset();
+    if (ownsFile) {
+        file.deleteFile();
+    }
+}
+
+int SharedAudioRing::allocate(Direction direction, int numSamples)
+{
+    if (numSamples <= 0 || numSamples > capacity) {
+        return -1;
+    }
+    const juce::ScopedLock scopedLock(lock);
+    int& cursor = writeCursors[static_cast<int>(direction)];
+    if (cursor + numSamples > capacity) {
+        cursor = 0;
+    }
+    int offset = cursor;
+    cursor += numSamples;
+    return offset;
+}
+
+float* SharedAudioRing::getSamples(Direction direction, int offset)
+{
+    jassert(isValid() && offset >= 0 && offset < capacity);
+    float* base = static_cast<float*>(mappedFile->getData());
+    return base + static_cast<size_t>(direction) * capacity + offset;
+}
+
+juce::int64 SharedAudioRing::getFileSize(int capacity)
+{
+    return 2 * static_cast<juce::int64>(capacity) * sizeof(float);
+}
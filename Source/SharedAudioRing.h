@@ -0,0 +1,64 @@
+/*
+  ==============================================================================
+
+    SharedAudioRing.h
+    Memory mapped sample ring shared between the plugin and the helper process.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+
+#include <memory>
+
+//==============================================================================
+/**
+    A file mapped into both the plugin and the RiffusionHelper process, split into
+    two rings of float samples: one the plugin writes recordings into, and one the
+    helper writes generated audio into. Each ring only ever has one writer, and the
+    control channel says where in the ring each take lives, so no samples ever get
+    copied through the pipe.
+
+    Space is handed out round the ring, so a take stays valid until enough newer
+    takes have been written to wrap around onto it. With a capacity of many takes
+    and only a couple of requests in flight at once, that never happens.
+*/
+class SharedAudioRing
+{
+public:
+    enum class Direction
+    {
+        ToHelper = 0, // Recordings, written by the plugin.
+        FromHelper = 1 // Generated audio, written by the helper.
+    };
+
+    // Creates the backing file (the plugin does this) or maps an existing one
+    // (the helper). capacity is the number of samples in each direction.
+    SharedAudioRing(const juce::File& file, int capacity, bool createFile);
+    ~SharedAudioRing();
+
+    bool isValid() const { return mappedFile != nullptr && mappedFile->getData() != nullptr; }
+    const juce::File& getFile() const { return file; }
+    int getCapacity() const { return capacity; }
+
+    // Reserves room for numSamples in the given direction. Returns the offset to
+    // write at, or -1 if it can never fit.
+    int allocate(Direction direction, int numSamples);
+    float* getSamples(Direction direction, int offset);
+
+    // Bytes needed to back a ring of the given capacity.
+    static juce::int64 getFileSize(int capacity);
+
+private:
+    juce::File file;
+    const int capacity;
+    const bool ownsFile;
+    std::unique_ptr<juce::MemoryMappedFile> mappedFile;
+    juce::CriticalSection lock;
+    // Next free sample in each direction.
+    int writeCursors[2] = { 0, 0 };
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (SharedAudioRing)
+};
@@ -0,0 +1,155 @@
+/*
+  ==============================================================================
+
+    SpectrogramAnalyser.cpp
+    Background FFT analysis that feeds the scrolling spectrogram views.
+
+  ==============================================================================
+*/
+
+#include "SpectrogramAnalyser.h"
+
+namespace {
+    // About a second and a half of audio at 44100 hz.
+    constexpr int kSampleFifoSize = 1 << 16;
+    constexpr int kColumnFifoSize = 256;
+    // Work done by the shared thread per tick, across all instances.
+    constexpr int kColumnsPerTick = 32;
+    constexpr int kTickMs = 20;
+    // Range of levels that gets mapped onto the colour scale.
+    constexpr float kMinDecibels = -100.0f;
+    constexpr float kMaxDecibels = 0.0f;
+}  // namespace
+
+//==============================================================================
+SpectrogramAnalyser::SpectrogramAnalyser()
+    : fft(fftOrder),
+      window(fftSize, juce::dsp::WindowingFunction<float>::hann, false),
+      sampleFifo(kSampleFifoSize),
+      sampleStorage(kSampleFifoSize, 0.0f),
+      columnFifo(kColumnFifoSize),
+      columnStorage(kColumnFifoSize * numBands, 0.0f),
+      frame(fftSize, 0.0f),
+      fftData(2 * fftSize, 0.0f)
+{
+    // Log spaced bands between the first bin and nyquist. Low bands are forced to be
+    // at least one bin wide, the exponential catches up with that further up.
+    constexpr int numBins = fftSize / 2;
+    bandEdges[0] = 1;
+    for (int band = 1; band <= numBands; ++band) {
+        int edge = static_cast<int>(std::pow(static_cast<double>(numBins), static_cast<double>(band) / numBands));
+        bandEdges[band] = juce::jlimit(bandEdges[band - 1] + 1, numBins, edge);
+    }
+    bandEdges[numBands] = numBins;
+}
+
+void SpectrogramAnalyser::pushSamples(const float* samples, int numSamples)
+{
+    int start1, size1, start2, size2;
+    sampleFifo.prepareToWrite(numSamples, start1, size1, start2, size2);
+    if (size1 > 0) {
+        std::copy(samples, samples + size1, sampleStorage.begin() + start1);
+    }
+    if (size2 > 0) {
+        std::copy(samples + size1, samples + size1 + size2, sampleStorage.begin() + start2);
+    }
+    sampleFifo.finishedWrite(size1 + size2);
+}
+
+int SpectrogramAnalyser::analysePending(int maxColumns)
+{
+    int numColumns = 0;
+    while (numColumns < maxColumns && sampleFifo.getNumReady() >= hopSize) {
+        // Slide the frame along by one hop and fill the end with fresh samples.
+        std::copy(frame.begin() + hopSize, frame.end(), frame.begin());
+        int start1, size1, start2, size2;
+        sampleFifo.prepareToRead(hopSize, start1, size1, start2, size2);
+        float* dest = frame.data() + fftSize - hopSize;
+        std::copy(sampleStorage.begin() + start1, sampleStorage.begin() + start1 + size1, dest);
+        std::copy(sampleStorage.begin() + start2, sampleStorage.begin() + start2 + size2, dest + size1);
+        sampleFifo.finishedRead(size1 + size2);
+
+        std::copy(frame.begin(), frame.end(), fftData.begin());
+        window.multiplyWithWindowingTable(fftData.data(), fftSize);
+        fft.performFrequencyOnlyForwardTransform(fftData.data(), true);
+
+        // If nobody is drawing (e.g. the editor is closed), just drop the column.
+        if (columnFifo.getFreeSpace() < 1) {
+            ++numColumns;
+            continue;
+        }
+        columnFifo.prepareToWrite(1, start1, size1, start2, size2);
+        float* column = columnStorage.data() + start1 * numBands;
+        for (int band = 0; band < numBands; ++band) {
+            float peak = 0.0f;
+            for (int bin = bandEdges[band]; bin < bandEdges[band + 1]; ++bin) {
+                peak = std::max(peak, fftData[bin]);
+            }
+            float db = juce::Decibels::gainToDecibels(peak / (fftSize / 2), kMinDecibels);
+            column[band] = juce::jmap(juce::jlimit(kMinDecibels, kMaxDecibels, db), kMinDecibels, kMaxDecibels, 0.0f, 1.0f);
+        }
+        columnFifo.finishedWrite(1);
+        ++numColumns;
+    }
+    return numColumns;
+}
+
+bool SpectrogramAnalyser::popColumn(float* dest)
+{
+    if (columnFifo.getNumReady() < 1) {
+        return false;
+    }
+    int start1, size1, start2, size2;
+    columnFifo.prepareToRead(1, start1, size1, start2, size2);
+    const float* column = columnStorage.data() + start1 * numBands;
+    std::copy(column, column + numBands, dest);
+    columnFifo.finishedRead(1);
+    return true;
+}
+
+//==============================================================================
+SpectrogramAnalysisThread::SpectrogramAnalysisThread() : juce::Thread("Riffusion Spectrogram")
+{
+    startThread();
+}
+
+SpectrogramAnalysisThread::~SpectrogramAnalysisThread()
+{
+    stopThread(1000);
+}
+
+void SpectrogramAnalysisThread::addAnalyser(SpectrogramAnalyser* analyser)
+{
+    const juce::ScopedLock scopedLock(lock);
+    analysers.addIfNotAlreadyThere(analyser);
+}
+
+void SpectrogramAnalysisThread::removeAnalyser(SpectrogramAnalyser* analyser)
+{
+    const juce::ScopedLock scopedLock(lock);
+    analysers.removeFirstMatchingValue(analyser);
+}
+
+void SpectrogramAnalysisThread::run()
+{
+    while (!threadShouldExit()) {
+        {
+            const juce::ScopedLock scopedLock(lock);
+            int budget = kColumnsPerTick;
+            // Hand out one column at a time round-robin until the budget is spent
+            // or nobody has anything left to analyse.
+            bool anyWork = true;
+            while (budget > 0 && anyWork && !analysers.isEmpty()) {
+                anyWork = false;
+                for (int i = 0; i < analysers.size() && budget > 0; ++i) {
+                    nextAnalyser = (nextAnalyser + 1) % analysers.size();
+                    if (analysers[nextAnalyser]->analysePending(1) > 0) {
+                        anyWork = true;
+                        --budget;
+                    }
+                }
+            }
+        }
+        wait(kTickMs);
+    }
+}
@@ -0,0 +1,91 @@
+/*
+  ==============================================================================
+
+    SpectrogramAnalyser.h
+    Background FFT analysis that feeds the scrolling spectrogram views.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+
+#include <array>
+#include <vector>
+
+//==============================================================================
+/**
+    Turns a stream of samples pushed from the audio thread into spectrogram columns
+    that the editor can draw. The audio thread only ever touches a lock-free FIFO;
+    the FFTs run on the shared SpectrogramAnalysisThread.
+*/
+class SpectrogramAnalyser
+{
+public:
+    static constexpr int fftOrder = 10;
+    static constexpr int fftSize = 1 << fftOrder;
+    static constexpr int hopSize = fftSize / 2;
+    // Each column is folded down into this many log spaced bands, so that one
+    // column maps directly onto a column of pixels.
+    static constexpr int numBands = 64;
+
+    SpectrogramAnalyser();
+
+    // Called from the audio thread. Never blocks or allocates. If the analysis
+    // thread falls behind, the samples that don't fit are dropped.
+    void pushSamples(const float* samples, int numSamples);
+
+    // Called from the analysis thread. Computes up to maxColumns new columns and
+    // returns how many were made.
+    int analysePending(int maxColumns);
+
+    // Called from the message thread. Copies the oldest finished column
+    // (numBands values between 0 and 1, lowest band first) into dest.
+    bool popColumn(float* dest);
+
+private:
+    juce::dsp::FFT fft;
+    juce::dsp::WindowingFunction<float> window;
+    // Samples waiting to be analysed. Written by the audio thread.
+    juce::AbstractFifo sampleFifo;
+    std::vector<float> sampleStorage;
+    // Finished columns waiting to be drawn. Written by the analysis thread.
+    juce::AbstractFifo columnFifo;
+    std::vector<float> columnStorage;
+    // The last fftSize samples seen by the analysis thread.
+    std::vector<float> frame;
+    // Scratch space for the FFT, which needs twice the frame size.
+    std::vector<float> fftData;
+    // First FFT bin of each band. The last entry is one past the final bin.
+    std::array<int, numBands + 1> bandEdges;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (SpectrogramAnalyser)
+};
+
+//==============================================================================
+/**
+    One background thread shared by every plugin instance in the process (through
+    juce::SharedResourcePointer). It round-robins over all registered analysers and
+    computes a fixed number of columns per tick, so the CPU it uses stays the same
+    whether one instance or twenty are open.
+*/
+class SpectrogramAnalysisThread : public juce::Thread
+{
+public:
+    SpectrogramAnalysisThread();
+    ~SpectrogramAnalysisThread() override;
+
+    void addAnalyser(SpectrogramAnalyser* analyser);
+    void removeAnalyser(SpectrogramAnalyser* analyser);
+
+    void run() override;
+
+private:
+    juce::CriticalSection lock;
+    juce::Array<SpectrogramAnalyser*> analysers;
+    // Where the next tick starts, so no analyser gets starved.
+    int nextAnalyser = 0;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (SpectrogramAnalysisThread)
+};
@@ -0,0 +1,379 @@
+/*
+  ==============================================================================
+
+    TakeHistory.cpp
+    Every generated take, kept in an append-only memory mapped file.
+
+  ==============================================================================
+*/
+
+#include "TakeHistory.h"
+
+#include <mutex>
+
+namespace {
+    constexpr int kRecordMagic = 0x454b4154; // "TAKE"
+    constexpr int kRecordVersion = 2;
+    // Magic, version, JSON size, channels, samples, recorded length, then the
+    // recorded tempo, recorded start, creation time and where the samples start.
+    // Version 1 records have no recorded start.
+    constexpr juce::int64 kHeaderBytes = 6 * 4 + 4 * 8;
+    constexpr juce::int64 kVersion1HeaderBytes = 6 * 4 + 3 * 8;
+    // Bytes apart that a page is touched when mapping a take in.
+    constexpr int kTouchStride = 4096;
+
+    juce::CriticalSection& getOpenStoresLock() {
+        static juce::CriticalSection lock;
+        return lock;
+    }
+
+    // Every store open in this process, so two instances never append to the same one.
+    juce::StringArray& getOpenStores() {
+        static juce::StringArray stores;
+        return stores;
+    }
+
+    juce::File getStoreDirectory() {
+        return juce::File::getSpecialLocation(juce::File::userApplicationDataDirectory)
+            .getChildFile("RiffusionVST").getChildFile("Takes");
+    }
+
+    int readRetentionDays() {
+        const juce::String days = juce::SystemStats::getEnvironmentVariable("RIFFUSION_TAKE_RETENTION_DAYS", {});
+        return days.isNotEmpty() ? days.getIntValue() : TakeHistory::kDefaultRetentionDays;
+    }
+
+    // Deletes the stores nothing has opened for longer than the retention period. Opening
+    // a store touches it, so only the takes of projects that have gone unopened that
+    // long (or were never saved, and outlived a crash) are lost.
+    void pruneOldStores() {
+        const int retentionDays = readRetentionDays();
+        if (retentionDays <= 0) {
+            return;
+        }
+        const juce::Time cutoff = juce::Time::getCurrentTime() - juce::RelativeTime::days(retentionDays);
+        const juce::ScopedLock registryLock(getOpenStoresLock());
+        for (const juce::File& store : getStoreDirectory().findChildFiles(juce::File::findFiles, false, "*.takes")) {
+            if (store.getLastModificationTime() < cutoff && !getOpenStores().contains(store.getFullPathName())) {
+                store.deleteFile();
+            }
+        }
+    }
+
+    juce::int64 getAudioBytes(const TakeHistory::Info& info) {
+        return static_cast<juce::int64>(info.numChannels) * info.numSamples * sizeof(float);
+    }
+
+    // Reads one byte of every page, so the audio thread doesn't fault them in.
+    void touchPages(const juce::AudioBuffer<float>& audio) {
+        static volatile float sink = 0.0f;
+        constexpr int stride = kTouchStride / static_cast<int>(sizeof(float));
+        float sum = 0.0f;
+        for (int channel = 0; channel < audio.getNumChannels(); ++channel) {
+            const float* samples = audio.getReadPointer(channel);
+            for (int i = 0; i < audio.getNumSamples(); i += stride) {
+                sum += samples[i];
+            }
+        }
+        sink = sum;
+    }
+}  // namespace
+
+//==============================================================================
+TakeHistory::TakeHistory()
+{
+    static std::once_flag pruned;
+    std::call_once(pruned, pruneOldStores);
+}
+
+TakeHistory::~TakeHistory()
+{
+    const juce::ScopedLock scopedLock(lock);
+    close();
+}
+
+bool TakeHistory::open(const juce::File& storeFile)
+{
+    const juce::ScopedLock scopedLock(lock);
+    close();
+    if (!storeFile.existsAsFile()) {
+        return false;
+    }
+    juce::File toOpen = storeFile;
+    {
+        const juce::ScopedLock registryLock(getOpenStoresLock());
+        if (getOpenStores().contains(storeFile.getFullPathName())) {
+            toOpen = createStoreFile();
+            if (!storeFile.copyFileTo(toOpen)) {
+                return false;
+            }
+        }
+        getOpenStores().add(toOpen.getFullPathName());
+    }
+    file = toOpen;
+    // A copy isn't in any saved project yet.
+    saved = toOpen == storeFile;
+    // Keeps a store that's still in use from being pruned.
+    file.setLastModificationTime(juce::Time::getCurrentTime());
+
+    juce::FileInputStream in(file);
+    if (!in.openedOk()) {
+        return false;
+    }
+    const juce::int64 fileSize = in.getTotalLength();
+    juce::int64 position = 0;
+    while (position + kVersion1HeaderBytes <= fileSize && in.setPosition(position)) {
+        if (in.readInt() != kRecordMagic) {
+            break;
+        }
+        const int version = in.readInt();
+        if (version != 1 && version != kRecordVersion) {
+            break;
+        }
+        const juce::int64 headerBytes = version == 1 ? kVersion1HeaderBytes : kHeaderBytes;
+        Entry entry;
+        const int jsonBytes = in.readInt();
+        entry.info.numChannels = in.readInt();
+        entry.info.numSamples = in.readInt();
+        entry.info.recordedLength = in.readInt();
+        entry.info.recordedTempo = in.readDouble();
+        if (version != 1) {
+            entry.info.recordedStartBeats = in.readDouble();
+        }
+        entry.info.created = juce::Time(in.readInt64());
+        entry.audioOffset = in.readInt64();
+        const juce::int64 audioBytes = getAudioBytes(entry.info);
+        // Anything that doesn't add up is where the last append was cut short.
+        if (jsonBytes < 0 || entry.info.numChannels <= 0 || entry.info.numSamples < 0
+            || entry.audioOffset < position + headerBytes + jsonBytes || entry.audioOffset % MappedRegion::kAlignment != 0
+            || entry.audioOffset + audioBytes > fileSize) {
+            break;
+        }
+        juce::MemoryBlock json;
+        if (in.readIntoMemoryBlock(json, jsonBytes) != static_cast<size_t>(jsonBytes)) {
+            break;
+        }
+        entry.info.params = juce::JSON::parse(json.toString());
+        entries.push_back(entry);
+        position = entry.audioOffset + audioBytes;
+    }
+    writeEnd = position;
+    return true;
+}
+
+void TakeHistory::close()
+{
+    const juce::File closed = file;
+    file = juce::File();
+    entries.clear();
+    writeEnd = 0;
+    selected = -1;
+    mapped.clear();
+    // Whatever the audio thread was playing from the old store is released once it
+    // has moved on to this.
+    handoff.publish(std::make_unique<View>());
+    if (closed != juce::File()) {
+        const juce::ScopedLock registryLock(getOpenStoresLock());
+        getOpenStores().removeString(closed.getFullPathName());
+        // Where the file is still mapped (by a take the owner hasn't let go of yet) and
+        // the OS won't delete it, it's left to be pruned.
+        if (!saved) {
+            closed.deleteFile();
+        }
+    }
+    saved = false;
+}
+
+juce::File TakeHistory::getFile() const
+{
+    const juce::ScopedLock scopedLock(lock);
+    return file;
+}
+
+void TakeHistory::markSaved()
+{
+    const juce::ScopedLock scopedLock(lock);
+    saved = file != juce::File();
+}
+
+juce::File TakeHistory::createStoreFile()
+{
+    juce::File directory = getStoreDirectory();
+    directory.createDirectory();
+    return directory.getChildFile(juce::Uuid().toString() + ".takes");
+}
+
+int TakeHistory::append(const juce::AudioBuffer<float>& audio, const juce::var& params, int recordedLength, double recordedTempo,
+    double recordedStartBeats)
+{
+    const juce::ScopedLock scopedLock(lock);
+    if (file == juce::File()) {
+        file = createStoreFile();
+        saved = false;
+        writeEnd = 0;
+        const juce::ScopedLock registryLock(getOpenStoresLock());
+        getOpenStores().add(file.getFullPathName());
+    }
+    Entry entry;
+    entry.info.params = params;
+    entry.info.numChannels = audio.getNumChannels();
+    entry.info.numSamples = audio.getNumSamples();
+    entry.info.recordedLength = recordedLength;
+    entry.info.recordedTempo = recordedTempo;
+    entry.info.recordedStartBeats = recordedStartBeats;
+    entry.info.created = juce::Time::getCurrentTime();
+    if (entry.info.numChannels <= 0) {
+        return -1;
+    }
+    const juce::String json = juce::JSON::toString(params, true);
+    const juce::int64 jsonBytes = static_cast<juce::int64>(json.getNumBytesAsUTF8());
+    const juce::int64 headerEnd = writeEnd + kHeaderBytes + jsonBytes;
+    // Samples start on a boundary every platform can map from.
+    entry.audioOffset = MappedRegion::align(headerEnd);
+
+    juce::FileOutputStream out(file);
+    if (!out.openedOk() || !out.setPosition(writeEnd)) {
+        return -1;
+    }
+    out.writeInt(kRecordMagic);
+    out.writeInt(kRecordVersion);
+    out.writeInt(static_cast<int>(jsonBytes));
+    out.writeInt(entry.info.numChannels);
+    out.writeInt(entry.info.numSamples);
+    out.writeInt(entry.info.recordedLength);
+    out.writeDouble(entry.info.recordedTempo);
+    out.writeDouble(entry.info.recordedStartBeats);
+    out.writeInt64(entry.info.created.toMilliseconds());
+    out.writeInt64(entry.audioOffset);
+    out.write(json.toRawUTF8(), static_cast<size_t>(jsonBytes));
+    out.writeRepeatedByte(0, static_cast<size_t>(entry.audioOffset - headerEnd));
+    for (int channel = 0; channel < audio.getNumChannels(); ++channel) {
+        out.write(audio.getReadPointer(channel), static_cast<size_t>(audio.getNumSamples()) * sizeof(float));
+    }
+    // Drops anything left over from an append that was cut short.
+    if (out.truncate().failed() || !out.getStatus().wasOk()) {
+        return -1;
+    }
+    writeEnd = entry.audioOffset + getAudioBytes(entry.info);
+    entries.push_back(entry);
+    return static_cast<int>(entries.size()) - 1;
+}
+
+int TakeHistory::getNumTakes() const
+{
+    const juce::ScopedLock scopedLock(lock);
+    return static_cast<int>(entries.size());
+}
+
+TakeHistory::Info TakeHistory::getInfo(int index) const
+{
+    const juce::ScopedLock scopedLock(lock);
+    if (index < 0 || index >= static_cast<int>(entries.size())) {
+        return {};
+    }
+    return entries[static_cast<size_t>(index)].info;
+}
+
+juce::int64 TakeHistory::getStoreSize() const
+{
+    const juce::ScopedLock scopedLock(lock);
+    return writeEnd;
+}
+
+int TakeHistory::getNumMapped() const
+{
+    const juce::ScopedLock scopedLock(lock);
+    return static_cast<int>(mapped.size());
+}
+
+int TakeHistory::getSelected() const
+{
+    const juce::ScopedLock scopedLock(lock);
+    return selected;
+}
+
+//==============================================================================
+std::shared_ptr<const MappedRegion> TakeHistory::map(int index)
+{
+    for (auto it = mapped.begin(); it != mapped.end(); ++it) {
+        if (it->first == index) {
+            mapped.splice(mapped.begin(), mapped, it);
+            return mapped.front().second;
+        }
+    }
+    const Entry& entry = entries[static_cast<size_t>(index)];
+    const juce::int64 audioBytes = getAudioBytes(entry.info);
+    if (audioBytes == 0) {
+        return nullptr;
+    }
+    auto mapping = std::make_shared<const MappedRegion>(file, entry.audioOffset, audioBytes);
+    if (mapping->getData() == nullptr) {
+        return nullptr;
+    }
+    mapped.emplace_front(index, mapping);
+    // Anything still playing from an unmapped take keeps its mapping until it's done.
+    while (static_cast<int>(mapped.size()) > kMaxMappedTakes) {
+        mapped.pop_back();
+    }
+    return mapping;
+}
+
+std::unique_ptr<TakeHistory::View> TakeHistory::makeView(int index)
+{
+    if (index < 0 || index >= static_cast<int>(entries.size())) {
+        return nullptr;
+    }
+    std::shared_ptr<const MappedRegion> mapping = map(index);
+    if (mapping == nullptr) {
+        return nullptr;
+    }
+    const Entry& entry = entries[static_cast<size_t>(index)];
+    auto view = std::make_unique<View>();
+    view->index = index;
+    view->recordedLength = entry.info.recordedLength;
+    view->recordedTempo = entry.info.recordedTempo;
+    view->recordedStartBeats = entry.info.recordedStartBeats;
+    const char* data = mapping->getData();
+    std::vector<float*> channels;
+    for (int channel = 0; channel < entry.info.numChannels; ++channel) {
+        // Mapped read only. Nothing writes through a View.
+        channels.push_back(const_cast<float*>(reinterpret_cast<const float*>(data)) + static_cast<size_t>(channel) * entry.info.numSamples);
+    }
+    view->audio = juce::AudioBuffer<float>(channels.data(), entry.info.numChannels, entry.info.numSamples);
+    view->mapping = std::move(mapping);
+    return view;
+}
+
+bool TakeHistory::select(int index, bool isHeldByOwner)
+{
+    const juce::ScopedLock scopedLock(lock);
+    if ((index < 0 && !isHeldByOwner) || index >= static_cast<int>(entries.size())) {
+        return false;
+    }
+    std::unique_ptr<View> view;
+    if (isHeldByOwner) {
+        view = std::make_unique<View>();
+        view->index = index;
+    }
+    else {
+        view = makeView(index);
+        if (view == nullptr) {
+            return false;
+        }
+        touchPages(view->audio);
+    }
+    selected = index;
+    handoff.publish(std::move(view));
+    return true;
+}
+
+std::shared_ptr<const juce::AudioBuffer<float>> TakeHistory::getAudio(int index)
+{
+    const juce::ScopedLock scopedLock(lock);
+    std::shared_ptr<View> view = makeView(index);
+    if (view == nullptr) {
+        return nullptr;
+    }
+    // Shares ownership of the view, so the mapping lives as long as the buffer is used.
+    return std::shared_ptr<const juce::AudioBuffer<float>>(view, &view->audio);
+}
@@ -0,0 +1,143 @@
+/*
+  ==============================================================================
+
+    TakeHistory.h
+    Every generated take, kept in an append-only memory mapped file.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "MappedRegion.h"
+#include "RealtimeHandoff.h"
+
+#include <list>
+#include <memory>
+#include <vector>
+
+//==============================================================================
+/**
+    Keeps every take the server sends back, along with the params it was made
+    with, so nothing that cost GPU time is ever thrown away.
+
+    Takes are appended to a single file and never rewritten: a record header, the
+    params as JSON, then the samples, starting on a 64k boundary so they can be
+    mapped straight from the file. Opening a store reads the headers back and stops
+    at the first incomplete record, so a take being written when the host crashed
+    is simply written over by the next one.
+
+    Only the last kMaxMappedTakes takes used are kept mapped. Mapped samples are
+    file backed, so the OS can drop them from RAM under pressure and read them back
+    on demand; however many takes a session builds up, the heap doesn't grow.
+
+    Selecting a take maps it, touches every page so it's in RAM, and hands the
+    audio thread a View of it through a RealtimeHandoff. The audio thread just
+    swaps pointers: nothing is copied or decoded, and no page fault is left for it.
+
+    A store that was never saved into a project is deleted when it's closed, since
+    nothing can open it again. Stores that haven't been opened for
+    kDefaultRetentionDays (or RIFFUSION_TAKE_RETENTION_DAYS, 0 to keep them forever)
+    are deleted the first time a TakeHistory is made in the process.
+*/
+class TakeHistory
+{
+public:
+    static constexpr int kMaxMappedTakes = 8;
+    static constexpr int kDefaultRetentionDays = 90;
+
+    struct Info
+    {
+        juce::var params;
+        int numChannels = 0;
+        int numSamples = 0;
+        // Length and tempo of the recording the take was generated from, and where it
+        // started on the DAW's timeline in beats, or negative if that isn't known.
+        int recordedLength = 0;
+        double recordedTempo = 0.0;
+        double recordedStartBeats = -1.0;
+        juce::Time created;
+    };
+
+    // What the audio thread plays. An empty audio buffer means the selected take
+    // is the one the owner already holds in its own buffer.
+    struct View
+    {
+        int index = -1;
+        int recordedLength = 0;
+        double recordedTempo = 0.0;
+        double recordedStartBeats = -1.0;
+        // Refers to the mapped samples, which stay mapped for as long as this exists.
+        juce::AudioBuffer<float> audio;
+        std::shared_ptr<const MappedRegion> mapping;
+    };
+
+    TakeHistory();
+    ~TakeHistory();
+
+    // Not for the audio thread. Opens an existing store, or makes a new one on the
+    // first append. If another instance in this process already has the file open
+    // (e.g. a duplicated track), a copy is opened instead, so each appends to its
+    // own. Returns false if the file couldn't be read.
+    bool open(const juce::File& file);
+    juce::File getFile() const;
+    // Call once the store's path has been saved somewhere it'll be opened from again,
+    // so it's kept when it's closed.
+    void markSaved();
+
+    // Not for the audio thread. Writes a take to the end of the store and returns
+    // its index, or -1 if it couldn't be written.
+    int append(const juce::AudioBuffer<float>& audio, const juce::var& params, int recordedLength, double recordedTempo,
+        double recordedStartBeats);
+
+    int getNumTakes() const;
+    Info getInfo(int index) const;
+    juce::int64 getStoreSize() const;
+    int getNumMapped() const;
+
+    // Not for the audio thread. Maps the take and its pages in, then hands it to
+    // the audio thread. If isHeldByOwner is true, the view is empty and the owner
+    // plays its own copy instead; that's allowed with an index of -1 too, for a take
+    // that couldn't be stored. Returns false if the take couldn't be mapped.
+    bool select(int index, bool isHeldByOwner);
+    int getSelected() const;
+
+    // Not for the audio thread. The take's samples, read straight from the mapping,
+    // e.g. to hand to the time stretch. Keeps the mapping alive. nullptr on failure.
+    std::shared_ptr<const juce::AudioBuffer<float>> getAudio(int index);
+
+    // Audio thread. The selected take, or nullptr if nothing has been selected.
+    const View* acquire() { return handoff.acquire(); }
+    // Not for the audio thread. Frees views the audio thread has moved on from.
+    void collectGarbage() { handoff.collectGarbage(); }
+
+private:
+    struct Entry
+    {
+        Info info;
+        juce::int64 audioOffset = 0;
+    };
+
+    // The remaining members are called with lock held.
+    // Deletes the store too, unless it has been saved.
+    void close();
+    // Maps the take's samples, or returns the mapping it already has.
+    std::shared_ptr<const MappedRegion> map(int index);
+    std::unique_ptr<View> makeView(int index);
+    // Picks a file for a new store.
+    static juce::File createStoreFile();
+
+    mutable juce::CriticalSection lock;
+    juce::File file;
+    bool saved = false;
+    std::vector<Entry> entries;
+    // Where the next record goes.
+    juce::int64 writeEnd = 0;
+    int selected = -1;
+    // Most recently used first.
+    std::list<std::pair<int, std::shared_ptr<const MappedRegion>>> mapped;
+    RealtimeHandoff<View> handoff;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (TakeHistory)
+};
@@ -0,0 +1,200 @@
+/*
+  ==============================================================================
+
+    TimeStretchEngine.cpp
+    Conforms generated audio to the host tempo with WSOLA, off the audio thread.
+
+  ==============================================================================
+*/
+
+#include "TimeStretchEngine.h"
+
+#include <limits>
+
+namespace {
+    // About 23 ms at 44100 hz, long enough to hold a few periods of a bass note.
+    constexpr int kFrameSize = 1024;
+    constexpr int kSynthesisHop = kFrameSize / 2;
+    // How far either side of the nominal position to look for the best match.
+    constexpr int kSearchRadius = 256;
+    // Frames rendered per slice on the worker, a couple of milliseconds' work.
+    constexpr int kFramesPerSlice = 32;
+    // How often an offline wait checks for a finished render.
+    constexpr int kPollMs = 20;
+    // Tempo changes smaller than this don't trigger a new render.
+    constexpr double kTempoTolerance = 0.01;
+    constexpr double kMinRatio = 0.25;
+    constexpr double kMaxRatio = 4.0;
+
+    // Four independent accumulators so the compiler can keep this in SIMD registers
+    // without needing fast-math.
+    float dotProduct(const float* a, const float* b, int n) {
+        float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+        int i = 0;
+        for (; i + 4 <= n; i += 4) {
+            s0 += a[i] * b[i];
+            s1 += a[i + 1] * b[i + 1];
+            s2 += a[i + 2] * b[i + 2];
+            s3 += a[i + 3] * b[i + 3];
+        }
+        for (; i < n; ++i) {
+            s0 += a[i] * b[i];
+        }
+        return (s0 + s1) + (s2 + s3);
+    }
+}  // namespace
+
+//==============================================================================
+TimeStretchEngine::TimeStretchEngine() : window(kFrameSize)
+{
+    for (int i = 0; i < kFrameSize; ++i) {
+        window[i] = 0.5f - 0.5f * std::cos(juce::MathConstants<float>::twoPi * i / kFrameSize);
+    }
+    worker->addClient(this);
+}
+
+TimeStretchEngine::~TimeStretchEngine()
+{
+    worker->removeClient(this);
+}
+
+void TimeStretchEngine::setSource(std::shared_ptr<const juce::AudioBuffer<float>> newSource, int newRecordedLength, double newRecordedTempo)
+{
+    {
+        const juce::ScopedLock scopedLock(sourceLock);
+        source = std::move(newSource);
+        recordedLength = newRecordedLength;
+        recordedTempo = newRecordedTempo;
+        canRender = source != nullptr && source->getNumSamples() >= kFrameSize
+            && recordedTempo > 0.0 && recordedLength > 0;
+        ++sourceVersion;
+    }
+    // Stop playing the old take's render straight away.
+    handoff.publish(std::make_unique<Rendered>());
+    renderedBytes = 0;
+    worker->wake();
+}
+
+bool TimeStretchEngine::doWork()
+{
+    handoff.collectGarbage();
+    // A render of a take that has since been replaced is no use to anyone.
+    if (job != nullptr && job->version != sourceVersion.load()) {
+        job.reset();
+    }
+    if (job == nullptr) {
+        job = startJob();
+        if (job == nullptr) {
+            return false;
+        }
+    }
+    if (!render(*job, kFramesPerSlice)) {
+        return true;
+    }
+    renderedBytes = static_cast<size_t>(job->rendered->audio.getNumSamples()) * sizeof(float);
+    renderedVersion = job->version;
+    renderedTempo = job->rendered->tempo;
+    handoff.publish(std::move(job->rendered));
+    job.reset();
+    renderFinished.signal();
+    return true;
+}
+
+std::unique_ptr<TimeStretchEngine::Job> TimeStretchEngine::startJob()
+{
+    auto next = std::make_unique<Job>();
+    int currentRecordedLength = 0;
+    double currentRecordedTempo = 0.0;
+    {
+        const juce::ScopedLock scopedLock(sourceLock);
+        next->source = source;
+        currentRecordedLength = recordedLength;
+        currentRecordedTempo = recordedTempo;
+        next->version = sourceVersion.load();
+    }
+    const double tempo = requestedTempo.load();
+    const bool upToDate = next->version == renderedVersion && std::abs(tempo - renderedTempo) < kTempoTolerance;
+    if (upToDate || !next->source || next->source->getNumSamples() < kFrameSize
+        || tempo <= 0.0 || currentRecordedTempo <= 0.0 || currentRecordedLength <= 0) {
+        return nullptr;
+    }
+    // Stretch so the take lasts as many beats now as the recording did when it was made.
+    const int inLength = next->source->getNumSamples();
+    const double targetLength = currentRecordedLength * currentRecordedTempo / tempo;
+    const double ratio = juce::jlimit(kMinRatio, kMaxRatio, targetLength / inLength);
+    next->analysisHop = kSynthesisHop / ratio;
+    next->rendered = std::make_unique<Rendered>();
+    next->rendered->tempo = tempo;
+    next->rendered->audio.setSize(1, static_cast<int>(inLength * ratio));
+    next->rendered->audio.clear();
+    return next;
+}
+
+const TimeStretchEngine::Rendered* TimeStretchEngine::waitForTempo(double tempo, int timeoutMs)
+{
+    requestTempo(tempo);
+    // Offline, so waking the worker is allowed and saves waiting for its next poll.
+    worker->wake();
+    const int version = sourceVersion;
+    if (version != offlineWaitVersion || std::abs(tempo - offlineWaitTempo) >= kTempoTolerance) {
+        offlineWaitVersion = version;
+        offlineWaitTempo = tempo;
+        offlineWaitDeadline = juce::Time::getMillisecondCounterHiRes() + timeoutMs;
+    }
+    const Rendered* rendered = acquire();
+    while (canRender && juce::Time::getMillisecondCounterHiRes() < offlineWaitDeadline
+        && (rendered == nullptr || rendered->audio.getNumSamples() == 0 || std::abs(rendered->tempo - tempo) >= kTempoTolerance)) {
+        renderFinished.wait(kPollMs);
+        rendered = acquire();
+    }
+    return rendered;
+}
+
+bool TimeStretchEngine::render(Job& job, int maxFrames)
+{
+    const juce::AudioBuffer<float>& in = *job.source;
+    juce::AudioBuffer<float>& out = job.rendered->audio;
+    const int inLength = in.getNumSamples();
+    const int outLength = out.getNumSamples();
+    const float* input = in.getReadPointer(0);
+    float* output = out.getWritePointer(0);
+    const int lastFrameStart = inLength - kFrameSize;
+
+    for (int numRendered = 0; numRendered < maxFrames; ++numRendered, ++job.frame) {
+        const int outPos = job.frame * kSynthesisHop;
+        if (outPos >= outLength) {
+            break;
+        }
+        const int nominal = juce::jlimit(0, lastFrameStart, static_cast<int>(job.frame * job.analysisHop));
+        int inputPos = nominal;
+        // Look for the frame that best continues the one placed last, i.e. the one
+        // that looks most like what followed the previous frame in the input.
+        const int natural = job.previousInputPos + kSynthesisHop;
+        if (job.frame > 0 && natural <= lastFrameStart) {
+            const float* target = input + natural;
+            const int searchStart = std::max(0, nominal - kSearchRadius);
+            const int searchEnd = std::min(lastFrameStart, nominal + kSearchRadius);
+            float best = -std::numeric_limits<float>::max();
+            for (int candidate = searchStart; candidate <= searchEnd; ++candidate) {
+                const float similarity = dotProduct(target, input + candidate, kSynthesisHop);
+                if (similarity > best) {
+                    best = similarity;
+                    inputPos = candidate;
+                }
+            }
+        }
+        const int numToAdd = std::min(kFrameSize, outLength - outPos);
+        juce::FloatVectorOperations::addWithMultiply(output + outPos, input + inputPos, window.data(), numToAdd);
+        job.previousInputPos = inputPos;
+    }
+    if (job.frame * kSynthesisHop < outLength) {
+        return false;
+    }
+    // Nothing overlaps the first half frame, so the window would fade it in from
+    // silence. Frame 0 always starts at the top of the input, so copy that through.
+    const int numToFix = std::min(kSynthesisHop, outLength);
+    for (int i = 0; i < numToFix; ++i) {
+        output[i] = input[i];
+    }
+    return true;
+}
@@ -0,0 +1,117 @@
+/*
+  ==============================================================================
+
+    TimeStretchEngine.h
+    Conforms generated audio to the host tempo with WSOLA, off the audio thread.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "BackgroundWorker.h"
+#include "RealtimeHandoff.h"
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+//==============================================================================
+/**
+    Stretches a generated take so that it lasts as many beats at the host's current
+    tempo as the recording it was made from did at the tempo it was recorded at.
+    That takes care of both tempo changes and the server returning a clip of a
+    slightly different length.
+
+    Rendering uses WSOLA (waveform similarity overlap-add), a slice at a time on the
+    shared BackgroundWorker, while playback carries on with the previous render. A
+    tempo change doesn't interrupt a render in progress: once it's published, the
+    next one is started at whatever the tempo is by then. Under continuous tempo
+    automation that means a steady stream of finished renders a little behind the
+    host, rather than none at all. Only a new take abandons a render.
+*/
+class TimeStretchEngine : private BackgroundWorker::Client
+{
+public:
+    struct Rendered
+    {
+        // Empty when there's nothing to play, e.g. just after a new take arrived.
+        juce::AudioBuffer<float> audio;
+        // The host tempo this was stretched to.
+        double tempo = 0.0;
+    };
+
+    TimeStretchEngine();
+    ~TimeStretchEngine() override;
+
+    // Any thread but the audio thread. Sets the take to stretch, along with how many
+    // samples the original recording had and the tempo it was recorded at.
+    void setSource(std::shared_ptr<const juce::AudioBuffer<float>> source, int recordedLength, double recordedTempo);
+
+    // Audio thread. Lock free. Asks for the take to be conformed to this tempo.
+    void requestTempo(double tempo) { requestedTempo.store(tempo); }
+
+    // Audio thread. The most recent finished render, or nullptr.
+    const Rendered* acquire() { return handoff.acquire(); }
+    // Any thread but the audio thread. Frees renders the audio thread has moved on from.
+    void collectGarbage() { handoff.collectGarbage(); }
+
+    // Audio thread, but only when rendering offline: blocks until a render for this
+    // tempo is ready. Returns straight away if there's nothing that could be rendered.
+    // timeoutMs is the longest it waits in total for one source and tempo, however many
+    // blocks ask, so a render that never finishes holds up the bounce only once.
+    const Rendered* waitForTempo(double tempo, int timeoutMs);
+
+    // Any thread. Bytes held by the latest render.
+    size_t getMemoryUsage() const { return renderedBytes; }
+
+private:
+    // A render in progress, carried over from one slice to the next.
+    struct Job
+    {
+        std::shared_ptr<const juce::AudioBuffer<float>> source;
+        int version = 0;
+        double analysisHop = 0.0;
+        std::unique_ptr<Rendered> rendered;
+        int frame = 0;
+        int previousInputPos = 0;
+    };
+
+    // BackgroundWorker::Client. Renders a few frames, starting a render first if the
+    // last one is out of date.
+    bool doWork() override;
+    // Returns nullptr if there's nothing that needs rendering.
+    std::unique_ptr<Job> startJob();
+    // Renders up to maxFrames frames. Returns true once the job is finished.
+    bool render(Job& job, int maxFrames);
+
+    juce::SharedResourcePointer<BackgroundWorker> worker;
+
+    juce::CriticalSection sourceLock;
+    std::shared_ptr<const juce::AudioBuffer<float>> source;
+    int recordedLength = 0;
+    double recordedTempo = 0.0;
+    // Bumped every time the source changes.
+    std::atomic<int> sourceVersion { 0 };
+    std::atomic<double> requestedTempo { 0.0 };
+    // True if the current source has everything needed to be stretched.
+    std::atomic<bool> canRender { false };
+    std::atomic<size_t> renderedBytes { 0 };
+    // Only touched by the worker.
+    std::unique_ptr<Job> job;
+    int renderedVersion = -1;
+    double renderedTempo = 0.0;
+    // Signalled every time a render is published.
+    juce::WaitableEvent renderFinished;
+    // Only touched by waitForTempo. The source version and tempo it's waiting for, and
+    // when it stops waiting for them.
+    int offlineWaitVersion = -1;
+    double offlineWaitTempo = 0.0;
+    double offlineWaitDeadline = 0.0;
+    // Periodic Hann window, which sums to one at 50% overlap.
+    std::vector<float> window;
+    RealtimeHandoff<Rendered> handoff;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (TimeStretchEngine)
+};
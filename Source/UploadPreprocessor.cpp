@@ -0,0 +1,105 @@
+/*
+  ==============================================================================
+
+    UploadPreprocessor.cpp
+    Cleans up a take before it's sent to the server.
+
+  ==============================================================================
+*/
+
+#include "UploadPreprocessor.h"
+
+namespace {
+    // Anything quieter than -50 dBFS counts as silence.
+    constexpr float kSilenceThreshold = 0.00316f;
+    // Silence is found a block at a time, so the search is a few vectorised peak scans.
+    constexpr int kBlockSize = 64;
+    // Kept either side of the loud part so attacks and tails aren't clipped.
+    constexpr double kPaddingSeconds = 0.05;
+    // Normalise peaks to -1 dBFS...
+    constexpr float kTargetPeak = 0.891f;
+    // ...but don't turn a very quiet take into amplified noise.
+    constexpr float kMaxGain = 16.0f;
+}  // namespace
+
+//==============================================================================
+UploadPreprocessor::Region UploadPreprocessor::process(const juce::AudioBuffer<float>& input, int numValidSamples,
+    double sampleRate, juce::AudioBuffer<float>& output)
+{
+    Region region;
+    const int numSamples = juce::jlimit(0, input.getNumSamples(), numValidSamples);
+    const int numChannels = input.getNumChannels();
+    if (numSamples == 0 || numChannels == 0) {
+        output.setSize(1, 0);
+        return region;
+    }
+
+    // Downmix into a scratch buffer, which is also where the rest happens in place.
+    juce::AudioBuffer<float> mono(1, numSamples);
+    mono.copyFrom(0, 0, input, 0, 0, numSamples);
+    for (int channel = 1; channel < numChannels; ++channel) {
+        mono.addFrom(0, 0, input, channel, 0, numSamples);
+    }
+    float* samples = mono.getWritePointer(0);
+    if (numChannels > 1) {
+        juce::FloatVectorOperations::multiply(samples, 1.0f / numChannels, numSamples);
+    }
+
+    // A take is only a few seconds long, so removing the mean is all the DC blocking
+    // it needs, and unlike a recursive high-pass filter it vectorises.
+    double sum = 0.0;
+    for (int i = 0; i < numSamples; ++i) {
+        sum += samples[i];
+    }
+    juce::FloatVectorOperations::add(samples, static_cast<float>(-sum / numSamples), numSamples);
+
+    int start = findFirstLoudSample(samples, numSamples, kSilenceThreshold);
+    int end = findEndOfLoudSamples(samples, numSamples, kSilenceThreshold);
+    if (start < 0 || end <= start) {
+        // All silence. Send it as it is rather than nothing at all.
+        start = 0;
+        end = numSamples;
+    }
+    else {
+        const int padding = juce::roundToInt(kPaddingSeconds * sampleRate);
+        start = std::max(0, start - padding);
+        end = std::min(numSamples, end + padding);
+    }
+    region.start = start;
+    region.length = end - start;
+    region.trimmedEnd = numSamples - end;
+
+    output.setSize(1, region.length, false, false, true);
+    output.copyFrom(0, 0, mono, 0, start, region.length);
+    const juce::Range<float> range = juce::FloatVectorOperations::findMinAndMax(output.getReadPointer(0), region.length);
+    const float peak = std::max(std::abs(range.getStart()), std::abs(range.getEnd()));
+    if (peak > 0.0f) {
+        region.gain = std::min(kMaxGain, kTargetPeak / peak);
+        juce::FloatVectorOperations::multiply(output.getWritePointer(0), region.gain, region.length);
+    }
+    return region;
+}
+
+int UploadPreprocessor::findFirstLoudSample(const float* samples, int numSamples, float threshold)
+{
+    for (int block = 0; block < numSamples; block += kBlockSize) {
+        const int blockLength = std::min(kBlockSize, numSamples - block);
+        const juce::Range<float> range = juce::FloatVectorOperations::findMinAndMax(samples + block, blockLength);
+        if (range.getEnd() > threshold || range.getStart() < -threshold) {
+            return block;
+        }
+    }
+    return -1;
+}
+
+int UploadPreprocessor::findEndOfLoudSamples(const float* samples, int numSamples, float threshold)
+{
+    for (int blockEnd = numSamples; blockEnd > 0; blockEnd -= kBlockSize) {
+        const int blockLength = std::min(kBlockSize, blockEnd);
+        const juce::Range<float> range = juce::FloatVectorOperations::findMinAndMax(samples + blockEnd - blockLength, blockLength);
+        if (range.getEnd() > threshold || range.getStart() < -threshold) {
+            return blockEnd;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,50 @@
+/*
+  ==============================================================================
+
+    UploadPreprocessor.h
+    Cleans up a take before it's sent to the server.
+
+  ==============================================================================
+*/
+
+#pragma once
+
+#include <JuceHeader.h>
+
+//==============================================================================
+/**
+    Turns the valid part of the recording buffer into what actually gets uploaded:
+    downmixed to mono, DC offset removed, leading and trailing silence trimmed and
+    peak normalised. Trailing zeros from a take that didn't fill the buffer would
+    otherwise be encoded, sent and generated on.
+
+    The generated audio corresponds to the trimmed region, so the region is
+    reported back for the result to be put at the same place on the timeline.
+*/
+class UploadPreprocessor
+{
+public:
+    struct Region
+    {
+        // Where the uploaded audio starts in the recording, and how long it is.
+        int start = 0;
+        int length = 0;
+        // Samples of the valid recording cut off the end.
+        int trimmedEnd = 0;
+        // Linear gain applied when normalising.
+        float gain = 1.0f;
+    };
+
+    // Processes the first numValidSamples samples of input, recorded at sampleRate,
+    // into output.
+    static Region process(const juce::AudioBuffer<float>& input, int numValidSamples, double sampleRate,
+        juce::AudioBuffer<float>& output);
+
+private:
+    // Start of the first block with a peak above threshold, or -1 if there isn't one.
+    static int findFirstLoudSample(const float* samples, int numSamples, float threshold);
+    // End of the last block with a peak above threshold, or -1 if there isn't one.
+    static int findEndOfLoudSamples(const float* samples, int numSamples, float threshold);
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (UploadPreprocessor)
+};
@@ -0,0 +1,311 @@
+/*
+  ==============================================================================
+
+    Main.cpp
+    RiffusionRealtimeDriver: runs the plugin's processBlock through a record,
+    play and generate session on a real-time audio thread, built with the
+    real-time safety checker, and fails on any violation.
+
+  ==============================================================================
+*/
+
+#include <JuceHeader.h>
+#include "../../../Source/PluginProcessor.h"
+#include "../../../Source/RealtimeSafetyChecker.h"
+
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <iostream>
+
+namespace {
+    constexpr int kDefaultMockPort = 3098;
+    constexpr int kDefaultBlockSize = 256;
+    constexpr double kDefaultSampleRate = 44100.0;
+    // How much faster than real time the audio thread runs, so a session takes seconds.
+    constexpr double kDefaultSpeed = 4.0;
+    constexpr int kDefaultGenerationTimeoutMs = 60000;
+    constexpr int kMockStartTimeoutMs = 5000;
+    // Longest any phase but a generation may take before it counts as stuck.
+    constexpr int kPhaseTimeoutMs = 20000;
+    // How long each playback phase runs for, in audio time.
+    constexpr double kPlaySeconds = 1.0;
+    constexpr double kTempo = 120.0;
+    // The tempo the synced phase moves the host to, so the take is stretched.
+    constexpr double kStretchedTempo = 96.0;
+    constexpr float kInputFrequency = 220.0f;
+    constexpr float kInputLevel = 0.25f;
+    constexpr int kStopTimeoutMs = 2000;
+
+    const char* const kUsage =
+        "Usage: RiffusionRealtimeDriver [options]\n"
+        "\n"
+        "Plays the plugin through idle, a lookback grab, recording, playing the\n"
+        "recording, generating, playing the take free and synced to the host tempo,\n"
+        "and morphing between two takes, with processBlock on a real-time thread.\n"
+        "Build it with RIFFUSION_RT_CHECKS=1 (the RTChecks configuration). Exits with 1\n"
+        "if processBlock allocated, locked or blocked, or if any phase failed.\n"
+        "\n"
+        "  --mock-server=<path>       Start this RiffusionMockServer to generate against.\n"
+        "  --port=<n>                 Port for the mock server (default 3098).\n"
+        "  --server=<address>         Use a server that's already running instead.\n"
+        "  --block-size=<n>           Samples per block (default 256).\n"
+        "  --sample-rate=<hz>         Sample rate (default 44100).\n"
+        "  --speed=<x>                How much faster than real time to run (default 4).\n"
+        "  --generation-timeout-ms=<ms>  Longest a generation may take (default 60000).\n";
+
+    // The host's transport. Always rolling, at a tempo the driver can change.
+    class DriverPlayHead : public juce::AudioPlayHead
+    {
+    public:
+        explicit DriverPlayHead(double rate) : sampleRate(rate) {}
+
+        juce::Optional<PositionInfo> getPosition() const override
+        {
+            PositionInfo position;
+            const double bpm = tempo;
+            const juce::int64 samples = samplePosition;
+            position.setIsPlaying(true);
+            position.setBpm(bpm);
+            position.setTimeInSamples(samples);
+            position.setTimeInSeconds(samples / sampleRate);
+            position.setPpqPosition(ppqPosition);
+            return position;
+        }
+
+        // Audio thread, after each block.
+        void advance(int numSamples)
+        {
+            ppqPosition = ppqPosition + numSamples / sampleRate * tempo / 60.0;
+            samplePosition += numSamples;
+        }
+
+        std::atomic<double> tempo { kTempo };
+
+    private:
+        const double sampleRate;
+        std::atomic<juce::int64> samplePosition { 0 };
+        std::atomic<double> ppqPosition { 0.0 };
+    };
+
+    // Calls processBlock over and over, with a sine for input, as a host's audio
+    // callback would. The sleep between blocks is outside processBlock, so the
+    // checker doesn't see it.
+    class AudioThread : public juce::Thread
+    {
+    public:
+        AudioThread(RiffusionVSTAudioProcessor& processorToDrive, DriverPlayHead& playHeadToAdvance,
+            int blockSizeToUse, double sampleRateToUse, double speed)
+            : juce::Thread("Riffusion Driver Audio"), processor(processorToDrive), playHead(playHeadToAdvance),
+              blockSize(blockSizeToUse), sampleRate(sampleRateToUse),
+              blockMs(juce::jmax(1, juce::roundToInt(blockSizeToUse / sampleRateToUse * 1000.0 / speed)))
+        {
+        }
+
+        ~AudioThread() override
+        {
+            stopThread(kStopTimeoutMs);
+        }
+
+        // Loudest output sample since the last call.
+        float takePeak() { return peak.exchange(0.0f); }
+        juce::int64 getNumSamplesPlayed() const { return numSamplesPlayed; }
+
+    private:
+        void run() override
+        {
+            juce::AudioBuffer<float> buffer(1, blockSize);
+            juce::MidiBuffer midi;
+            midi.ensureSize(256);
+            double phase = 0.0;
+            const double phaseStep = juce::MathConstants<double>::twoPi * kInputFrequency / sampleRate;
+            while (!threadShouldExit()) {
+                float* samples = buffer.getWritePointer(0);
+                for (int i = 0; i < blockSize; ++i) {
+                    samples[i] = kInputLevel * static_cast<float>(std::sin(phase));
+                    phase = std::fmod(phase + phaseStep, juce::MathConstants<double>::twoPi);
+                }
+                processor.processBlock(buffer, midi);
+                // Output is only the input passed through when nothing is playing.
+                if (processor.getPlayState() != RiffusionVSTAudioProcessor::PlayState::NotPlaying) {
+                    const float blockPeak = buffer.getMagnitude(0, 0, blockSize);
+                    if (blockPeak > peak) {
+                        peak = blockPeak;
+                    }
+                }
+                playHead.advance(blockSize);
+                numSamplesPlayed += blockSize;
+                wait(blockMs);
+            }
+        }
+
+        RiffusionVSTAudioProcessor& processor;
+        DriverPlayHead& playHead;
+        const int blockSize;
+        const double sampleRate;
+        const int blockMs;
+        std::atomic<float> peak { 0.0f };
+        std::atomic<juce::int64> numSamplesPlayed { 0 };
+    };
+
+    bool waitForPort(int port, int timeoutMs)
+    {
+        const juce::uint32 deadline = juce::Time::getMillisecondCounter() + static_cast<juce::uint32>(timeoutMs);
+        while (juce::Time::getMillisecondCounter() < deadline) {
+            juce::StreamingSocket socket;
+            if (socket.connect("127.0.0.1", port, 100)) {
+                return true;
+            }
+            juce::Thread::sleep(50);
+        }
+        return false;
+    }
+
+    // Runs the message loop, as the host would, until done() or the timeout.
+    bool pumpUntil(const std::function<bool()>& done, int timeoutMs)
+    {
+        const juce::uint32 deadline = juce::Time::getMillisecondCounter() + static_cast<juce::uint32>(timeoutMs);
+        while (!done()) {
+            if (juce::Time::getMillisecondCounter() >= deadline) {
+                return false;
+            }
+            juce::MessageManager::getInstance()->runDispatchLoopUntil(10);
+        }
+        return true;
+    }
+
+    RiffusionVSTAudioProcessor::ProcessParams makeParams(const juce::String& serverAddress, int seed)
+    {
+        RiffusionVSTAudioProcessor::ProcessParams params;
+        params.serverAddress = serverAddress.toStdString();
+        params.promptA = "jazz piano";
+        params.promptB = "church organ";
+        params.alpha = 0.5f;
+        params.denoising = 0.75f;
+        params.guidance = 7.0f;
+        params.seed = seed;
+        params.numInferenceSteps = 10;
+        params.seedText = std::to_string(seed);
+        return params;
+    }
+}  // namespace
+
+//==============================================================================
+int main (int argc, char* argv[])
+{
+    const juce::ArgumentList args(argc, argv);
+    if (args.containsOption("--help|-h")) {
+        std::cout << kUsage;
+        return 0;
+    }
+   #if !RIFFUSION_RT_CHECKS
+    std::cerr << "Built without RIFFUSION_RT_CHECKS, so nothing would be checked. Use the RTChecks configuration." << std::endl;
+    return 1;
+   #endif
+    auto readOption = [&args](const char* option, double fallback) {
+        const juce::String value = args.getValueForOption(option);
+        return value.isNotEmpty() ? value.getDoubleValue() : fallback;
+    };
+    const int port = static_cast<int>(readOption("--port", kDefaultMockPort));
+    const int blockSize = static_cast<int>(readOption("--block-size", kDefaultBlockSize));
+    const double sampleRate = readOption("--sample-rate", kDefaultSampleRate);
+    const double speed = readOption("--speed", kDefaultSpeed);
+    const int generationTimeoutMs = static_cast<int>(readOption("--generation-timeout-ms", kDefaultGenerationTimeoutMs));
+
+    juce::String serverAddress = args.getValueForOption("--server");
+    juce::ChildProcess mockServer;
+    const juce::String mockServerPath = args.getValueForOption("--mock-server");
+    if (mockServerPath.isNotEmpty()) {
+        juce::StringArray command { mockServerPath, "--quiet", "--step-ms=1", "--port=" + juce::String(port) };
+        if (!mockServer.start(command, 0) || !waitForPort(port, kMockStartTimeoutMs)) {
+            std::cerr << "Couldn't start " << mockServerPath << std::endl;
+            return 1;
+        }
+        serverAddress = "http://127.0.0.1:" + juce::String(port);
+    }
+    if (serverAddress.isEmpty()) {
+        std::cerr << kUsage;
+        return 1;
+    }
+
+    // The processor's timer runs on this thread, as it would on the host's message thread.
+    juce::ScopedJuceInitialiser_GUI juceInitialiser;
+    bool passed = true;
+    {
+        RiffusionVSTAudioProcessor processor;
+        DriverPlayHead playHead(sampleRate);
+        processor.setPlayHead(&playHead);
+        processor.setRateAndBufferSizeDetails(sampleRate, blockSize);
+        processor.prepareToPlay(sampleRate, blockSize);
+        AudioThread audioThread(processor, playHead, blockSize, sampleRate, speed);
+        audioThread.startThread();
+
+        const double msPerAudioSecond = 1000.0 / speed;
+        // Runs the audio for a while, in audio time.
+        auto play = [&](double seconds) {
+            const juce::int64 until = audioThread.getNumSamplesPlayed() + static_cast<juce::int64>(seconds * sampleRate);
+            return pumpUntil([&] { return audioThread.getNumSamplesPlayed() >= until; },
+                juce::roundToInt(seconds * msPerAudioSecond) + kPhaseTimeoutMs);
+        };
+        auto phase = [&](const char* what, bool succeeded) {
+            const int violations = RealtimeSafetyChecker::getNumViolations();
+            std::cout << (succeeded ? "PASS " : "FAIL ") << what << " (" << violations << " violations so far)" << std::endl;
+            passed &= succeeded;
+        };
+        auto playAndCheck = [&](const char* what, RiffusionVSTAudioProcessor::PlayState state) {
+            processor.startPlaying(state);
+            audioThread.takePeak();
+            const bool played = play(kPlaySeconds);
+            const float peak = audioThread.takePeak();
+            processor.stopPlaying();
+            phase(what, played && peak > 0.0f);
+        };
+        auto generate = [&](int seed) {
+            processor.startGenerating(makeParams(serverAddress, seed));
+            const int numTakes = processor.getNumTakes();
+            const bool finished = pumpUntil([&] { return !processor.getIsGenerating(); }, generationTimeoutMs);
+            return finished && processor.getNumTakes() > numTakes;
+        };
+
+        // Nothing has asked for the buffers, so only the lookback is running.
+        phase("idle", play(kPlaySeconds));
+        // The grab asks for the buffers from the audio thread and waits for them.
+        processor.grabLookback();
+        const int grabCount = processor.getLookbackGrabCount();
+        phase("grab lookback", pumpUntil([&] { return processor.getLookbackGrabCount() > grabCount; }, kPhaseTimeoutMs));
+        // Stops by itself when the buffer is full.
+        processor.startRecording();
+        phase("record", pumpUntil([&] { return !processor.getIsRecording(); }, kPhaseTimeoutMs));
+        playAndCheck("play recorded", RiffusionVSTAudioProcessor::PlayState::PlayingRecorded);
+        phase("generate", generate(1));
+        playAndCheck("play generated", RiffusionVSTAudioProcessor::PlayState::PlayingGenerated);
+        // At another tempo, so the stretched take is asked for and swapped in.
+        processor.doesDAWControlTiming = true;
+        playHead.tempo = kStretchedTempo;
+        playAndCheck("play generated synced to the host", RiffusionVSTAudioProcessor::PlayState::PlayingGenerated);
+        processor.doesDAWControlTiming = false;
+        playHead.tempo = kTempo;
+        // A second take of the same recording, blended with the first.
+        phase("generate a second take", generate(2));
+        processor.getMorphParameter().setValueNotifyingHost(0.5f);
+        pumpUntil([&] { return processor.getNumMorphTakes() >= 2; }, kPhaseTimeoutMs);
+        playAndCheck("play morphed", RiffusionVSTAudioProcessor::PlayState::PlayingGenerated);
+        // Back to the first take, which now plays from the store.
+        processor.selectTake(0);
+        playAndCheck("play an older take", RiffusionVSTAudioProcessor::PlayState::PlayingGenerated);
+
+        audioThread.stopThread(kStopTimeoutMs);
+        processor.releaseResources();
+        processor.setPlayHead(nullptr);
+    }
+
+    const int violations = RealtimeSafetyChecker::getNumViolations();
+    if (violations > 0) {
+        std::cout << "FAIL processBlock made " << violations << " real-time safety violations" << std::endl;
+        passed = false;
+    }
+    if (mockServer.isRunning()) {
+        mockServer.kill();
+    }
+    return passed ? 0 : 1;
+}
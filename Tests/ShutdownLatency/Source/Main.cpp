@@ -0,0 +1,180 @@
+/*
+  ==============================================================================
+
+    Main.cpp
+    RiffusionShutdownTest: checks that the generation service lets go quickly
+    when the server never answers, as a plugin instance closing or the DAW
+    exiting needs it to.
+
+  ==============================================================================
+*/
+
+#include <JuceHeader.h>
+#include "../../../Source/GenerationService.h"
+
+#include <atomic>
+#include <iostream>
+#include <memory>
+
+namespace {
+    constexpr int kDefaultMockPort = 3099;
+    // Longer than this blocking the message thread is a visible hang.
+    constexpr int kDefaultMaxMs = 500;
+    // Long enough for a request to be sent and sitting on the server.
+    constexpr int kDefaultSettleMs = 500;
+    constexpr int kMockStartTimeoutMs = 5000;
+    constexpr double kRecordingSeconds = 5.0;
+    constexpr double kSampleRate = 44100.0;
+
+    const char* const kUsage =
+        "Usage: RiffusionShutdownTest [options]\n"
+        "\n"
+        "Submits requests to a server that never answers them, then times how long\n"
+        "unregistering a client and destroying the generation service take. Exits\n"
+        "with 1 if either takes longer than --max-ms.\n"
+        "\n"
+        "  --mock-server=<path>       Start this RiffusionMockServer with --hang-rate=1.\n"
+        "  --port=<n>                 Port for the mock server (default 3099).\n"
+        "  --server=<address>         Use a server that's already running instead. It\n"
+        "                             should hang every request (--hang-rate=1).\n"
+        "  --max-ms=<ms>              Longest either may take (default 500).\n"
+        "  --settle-ms=<ms>           Wait after submitting (default 500).\n";
+
+    GenerationService::Request makeRequest(const juce::String& serverAddress, int seed)
+    {
+        auto makePrompt = [seed](const char* prompt)
+        {
+            juce::DynamicObject::Ptr json = new juce::DynamicObject();
+            json->setProperty("prompt", prompt);
+            json->setProperty("seed", seed);
+            json->setProperty("denoising", 0.75);
+            json->setProperty("guidance", 7.0);
+            return juce::var(json.get());
+        };
+        juce::DynamicObject::Ptr params = new juce::DynamicObject();
+        params->setProperty("alpha", 0.5);
+        params->setProperty("num_inference_steps", 50);
+        params->setProperty("start", makePrompt("jazz piano"));
+        params->setProperty("end", makePrompt("church organ"));
+
+        GenerationService::Request request;
+        request.serverAddress = serverAddress;
+        request.params = juce::var(params.get());
+        request.sampleRate = kSampleRate;
+        request.audio.setSize(1, static_cast<int>(kRecordingSeconds * kSampleRate));
+        juce::Random random(seed);
+        for (int i = 0; i < request.audio.getNumSamples(); ++i) {
+            request.audio.setSample(0, i, random.nextFloat() * 0.2f - 0.1f);
+        }
+        return request;
+    }
+
+    bool waitForPort(int port, int timeoutMs)
+    {
+        const juce::uint32 deadline = juce::Time::getMillisecondCounter() + static_cast<juce::uint32>(timeoutMs);
+        while (juce::Time::getMillisecondCounter() < deadline) {
+            juce::StreamingSocket socket;
+            if (socket.connect("127.0.0.1", port, 100)) {
+                return true;
+            }
+            juce::Thread::sleep(50);
+        }
+        return false;
+    }
+
+    // Prints the result of one check, and returns whether it passed.
+    bool report(const char* what, double elapsedMs, int maxMs)
+    {
+        const bool passed = elapsedMs <= maxMs;
+        std::cout << (passed ? "PASS " : "FAIL ") << what << ": " << juce::String(elapsedMs, 1)
+                  << " ms (limit " << maxMs << " ms)" << std::endl;
+        return passed;
+    }
+}  // namespace
+
+//==============================================================================
+int main (int argc, char* argv[])
+{
+    const juce::ArgumentList args(argc, argv);
+    if (args.containsOption("--help|-h")) {
+        std::cout << kUsage;
+        return 0;
+    }
+    const juce::String maxMsOption = args.getValueForOption("--max-ms");
+    const juce::String settleMsOption = args.getValueForOption("--settle-ms");
+    const juce::String portOption = args.getValueForOption("--port");
+    const int maxMs = maxMsOption.isNotEmpty() ? maxMsOption.getIntValue() : kDefaultMaxMs;
+    const int settleMs = settleMsOption.isNotEmpty() ? settleMsOption.getIntValue() : kDefaultSettleMs;
+    const int port = portOption.isNotEmpty() ? portOption.getIntValue() : kDefaultMockPort;
+
+    juce::String serverAddress = args.getValueForOption("--server");
+    juce::ChildProcess mockServer;
+    const juce::String mockServerPath = args.getValueForOption("--mock-server");
+    if (mockServerPath.isNotEmpty()) {
+        juce::StringArray command { mockServerPath, "--hang-rate=1", "--quiet", "--port=" + juce::String(port) };
+        if (!mockServer.start(command, 0) || !waitForPort(port, kMockStartTimeoutMs)) {
+            std::cerr << "Couldn't start " << mockServerPath << std::endl;
+            return 1;
+        }
+        serverAddress = "http://127.0.0.1:" + juce::String(port);
+    }
+    if (serverAddress.isEmpty()) {
+        std::cerr << kUsage;
+        return 1;
+    }
+
+    bool passed = true;
+    auto service = std::make_unique<GenerationService>();
+    // Set once the first client has been unregistered, after which its callback must
+    // never fire.
+    std::atomic<bool> unregistered { false };
+    std::atomic<int> lateCallbacks { 0 };
+
+    // A plugin instance closing while its request hangs.
+    {
+        const int clientId = service->registerClient(std::make_shared<PerformanceTracer>());
+        service->submit(clientId, makeRequest(serverAddress, 1), [&](const GenerationService::Result&)
+        {
+            if (unregistered) {
+                ++lateCallbacks;
+            }
+        });
+        juce::Thread::sleep(settleMs);
+        const double start = juce::Time::getMillisecondCounterHiRes();
+        service->unregisterClient(clientId);
+        passed &= report("unregisterClient with a hung request", juce::Time::getMillisecondCounterHiRes() - start, maxMs);
+        unregistered = true;
+    }
+
+    // The last instance going away while every worker is stuck on the server, with
+    // speculative requests queued behind them.
+    {
+        for (int seed = 2; seed < 2 + GenerationService::kMaxConcurrentRequests; ++seed) {
+            const int clientId = service->registerClient(std::make_shared<PerformanceTracer>());
+            service->submit(clientId, makeRequest(serverAddress, seed), nullptr);
+            service->submitSpeculative(clientId, makeRequest(serverAddress, seed + 100));
+        }
+        juce::Thread::sleep(settleMs);
+        const double start = juce::Time::getMillisecondCounterHiRes();
+        service.reset();
+        passed &= report("~GenerationService with hung workers", juce::Time::getMillisecondCounterHiRes() - start, maxMs);
+    }
+
+    // And with nothing running at all.
+    {
+        service = std::make_unique<GenerationService>();
+        juce::Thread::sleep(settleMs);
+        const double start = juce::Time::getMillisecondCounterHiRes();
+        service.reset();
+        passed &= report("~GenerationService when idle", juce::Time::getMillisecondCounterHiRes() - start, maxMs);
+    }
+
+    if (lateCallbacks > 0) {
+        std::cout << "FAIL a callback fired after unregisterClient returned" << std::endl;
+        passed = false;
+    }
+    if (mockServer.isRunning()) {
+        mockServer.kill();
+    }
+    return passed ? 0 : 1;
+}